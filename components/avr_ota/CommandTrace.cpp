@@ -0,0 +1,92 @@
+#include "CommandTrace.h"
+
+#ifdef USE_AVR_OTA_TRACE
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace esphome {
+namespace avr_ota {
+
+void CommandTrace::begin(uint8_t command, const CommandTraceCounters_t &counters) {
+  this->current_.at = micros();
+  this->current_.command = command;
+  this->started_ = counters;
+  this->active_ = true;
+}
+
+void CommandTrace::end(const CommandTraceCounters_t &counters) {
+  if (!this->active_) return;
+  this->active_ = false;
+
+  CommandTraceEntry_t &entry = this->current_;
+  entry.total_us = micros() - entry.at;
+  entry.spi_us = counters.spi_us - this->started_.spi_us;
+  entry.wait_us = counters.wait_us - this->started_.wait_us;
+  // The command byte was read before begin()
+  entry.bytes_in = counters.rx_bytes - this->started_.rx_bytes + 1;
+  entry.bytes_out = counters.tx_bytes - this->started_.tx_bytes;
+  this->ring_[this->recorded_ % AVR_OTA_TRACE_SIZE] = entry;
+  this->recorded_++;
+
+  CommandTraceHistogram_t *h = this->histogram_(entry.command);
+  if (h == nullptr) return;
+  int bucket = 0;
+  while (bucket < COMMAND_TRACE_BUCKETS - 1 && entry.total_us >= (128u << bucket)) bucket++;
+  h->buckets[bucket]++;
+  h->count++;
+  h->total_us += entry.total_us;
+  if (entry.total_us > h->max_us)
+    h->max_us = entry.total_us;
+}
+
+// Find or add the histogram of a command. nullptr once the table is full
+CommandTraceHistogram_t *CommandTrace::histogram_(uint8_t command) {
+  for (int i = 0; i < this->histogram_count_; i++) {
+    if (this->histograms_[i].command == command)
+      return &this->histograms_[i];
+  }
+  if (this->histogram_count_ == COMMAND_TRACE_COMMANDS)
+    return nullptr;
+  CommandTraceHistogram_t *h = &this->histograms_[this->histogram_count_++];
+  memset(h, 0, sizeof(*h));
+  h->command = command;
+  return h;
+}
+
+void CommandTrace::dump(const char *tag) {
+  uint32_t count = std::min<uint32_t>(this->recorded_, AVR_OTA_TRACE_SIZE);
+  ESP_LOGI(tag, "Command trace: last %u of %u commands", count, this->recorded_);
+  ESP_LOGI(tag, "  cmd    at(us)   total     spi    wait    in   out");
+  for (uint32_t i = this->recorded_ - count; i < this->recorded_; i++) {
+    const CommandTraceEntry_t &e = this->ring_[i % AVR_OTA_TRACE_SIZE];
+    ESP_LOGI(tag, "  0x%02x %9u %7u %7u %7u %5u %5u", e.command, e.at, e.total_us, e.spi_us, e.wait_us, e.bytes_in,
+             e.bytes_out);
+  }
+
+  ESP_LOGI(tag, "Command latency (buckets from <128us, doubling):");
+  for (int i = 0; i < this->histogram_count_; i++) {
+    const CommandTraceHistogram_t &h = this->histograms_[i];
+    char buckets[COMMAND_TRACE_BUCKETS * 6 + 1];
+    int len = 0;
+    for (int b = 0; b < COMMAND_TRACE_BUCKETS; b++)
+      len += snprintf(buckets + len, sizeof(buckets) - len, " %u", h.buckets[b]);
+    ESP_LOGI(tag, "  0x%02x n=%u avg=%uus max=%uus |%s", h.command, h.count, h.total_us / h.count, h.max_us,
+             buckets);
+  }
+}
+
+void CommandTrace::clear() {
+  this->recorded_ = 0;
+  this->histogram_count_ = 0;
+  this->active_ = false;
+}
+
+}  // namespace avr_ota
+}  // namespace esphome
+
+#endif
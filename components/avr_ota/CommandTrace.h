@@ -0,0 +1,86 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#include <cstdint>
+
+// Tracing of programmer commands, compiled in by setting trace_size. When
+// it is off AVRISP_TRACE() drops its arguments and nothing is recorded
+#ifdef USE_AVR_OTA_TRACE
+#define AVRISP_TRACE(...) __VA_ARGS__
+#else
+#define AVRISP_TRACE(...)
+#endif
+
+#ifdef USE_AVR_OTA_TRACE
+
+namespace esphome {
+namespace avr_ota {
+
+// Distinct command bytes with a latency histogram. Further commands are
+// still recorded in the ring but not in a histogram
+static const int COMMAND_TRACE_COMMANDS = 16;
+
+// Histogram buckets. Bucket i counts commands that took less than
+// 128 << i microseconds, the last one everything slower
+static const int COMMAND_TRACE_BUCKETS = 12;
+
+// A traced command
+typedef struct {
+    uint32_t at;          // micros() when the command byte arrived
+    uint32_t total_us;    // time until the reply was sent
+    uint32_t spi_us;      // time in SPI transfers
+    uint32_t wait_us;     // time waiting for more data from the client
+    uint16_t bytes_in;    // bytes received, including the command byte
+    uint16_t bytes_out;   // bytes replied
+    uint8_t command;      // stk500v1 or stk500v2 command byte, 0xA5 for native uploads
+} CommandTraceEntry_t;
+
+// Per command latency histogram
+typedef struct {
+    uint8_t command;
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint16_t buckets[COMMAND_TRACE_BUCKETS];
+} CommandTraceHistogram_t;
+
+// The counters a command is measured against. The owner keeps them running
+typedef struct {
+    uint32_t spi_us;
+    uint32_t wait_us;
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+} CommandTraceCounters_t;
+
+// Records the last AVR_OTA_TRACE_SIZE commands in a ring and keeps a
+// latency histogram per command. Recording only copies counters, all
+// formatting is left to dump()
+class CommandTrace {
+ public:
+  void begin(uint8_t command, const CommandTraceCounters_t &counters);
+  // Replace the command byte of the command being traced
+  void set_command(uint8_t command) { this->current_.command = command; }
+  void end(const CommandTraceCounters_t &counters);
+
+  // Log the ring, oldest first, and the histograms
+  void dump(const char *tag);
+  void clear();
+
+ protected:
+  CommandTraceHistogram_t *histogram_(uint8_t command);
+
+  CommandTraceEntry_t ring_[AVR_OTA_TRACE_SIZE];
+  uint32_t recorded_{0};  // commands recorded since clear(), the ring holds the last ones
+  CommandTraceHistogram_t histograms_[COMMAND_TRACE_COMMANDS];
+  int histogram_count_{0};
+
+  CommandTraceEntry_t current_;
+  CommandTraceCounters_t started_;
+  bool active_{false};
+};
+
+}  // namespace avr_ota
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,82 @@
+#include "EngineTask.h"
+#include "esphome/core/application.h"
+#include "esphome/core/log.h"
+
+#ifdef USE_AVR_OTA_TASK
+#ifdef USE_ESP32
+#include <esp_task_wdt.h>
+#endif
+#endif
+
+namespace esphome {
+namespace avr_ota {
+
+static const char *TAG = "avr_ota.engine_task";
+
+#ifdef USE_AVR_OTA_TASK
+
+// Set in the engine task, App.feed_wdt() belongs to the main loop
+static thread_local bool in_engine_task = false;
+
+void EngineTask::run_(void *task) {
+  EngineTask *self = (EngineTask *) task;
+  in_engine_task = true;
+#ifdef USE_ESP32
+  // Watched like the main loop, the engine feeds it while it works
+  esp_task_wdt_add(nullptr);
+#endif
+  self->fn_(self->arg_);
+}
+
+bool EngineTask::start(const char *name, void (*fn)(void *), void *arg) {
+  if (this->running_)
+    return false;
+  this->fn_ = fn;
+  this->arg_ = arg;
+  // Set first, the task may run before the create call returns
+  this->running_ = true;
+
+#ifdef USE_ESP32
+  // Keep off the core running the main loop where there is a second one,
+  // so neither waits for the other at the same priority
+  this->core_ = portNUM_PROCESSORS > 1 ? 1 - xPortGetCoreID() : 0;
+  TaskHandle_t handle;
+  if (xTaskCreatePinnedToCore(EngineTask::run_, name, ENGINE_TASK_STACK_SIZE, this, 1, &handle, this->core_) !=
+      pdPASS) {
+    ESP_LOGW(TAG, "Could not create task %s", name);
+    this->running_ = false;
+    this->core_ = -1;
+    return false;
+  }
+#else
+  std::thread(EngineTask::run_, this).detach();
+#endif
+  ESP_LOGD(TAG, "Started task %s", name);
+  return true;
+}
+
+void EngineTask::feed_wdt() {
+  if (!in_engine_task) {
+    App.feed_wdt();
+    return;
+  }
+#ifdef USE_ESP32
+  esp_task_wdt_reset();
+#endif
+}
+
+#else
+
+bool EngineTask::start(const char *, void (*)(void *), void *) {
+  ESP_LOGW(TAG, "Engine task is not compiled in, set dedicated_task to enable it");
+  return false;
+}
+
+void EngineTask::feed_wdt() { App.feed_wdt(); }
+
+void EngineTask::run_(void *) {}
+
+#endif
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#include <cstdint>
+
+#ifdef USE_AVR_OTA_TASK
+#ifdef USE_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#endif
+#endif
+
+namespace esphome {
+namespace avr_ota {
+
+// Stack of the engine task in bytes
+static const uint32_t ENGINE_TASK_STACK_SIZE = 6144;
+
+// Runs the programmer engine off the main loop: a FreeRTOS task pinned to
+// the core the loop isn't running on on the ESP32, a std::thread on the
+// host. start() has to be called from the main loop. Only compiled in with
+// dedicated_task
+class EngineTask {
+ public:
+  // Start fn(arg) in a new task that runs until reboot. Returns false if it
+  // could not be created or tasks are not compiled in
+  bool start(const char *name, void (*fn)(void *), void *arg);
+  bool is_running() { return this->running_; }
+  // Core the task is pinned to, -1 if not pinned
+  int get_core() { return this->core_; }
+
+  // Feed the watchdog of whichever context the engine is running in
+  static void feed_wdt();
+
+ protected:
+  bool running_{false};
+  int core_{-1};
+  void (*fn_)(void *){nullptr};
+  void *arg_{nullptr};
+
+  static void run_(void *task);
+};
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -0,0 +1,82 @@
+#include "Heatshrink.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace avr_ota {
+
+bool Heatshrink::begin(uint8_t window_bits, uint8_t lookahead_bits) {
+  // The same limits as the heatshrink encoder
+  if (window_bits < 4 || window_bits > HEATSHRINK_MAX_WINDOW_BITS || lookahead_bits < 3 ||
+      lookahead_bits >= window_bits)
+    return false;
+  this->window_bits_ = window_bits;
+  this->lookahead_bits_ = lookahead_bits;
+  this->mask_ = (1u << window_bits) - 1;
+  // References before the start of the stream read zeros
+  memset(this->window_, 0, 1u << window_bits);
+  this->pos_ = 0;
+  this->state_ = HeatshrinkTag;
+  this->bits_ = 0;
+  this->bit_count_ = 0;
+  this->decoded_ = 0;
+  return true;
+}
+
+void Heatshrink::emit_(uint8_t byte) {
+  this->window_[this->pos_ & this->mask_] = byte;
+  this->pos_++;
+  this->decoded_++;
+}
+
+// Remove the oldest n pending bits
+uint32_t Heatshrink::take_(int n) {
+  this->bit_count_ -= n;
+  uint32_t value = (this->bits_ >> this->bit_count_) & ((1u << n) - 1);
+  this->bits_ &= (1u << this->bit_count_) - 1;
+  return value;
+}
+
+int Heatshrink::push(uint8_t byte) {
+  // At most window_bits - 1 bits are left over, so this never overflows
+  this->bits_ = this->bits_ << 8 | byte;
+  this->bit_count_ += 8;
+
+  int produced = 0;
+  while (true) {
+    switch (this->state_) {
+      case HeatshrinkTag:
+        if (this->bit_count_ < 1)
+          return produced;
+        this->state_ = take_(1) ? HeatshrinkLiteral : HeatshrinkIndex;
+        break;
+      case HeatshrinkLiteral:
+        if (this->bit_count_ < 8)
+          return produced;
+        emit_(take_(8));
+        produced++;
+        this->state_ = HeatshrinkTag;
+        break;
+      case HeatshrinkIndex:
+        if (this->bit_count_ < this->window_bits_)
+          return produced;
+        this->index_ = take_(this->window_bits_) + 1;
+        this->state_ = HeatshrinkCount;
+        break;
+      case HeatshrinkCount: {
+        if (this->bit_count_ < this->lookahead_bits_)
+          return produced;
+        // Byte by byte, the reference may overlap what it produces
+        uint32_t count = take_(this->lookahead_bits_) + 1;
+        for (uint32_t i = 0; i < count; i++)
+          emit_(this->window_[(this->pos_ - this->index_) & this->mask_]);
+        produced += count;
+        this->state_ = HeatshrinkTag;
+        break;
+      }
+    }
+  }
+}
+
+}  // namespace avr_ota
+}  // namespace esphome
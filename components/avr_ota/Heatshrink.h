@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+namespace avr_ota {
+
+// Largest window the decoder keeps, as a power of two. Streams compressed
+// with a larger window are refused
+static const int HEATSHRINK_MAX_WINDOW_BITS = 10;
+
+// Streaming heatshrink (LZSS) decoder with a fixed window. Every decoded
+// byte goes through the window, so after push() the bytes it produced are
+// the last ones written there and output() reads them back in place
+class Heatshrink {
+ public:
+  // Start a new stream. Returns false if the parameters are unsupported
+  bool begin(uint8_t window_bits, uint8_t lookahead_bits);
+
+  // Decode one compressed byte. Returns the number of bytes it produced,
+  // at most (1 << lookahead_bits) + 1
+  int push(uint8_t byte);
+  // Byte i of the n produced by the last push()
+  uint8_t output(int i, int n) { return this->window_[(this->pos_ - n + i) & this->mask_]; }
+
+  // Bytes produced since begin()
+  uint32_t get_decoded() { return this->decoded_; }
+
+ protected:
+  typedef enum {
+      HeatshrinkTag = 0,  // next bit selects a literal or a back reference
+      HeatshrinkLiteral,  // 8 bits of literal
+      HeatshrinkIndex,    // window_bits of distance - 1
+      HeatshrinkCount,    // lookahead_bits of length - 1
+  } HeatshrinkState_t;
+
+  void emit_(uint8_t byte);
+  uint32_t take_(int n);
+
+  uint8_t window_[1 << HEATSHRINK_MAX_WINDOW_BITS];
+  uint32_t mask_{0};
+  uint32_t pos_{0};  // next window position, wraps through mask_
+  int window_bits_{0};
+  int lookahead_bits_{0};
+
+  HeatshrinkState_t state_{HeatshrinkTag};
+  uint32_t bits_{0};   // pending input bits, the oldest is the most significant
+  int bit_count_{0};
+  uint32_t index_{0};
+  uint32_t decoded_{0};
+};
+
+}  // namespace avr_ota
+}  // namespace esphome
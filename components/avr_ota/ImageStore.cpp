@@ -0,0 +1,224 @@
+#include "ImageStore.h"
+#include "esphome/core/log.h"
+
+#include <cstring>
+
+#ifdef USE_ESP32
+#include <esp_rom_crc.h>
+#endif
+
+namespace esphome {
+namespace avr_ota {
+
+static const char *TAG = "avr_ota.image_store";
+
+// Flash is erased a sector at a time
+static const uint32_t IMAGE_STORE_SECTOR = 4096;
+
+#ifdef USE_ESP32
+
+bool ImageStore::setup() {
+  this->partition_ =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, this->label_.c_str());
+  if (this->partition_ == nullptr) {
+    ESP_LOGW(TAG, "Partition '%s' not found, images will not be stored", this->label_.c_str());
+    return false;
+  }
+  // Two slots, each a whole number of sectors
+  this->slot_size_ = (this->partition_->size / 2) & ~(IMAGE_STORE_SECTOR - 1);
+  if (this->slot_size_ < IMAGE_STORE_SECTOR) {
+    ESP_LOGW(TAG, "Partition '%s' is too small", this->label_.c_str());
+    this->partition_ = nullptr;
+    this->slot_size_ = 0;
+    return false;
+  }
+  return true;
+}
+
+bool ImageStore::is_available() { return this->partition_ != nullptr; }
+
+// Returns the slot holding the newest complete image, or -1 if there is none
+int ImageStore::current_slot_(ImageHeader_t *header) {
+  int found = -1;
+  for (int slot = 0; slot < 2; slot++) {
+    ImageHeader_t h;
+    if (esp_partition_read(this->partition_, slot * this->slot_size_, &h, sizeof(h)) != ESP_OK)
+      continue;
+    if (h.magic != IMAGE_STORE_MAGIC || sizeof(h) + h.length > this->slot_size_)
+      continue;
+    if (found < 0 || h.sequence > header->sequence) {
+      *header = h;
+      found = slot;
+    }
+  }
+  return found;
+}
+
+// Erase the slot being recorded up to end, a sector at a time as the image grows
+bool ImageStore::erase_(uint32_t end) {
+  uint32_t base = this->slot_ * this->slot_size_;
+  while (this->erased_ < end) {
+    if (esp_partition_erase_range(this->partition_, base + this->erased_, IMAGE_STORE_SECTOR) != ESP_OK)
+      return false;
+    this->erased_ += IMAGE_STORE_SECTOR;
+  }
+  return true;
+}
+
+bool ImageStore::write_(uint32_t offset, const void *data, uint32_t length) {
+  if (!this->erase_(offset + length))
+    return false;
+  return esp_partition_write(this->partition_, this->slot_ * this->slot_size_ + offset, data, length) == ESP_OK;
+}
+
+bool ImageStore::begin(uint32_t signature, uint32_t pagesize) {
+  if (this->partition_ == nullptr || this->state_ != ImageStoreIdle)
+    return false;
+
+  ImageHeader_t current;
+  int slot = this->current_slot_(&current);
+  this->slot_ = slot == 0 ? 1 : 0;
+  this->sequence_ = slot < 0 ? 1 : current.sequence + 1;
+
+  // The header stays erased until commit()
+  memset(&this->header_, 0, sizeof(this->header_));
+  this->header_.sequence = this->sequence_;
+  this->header_.signature = signature;
+  this->header_.pagesize = pagesize;
+  this->offset_ = sizeof(ImageHeader_t);
+  this->erased_ = 0;
+  if (!this->erase_(sizeof(ImageHeader_t))) {
+    ESP_LOGW(TAG, "Could not erase slot %d", this->slot_);
+    this->state_ = ImageStoreFailed;
+    return false;
+  }
+
+  ESP_LOGD(TAG, "Recording image %u into slot %d", this->sequence_, this->slot_);
+  this->state_ = ImageStoreRecording;
+  return true;
+}
+
+bool ImageStore::append(uint32_t addr, const uint8_t *data, uint32_t length) {
+  if (this->state_ != ImageStoreRecording)
+    return false;
+
+  uint32_t padded = (length + 3) & ~3u;
+  if (this->offset_ + sizeof(ImageRecord_t) + padded > this->slot_size_) {
+    ESP_LOGW(TAG, "Image does not fit in %u bytes, not storing it", this->slot_size_);
+    this->state_ = ImageStoreFailed;
+    return false;
+  }
+
+  ImageRecord_t record = {addr, length};
+  bool ok = this->write_(this->offset_, &record, sizeof(record));
+  this->header_.crc = esp_rom_crc32_le(this->header_.crc, (const uint8_t *) &record, sizeof(record));
+  this->offset_ += sizeof(record);
+
+  // esp_partition_write() takes any length, padding is left erased
+  ok = ok && this->write_(this->offset_, data, length);
+  this->header_.crc = esp_rom_crc32_le(this->header_.crc, data, length);
+  if (padded > length) {
+    static const uint8_t PAD[3] = {0xFF, 0xFF, 0xFF};
+    ok = ok && this->write_(this->offset_ + length, PAD, padded - length);
+    this->header_.crc = esp_rom_crc32_le(this->header_.crc, PAD, padded - length);
+  }
+  this->offset_ += padded;
+
+  if (!ok) {
+    ESP_LOGW(TAG, "Flash write failed, not storing the image");
+    this->state_ = ImageStoreFailed;
+    return false;
+  }
+  this->header_.records++;
+  return true;
+}
+
+bool ImageStore::commit() {
+  if (this->state_ != ImageStoreRecording)
+    return false;
+  this->state_ = ImageStoreIdle;
+  if (this->header_.records == 0)
+    return false;
+
+  this->header_.length = this->offset_ - sizeof(ImageHeader_t);
+  this->header_.magic = IMAGE_STORE_MAGIC;
+  if (!this->write_(0, &this->header_, sizeof(this->header_))) {
+    ESP_LOGW(TAG, "Could not write the image header");
+    return false;
+  }
+  ESP_LOGI(TAG, "Stored image %u: %u pages, %u bytes", this->header_.sequence, this->header_.records,
+           this->header_.length);
+  return true;
+}
+
+void ImageStore::fail() {
+  if (this->state_ == ImageStoreRecording)
+    ESP_LOGW(TAG, "Programming failed, not storing image %u", this->sequence_);
+  this->state_ = ImageStoreFailed;
+}
+
+void ImageStore::abort() {
+  if (this->state_ == ImageStoreRecording)
+    ESP_LOGD(TAG, "Dropping incomplete image %u", this->sequence_);
+  this->state_ = ImageStoreIdle;
+}
+
+bool ImageStore::open(ImageHeader_t *header, const uint8_t **records) {
+  if (this->partition_ == nullptr || this->mapped_)
+    return false;
+
+  int slot = this->current_slot_(header);
+  if (slot < 0) {
+    ESP_LOGW(TAG, "No stored image");
+    return false;
+  }
+
+  // Map the slot so the records are read straight from flash
+  const void *ptr;
+  if (esp_partition_mmap(this->partition_, slot * this->slot_size_, sizeof(ImageHeader_t) + header->length,
+                         ESP_PARTITION_MMAP_DATA, &ptr, &this->mmap_handle_) != ESP_OK) {
+    ESP_LOGW(TAG, "Could not map slot %d", slot);
+    return false;
+  }
+  this->mapped_ = true;
+
+  *records = (const uint8_t *) ptr + sizeof(ImageHeader_t);
+  if (esp_rom_crc32_le(0, *records, header->length) != header->crc) {
+    ESP_LOGW(TAG, "Stored image %u failed its CRC check", header->sequence);
+    this->close();
+    return false;
+  }
+  return true;
+}
+
+void ImageStore::close() {
+  if (!this->mapped_)
+    return;
+  esp_partition_munmap(this->mmap_handle_);
+  this->mapped_ = false;
+}
+
+#else
+
+// Without partitions there is nowhere to keep an image
+
+bool ImageStore::setup() {
+  ESP_LOGW(TAG, "Image store is only supported on the ESP32");
+  return false;
+}
+bool ImageStore::is_available() { return false; }
+int ImageStore::current_slot_(ImageHeader_t *) { return -1; }
+bool ImageStore::erase_(uint32_t) { return false; }
+bool ImageStore::write_(uint32_t, const void *, uint32_t) { return false; }
+bool ImageStore::begin(uint32_t, uint32_t) { return false; }
+bool ImageStore::append(uint32_t, const uint8_t *, uint32_t) { return false; }
+bool ImageStore::commit() { return false; }
+void ImageStore::fail() { this->state_ = ImageStoreFailed; }
+void ImageStore::abort() { this->state_ = ImageStoreIdle; }
+bool ImageStore::open(ImageHeader_t *, const uint8_t **) { return false; }
+void ImageStore::close() {}
+
+#endif
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "esphome/core/defines.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef USE_ESP32
+#include <esp_partition.h>
+#endif
+
+namespace esphome {
+namespace avr_ota {
+
+// "AVRI", written last so a torn image is never taken for a complete one
+static const uint32_t IMAGE_STORE_MAGIC = 0x49525641;
+
+// Each slot starts with this header, followed by the page records
+typedef struct {
+    uint32_t magic;      // IMAGE_STORE_MAGIC once the image is complete
+    uint32_t sequence;   // the valid slot with the highest sequence is current
+    uint32_t signature;  // device signature of the programmed part
+    uint32_t pagesize;   // flash page size in bytes
+    uint32_t records;    // number of page records
+    uint32_t length;     // bytes of records following the header
+    uint32_t crc;        // crc32 of the records
+    uint32_t reserved;
+} ImageHeader_t;
+
+// A page record: the byte address and length of the data that follows.
+// The data is padded to a multiple of four bytes
+typedef struct {
+    uint32_t addr;
+    uint32_t length;
+} ImageRecord_t;
+
+typedef enum {
+    ImageStoreIdle = 0,   // not recording
+    ImageStoreRecording,  // pages are being appended to the free slot
+    ImageStoreFailed,     // the recording was dropped, nothing more is stored this session
+} ImageStoreState_t;
+
+// Keeps the last programmed flash image in a data partition. The partition
+// is split into two slots so a new image never overwrites the current one
+// until it is complete. Only available on the ESP32
+class ImageStore {
+ public:
+  // Label of the data partition, from the partition table
+  void set_label(const std::string &label) { this->label_ = label; }
+  const std::string &get_label() { return this->label_; }
+
+  // Find the partition. Returns false if it doesn't exist
+  bool setup();
+  bool is_available();
+
+  // Start recording an image into the free slot
+  bool begin(uint32_t signature, uint32_t pagesize);
+  // Add the data of one page, addr is a byte address
+  bool append(uint32_t addr, const uint8_t *data, uint32_t length);
+  // Complete the recording, the image becomes the current one
+  bool commit();
+  // Stop recording for the rest of the session, the image is incomplete
+  void fail();
+  // Drop an incomplete recording and reset to idle
+  void abort();
+  ImageStoreState_t get_state() { return this->state_; }
+
+  // Map the current image into memory and check its CRC. records points at
+  // the first record and stays valid until close()
+  bool open(ImageHeader_t *header, const uint8_t **records);
+  void close();
+
+  // Size of each slot in bytes, 0 if there is no partition
+  uint32_t get_slot_size() { return this->slot_size_; }
+
+ protected:
+  bool erase_(uint32_t end);
+  bool write_(uint32_t offset, const void *data, uint32_t length);
+  int current_slot_(ImageHeader_t *header);
+
+  std::string label_;
+  ImageStoreState_t state_{ImageStoreIdle};
+  uint32_t slot_size_{0};
+
+  // recording state
+  int slot_{0};
+  uint32_t sequence_{0};
+  uint32_t offset_{0};   // next write offset within the slot
+  uint32_t erased_{0};   // bytes of the slot erased so far
+  ImageHeader_t header_{};
+
+#ifdef USE_ESP32
+  const esp_partition_t *partition_{nullptr};
+  esp_partition_mmap_handle_t mmap_handle_{};
+  bool mapped_{false};
+#endif
+};
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace esphome {
+namespace avr_ota {
+
+// Fixed size lock-free queue between exactly one producer and one consumer
+// thread. Holds N - 1 items
+template<typename T, size_t N> class SpscQueue {
+ public:
+  // Producer side. Returns false if the queue is full
+  bool push(const T &item) {
+    size_t head = this->head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) % N;
+    if (next == this->tail_.load(std::memory_order_acquire))
+      return false;
+    this->items_[head] = item;
+    this->head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the queue is empty
+  bool pop(T *item) {
+    size_t tail = this->tail_.load(std::memory_order_relaxed);
+    if (tail == this->head_.load(std::memory_order_acquire))
+      return false;
+    *item = this->items_[tail];
+    this->tail_.store((tail + 1) % N, std::memory_order_release);
+    return true;
+  }
+
+ protected:
+  T items_[N];
+  std::atomic<size_t> head_{0};  // next slot to write, owned by the producer
+  std::atomic<size_t> tail_{0};  // next slot to read, owned by the consumer
+};
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -1,8 +1,11 @@
 #include "esphome/core/log.h"
 #include "WebSocket.h"
+#include "EngineTask.h"
 #include "esphome/components/network/util.h"
 #include "esphome/core/application.h"
 
+#include <algorithm>
+
 namespace esphome {
 namespace avr_ota {
 
@@ -52,11 +55,13 @@ bool WebSocket::start() {
   }
   
   this->status = WebSocketIdle;
+  WebSocketListener::add(this);
   ESP_LOGI(TAG, "Socket Started - Idle");
   return true;
 }
 
 void WebSocket::stop() {
+    WebSocketListener::remove(this);
     if (this->client_ != nullptr) {
         this->client_->close();
         this->client_ = nullptr;
@@ -70,6 +75,14 @@ void WebSocket::close() {
   status = WebSocketIdle;
   this->client_->close();
   this->client_ = nullptr;
+  this->reset_buffers_();
+}
+
+// Drop any buffered data left over from the previous client
+void WebSocket::reset_buffers_() {
+  this->rx_pos_ = 0;
+  this->rx_len_ = 0;
+  this->tx_len_ = 0;
 }
 
 
@@ -78,15 +91,24 @@ bool WebSocket::handle() {
     // The web socket has not been started. Do nothing
     if (status == WebSocketShutdown) return false;
 
+    WebSocketListener::poll(this);
+
     // We are already connected to a client. Check to see if the web socket is still active
-    else if (status == WebSocketConnected) {
-        // TODO: Not sure how to do this
+    if (status == WebSocketConnected) {
+        // Turn away anyone else straight away rather than leaving them in the backlog
+        if (this->listen_ready_) this->reject_();
+        // A readable socket with nothing buffered is either new data or the
+        // peer going away. Find out now, so a lost client is noticed this loop
+        if (this->client_ready_ && this->rx_pos_ == this->rx_len_ && !this->peek_()) {
+            this->close();
+            ESP_LOGI(TAG, "Client disconnected");
+        }
         return false;
     }
 
     // We are not connected to a client. See if we can establish a new connection
     else if (status == WebSocketIdle) {
-        if (client_ == nullptr) {
+        if (client_ == nullptr && this->listen_ready_) {
             struct sockaddr_storage source_addr;
             socklen_t addr_len = sizeof(source_addr);
             client_ = server_->accept((struct sockaddr *) &source_addr, &addr_len);
@@ -96,6 +118,11 @@ bool WebSocket::handle() {
 
         // Mark this as an active connection
         status = WebSocketConnected;
+        this->reset_buffers_();
+        // Every client starts without an estimate
+        this->srtt_us_ = 0;
+        this->rttvar_us_ = 0;
+        this->rtt_pending_ = false;
 
         int enable = 1;
         int err = client_->setsockopt(IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
@@ -103,6 +130,12 @@ bool WebSocket::handle() {
             ESP_LOGW(TAG, "Socket could not enable TCP nodelay, errno %d", errno);
             // return;
         }
+        this->set_keepalive_();
+        // peek_() and readall_() expect EAGAIN rather than to wait. Accepted
+        // sockets don't reliably inherit that from the listener
+        err = client_->setblocking(false);
+        if (err != 0)
+            ESP_LOGW(TAG, "Socket could not set nonblocking mode, errno %d", errno);
 
         return true;
     }
@@ -128,51 +161,252 @@ bool WebSocket::read_bytes(uint8_t *buf, size_t len) {
     return res;
 }
 
-// Write a single byte to the socket
+// Queue a single byte for the socket
 bool WebSocket::write(char b) {
   if (this->status != WebSocketConnected) return false;
 
     uint8_t buf[1] = { b };
-    bool res = this->writeall_(buf, 1);
-    if (!res) this->close();
-    return res;
+    return this->queue_(buf, 1);
 }
 
-// Write a single byte to the socket
+// Queue len bytes for the socket
 bool WebSocket::write_bytes(uint8_t *buf, size_t len) {
     if (this->status != WebSocketConnected) return false;
 
-    bool res = this->writeall_(buf, len);
-    if (!res) this->close();
-    return res;
+    return this->queue_(buf, len);
 }
 
-// Write a char array to the socket
+// Queue a char array for the socket
 bool WebSocket::print(const char* buf) {
-    bool res = this->writeall_((const uint8_t *)buf, strlen(buf));
-    if (!res) this->close();
-    return res;
+    if (this->status != WebSocketConnected) return false;
+
+    return this->queue_((const uint8_t *)buf, strlen(buf));
+}
+
+// Send everything queued by write(), write_bytes() and print()
+bool WebSocket::flush() {
+    if (this->status != WebSocketConnected) return false;
+    if (this->tx_len_ == 0) return true;
+
+    bool res = this->writeall_(this->tx_buf_, this->tx_len_);
+    this->tx_len_ = 0;
+    if (!res) {
+        this->close();
+        return false;
+    }
+    // The client answers this, time it unless data is already waiting
+    this->rtt_pending_ = this->rx_pos_ == this->rx_len_;
+    this->flushed_us_ = micros();
+    return true;
+}
+
+// Read whatever the client has sent into the empty receive buffer, without
+// waiting. Returns false if the peer has closed the connection or it failed.
+// Finding nothing clears the readiness, it was from before the data was read
+bool WebSocket::peek_() {
+  ssize_t read = this->client_->read(this->rx_buf_, sizeof(this->rx_buf_));
+  if (read == 0)
+    return false;
+  if (read == -1) {
+    this->client_ready_ = false;
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  this->rx_pos_ = 0;
+  this->rx_len_ = read;
+  if (this->rtt_pending_)
+    this->rtt_sample_(micros() - this->flushed_us_);
+  return true;
+}
+
+// Fold a round trip into the estimate the way TCP does (RFC 6298). Gaps
+// longer than the ceiling are the client pausing, not the network
+void WebSocket::rtt_sample_(uint32_t rtt_us) {
+  this->rtt_pending_ = false;
+  if (rtt_us > this->timeout_max_ * 1000) return;
+  if (this->srtt_us_ == 0) {
+    this->srtt_us_ = std::max<uint32_t>(rtt_us, 1);
+    this->rttvar_us_ = rtt_us / 2;
+    return;
+  }
+  uint32_t delta = rtt_us > this->srtt_us_ ? rtt_us - this->srtt_us_ : this->srtt_us_ - rtt_us;
+  this->rttvar_us_ = (3 * this->rttvar_us_ + delta) / 4;
+  this->srtt_us_ = std::max<uint32_t>((7 * this->srtt_us_ + rtt_us) / 8, 1);
+}
+
+uint32_t WebSocket::get_timeout() const {
+  uint32_t timeout = WEB_SOCKET_TIMEOUT_INITIAL;
+  if (this->srtt_us_ != 0)
+    timeout = (this->srtt_us_ + 4 * this->rttvar_us_) / 1000;
+  return std::min(std::max(timeout, this->timeout_min_), this->timeout_max_);
+}
+
+// Have the stack probe a silent client, so a host that vanished without
+// closing the connection is dropped after a few seconds
+void WebSocket::set_keepalive_() {
+  int enable = 1;
+  if (this->client_->setsockopt(SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int)) != 0) {
+    ESP_LOGW(TAG, "Socket could not enable keepalive, errno %d", errno);
+    return;
+  }
+#ifdef TCP_KEEPIDLE
+  int idle = WEB_SOCKET_KEEPALIVE_IDLE, interval = WEB_SOCKET_KEEPALIVE_INTERVAL,
+      count = WEB_SOCKET_KEEPALIVE_COUNT;
+  this->client_->setsockopt(IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int));
+  this->client_->setsockopt(IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+  this->client_->setsockopt(IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(int));
+#endif
 }
 
 bool WebSocket::is_running() { 
   return this->status != WebSocketShutdown;
 }
 
+bool WebSocket::available() {
+  if (this->status != WebSocketConnected) return false;
+  if (this->rx_pos_ < this->rx_len_) return true;
+  if (!this->client_ready_) return false;
+  // The readiness may come from a select() that ran before the data it saw
+  // was read. Look again, a closed peer counts as readable
+  return !this->peek_() || this->rx_pos_ < this->rx_len_;
+}
+
+// Accept a waiting client, send it the busy reply and close it
+void WebSocket::reject_() {
+  struct sockaddr_storage source_addr;
+  socklen_t addr_len = sizeof(source_addr);
+  auto other = this->server_->accept((struct sockaddr *) &source_addr, &addr_len);
+  if (other == nullptr) return;
+
+  ESP_LOGW(TAG, "Busy, rejecting client %s", other->getpeername().c_str());
+  if (this->busy_reply_ != nullptr)
+    other->write(this->busy_reply_, this->busy_reply_len_);
+  other->close();
+}
+
+std::vector<WebSocket *> WebSocketListener::sockets_;
+uint32_t WebSocketListener::generation_ = 0;
+
+// Engine tasks of several instances share the listener
+#ifdef USE_AVR_OTA_TASK
+Mutex WebSocketListener::lock_;
+#define WEB_SOCKET_LISTENER_LOCK() LockGuard guard(lock_)
+#else
+#define WEB_SOCKET_LISTENER_LOCK()
+#endif
+
+void WebSocketListener::add(WebSocket *socket) {
+  WEB_SOCKET_LISTENER_LOCK();
+  for (auto *s : sockets_) {
+    if (s == socket) return;
+  }
+  sockets_.push_back(socket);
+  socket->generation_ = generation_;
+}
+
+void WebSocketListener::remove(WebSocket *socket) {
+  WEB_SOCKET_LISTENER_LOCK();
+  for (size_t i = 0; i < sockets_.size(); i++) {
+    if (sockets_[i] == socket) {
+      sockets_.erase(sockets_.begin() + i);
+      return;
+    }
+  }
+}
+
+#ifdef USE_SOCKET_IMPL_LWIP_TCP
+// Raw lwip sockets have no descriptors to select() on
+void WebSocketListener::poll(WebSocket *caller) {
+  caller->listen_ready_ = true;
+  caller->client_ready_ = caller->client_ != nullptr;
+}
+#else
+void WebSocketListener::poll(WebSocket *caller) {
+  WEB_SOCKET_LISTENER_LOCK();
+  // The last result is still unseen by this socket
+  if (caller->generation_ != generation_) {
+    caller->generation_ = generation_;
+    return;
+  }
+  generation_++;
+  caller->generation_ = generation_;
+
+  fd_set fds;
+  FD_ZERO(&fds);
+  int max_fd = -1;
+  for (auto *s : sockets_) {
+    int fd = s->server_ != nullptr ? s->server_->get_fd() : -1;
+    int client_fd = s->client_ != nullptr ? s->client_->get_fd() : -1;
+    // Without a descriptor the socket has to be polled directly
+    s->listen_ready_ = fd < 0;
+    s->client_ready_ = s->client_ != nullptr && client_fd < 0;
+    if (fd >= 0) {
+      FD_SET(fd, &fds);
+      max_fd = std::max(max_fd, fd);
+    }
+    if (client_fd >= 0) {
+      FD_SET(client_fd, &fds);
+      max_fd = std::max(max_fd, client_fd);
+    }
+  }
+  if (max_fd < 0) return;
+
+  struct timeval tv = {0, 0};
+  int ready = ::select(max_fd + 1, &fds, nullptr, nullptr, &tv);
+  if (ready < 0) {
+    // Poll everything directly rather than stall
+    for (auto *s : sockets_) {
+      s->listen_ready_ = true;
+      s->client_ready_ = s->client_ != nullptr;
+    }
+    return;
+  }
+  if (ready == 0) return;
+
+  for (auto *s : sockets_) {
+    int fd = s->server_ != nullptr ? s->server_->get_fd() : -1;
+    int client_fd = s->client_ != nullptr ? s->client_->get_fd() : -1;
+    if (fd >= 0 && FD_ISSET(fd, &fds))
+      s->listen_ready_ = true;
+    if (client_fd >= 0 && FD_ISSET(client_fd, &fds))
+      s->client_ready_ = true;
+  }
+}
+#endif
+
 bool WebSocket::readall_(uint8_t *buf, size_t len) {
+  // The timeout runs from the last data received, so long reads are fine
+  uint32_t timeout = this->get_timeout();
   uint32_t start = millis();
   uint32_t at = 0;
   while (len - at > 0) {
+    // Serve as much as possible from the receive buffer
+    size_t buffered = this->rx_len_ - this->rx_pos_;
+    if (buffered > 0) {
+      size_t n = std::min(buffered, len - at);
+      memcpy(buf + at, this->rx_buf_ + this->rx_pos_, n);
+      this->rx_pos_ += n;
+#ifdef USE_AVR_OTA_TRACE
+      this->rx_bytes += n;
+#endif
+      at += n;
+      continue;
+    }
+
     uint32_t now = millis();
-    if (now - start > 1000) {
-      ESP_LOGW(TAG, "Timed out reading %d bytes of data", len);
+    if (now - start > timeout) {
+      ESP_LOGW(TAG, "Timed out reading %d bytes of data after %u ms (RTT %u.%03u ms)", len, timeout,
+               this->srtt_us_ / 1000, this->srtt_us_ % 1000);
       return false;
     }
 
-    ssize_t read = this->client_->read(buf + at, len - at);
+    // The buffer is empty. Refill it with everything the socket has available
+    uint32_t waited = micros();
+    ssize_t read = this->client_->read(this->rx_buf_, sizeof(this->rx_buf_));
     if (read == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        App.feed_wdt();
+        EngineTask::feed_wdt();
         delay(1);
+        this->wait_us += micros() - waited;
         continue;
       }
       ESP_LOGW(TAG, "Failed to read %d bytes of data, errno %d", len, errno);
@@ -181,28 +415,56 @@ bool WebSocket::readall_(uint8_t *buf, size_t len) {
       ESP_LOGW(TAG, "Remote closed connection");
       return false;
     } else {
-      at += read;
+      uint32_t arrived = micros();
+      this->wait_us += arrived - waited;
+      this->rx_pos_ = 0;
+      this->rx_len_ = read;
+      if (this->rtt_pending_)
+        this->rtt_sample_(arrived - this->flushed_us_);
+      start = millis();
     }
-    App.feed_wdt();
-    delay(1);
   }
 
   return true;
 }
+// Append to the transmit buffer, flushing first if it would overflow
+bool WebSocket::queue_(const uint8_t *buf, size_t len) {
+#ifdef USE_AVR_OTA_TRACE
+  this->tx_bytes += len;
+#endif
+  if (this->tx_len_ + len > sizeof(this->tx_buf_)) {
+    if (!this->flush()) return false;
+
+    // Too large to buffer at all, send it straight away
+    if (len > sizeof(this->tx_buf_)) {
+      bool res = this->writeall_(buf, len);
+      if (!res) this->close();
+      return res;
+    }
+  }
+
+  memcpy(this->tx_buf_ + this->tx_len_, buf, len);
+  this->tx_len_ += len;
+  return true;
+}
+
 bool WebSocket::writeall_(const uint8_t *buf, size_t len) {
+  // A full send buffer drains as the client acknowledges, a round trip
+  uint32_t timeout = this->get_timeout();
   uint32_t start = millis();
   uint32_t at = 0;
   while (len - at > 0) {
     uint32_t now = millis();
-    if (now - start > 1000) {
-      ESP_LOGW(TAG, "Timed out writing %d bytes of data", len);
+    if (now - start > timeout) {
+      ESP_LOGW(TAG, "Timed out writing %d bytes of data after %u ms (RTT %u.%03u ms)", len, timeout,
+               this->srtt_us_ / 1000, this->srtt_us_ % 1000);
       return false;
     }
 
     ssize_t written = this->client_->write(buf + at, len - at);
     if (written == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        App.feed_wdt();
+        EngineTask::feed_wdt();
         delay(1);
         continue;
       }
@@ -210,9 +472,8 @@ bool WebSocket::writeall_(const uint8_t *buf, size_t len) {
       return false;
     } else {
       at += written;
+      start = millis();
     }
-    App.feed_wdt();
-    delay(1);
   }
   return true;
 }
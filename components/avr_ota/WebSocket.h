@@ -1,10 +1,31 @@
 #pragma once
 
+#include "esphome/core/defines.h"
+#include "esphome/core/helpers.h"
 #include "esphome/components/socket/socket.h"
 
+#include <vector>
+
 namespace esphome {
 namespace avr_ota {
 
+// Size of the receive buffer. Large enough to hold a full STK500 page command
+static const size_t WEB_SOCKET_RX_BUFFER_SIZE = 512;
+// Size of the transmit buffer. Large enough to hold a full page read reply
+static const size_t WEB_SOCKET_TX_BUFFER_SIZE = 512;
+
+// Keepalive probing of a silent client: seconds idle before the first
+// probe, seconds between probes and unanswered probes before it is dropped
+static const int WEB_SOCKET_KEEPALIVE_IDLE = 2;
+static const int WEB_SOCKET_KEEPALIVE_INTERVAL = 1;
+static const int WEB_SOCKET_KEEPALIVE_COUNT = 3;
+
+// Read and write timeouts in milliseconds. Until the connection has an RTT
+// estimate the initial one is used, both clamped to the configured range
+static const uint32_t WEB_SOCKET_TIMEOUT_INITIAL = 1000;
+static const uint32_t WEB_SOCKET_TIMEOUT_MIN = 200;
+static const uint32_t WEB_SOCKET_TIMEOUT_MAX = 5000;
+
 // programmer states
 typedef enum {
     WebSocketIdle = 0,    // no active TCP session
@@ -12,6 +33,28 @@ typedef enum {
     WebSocketShutdown,    // WebSocket is not online at all
 } WebSocketStatus_t;
 
+class WebSocket;
+
+// One select() over the sockets of every started WebSocket, so idle
+// programmers cost nothing per loop. Sockets without a file descriptor
+// are always reported ready and fall back to polling
+class WebSocketListener {
+ public:
+  static void add(WebSocket *socket);
+  static void remove(WebSocket *socket);
+
+  // Refresh the readiness of every socket. Runs the select() only once
+  // the caller has seen the previous result, so once per loop iteration
+  static void poll(WebSocket *caller);
+
+ protected:
+  static std::vector<WebSocket *> sockets_;
+  static uint32_t generation_;
+#ifdef USE_AVR_OTA_TASK
+  static Mutex lock_;
+#endif
+};
+
 class WebSocket {
  public:
 
@@ -21,6 +64,21 @@ class WebSocket {
   void set_port(uint16_t port) { this->port_ = port; }
   uint16_t get_port() { return this->port_; }
 
+  // Range the RTT derived timeouts are clamped to, in milliseconds
+  void set_timeouts(uint32_t min_ms, uint32_t max_ms) {
+    this->timeout_min_ = min_ms;
+    this->timeout_max_ = max_ms;
+  }
+  uint32_t get_timeout_min() const { return this->timeout_min_; }
+  uint32_t get_timeout_max() const { return this->timeout_max_; }
+
+  // Smoothed round trip time and its mean deviation in microseconds, 0
+  // until the current (or last) client has answered a reply
+  uint32_t get_srtt_us() const { return this->srtt_us_; }
+  uint32_t get_rttvar_us() const { return this->rttvar_us_; }
+  // Current read and write timeout in milliseconds
+  uint32_t get_timeout() const;
+
   bool start();
   void stop();
   void close();
@@ -31,18 +89,71 @@ class WebSocket {
   bool write(char b);
   bool write_bytes(uint8_t *buf, size_t len);
   bool print(const char *buf);
+  bool flush();
 
   bool is_running();
 
+  // True if read() can make progress without waiting: data is buffered or
+  // the client socket is readable (or closed)
+  bool available();
+
+  // Sent to clients that connect while another one is being served, before
+  // they are closed. The data must stay valid
+  void set_busy_reply(const uint8_t *data, size_t len) {
+    this->busy_reply_ = data;
+    this->busy_reply_len_ = len;
+  }
+
   WebSocketStatus_t status;
 
+  // time spent waiting for received data, in microseconds. Never reset here
+  uint32_t wait_us{0};
+#ifdef USE_AVR_OTA_TRACE
+  // bytes read and queued, for command tracing
+  uint32_t rx_bytes{0};
+  uint32_t tx_bytes{0};
+#endif
+
  protected:
   bool readall_(uint8_t *buf, size_t len);
+  void reset_buffers_();
   bool writeall_(const uint8_t *buf, size_t len);
+  bool queue_(const uint8_t *buf, size_t len);
+  void reject_();
+  bool peek_();
+  void set_keepalive_();
+  void rtt_sample_(uint32_t rtt_us);
+
+  friend class WebSocketListener;
+  // readiness from the last WebSocketListener::poll()
+  bool listen_ready_{false};
+  bool client_ready_{false};
+  uint32_t generation_{0};
+
+  const uint8_t *busy_reply_{nullptr};
+  size_t busy_reply_len_{0};
+
+  // Round trip estimate, from a flush() to the next data from the client
+  uint32_t srtt_us_{0};
+  uint32_t rttvar_us_{0};
+  uint32_t flushed_us_{0};
+  bool rtt_pending_{false};
+  uint32_t timeout_min_{WEB_SOCKET_TIMEOUT_MIN};
+  uint32_t timeout_max_{WEB_SOCKET_TIMEOUT_MAX};
 
   uint16_t port_;
   std::unique_ptr<socket::Socket> server_;
   std::unique_ptr<socket::Socket> client_;
+
+  // receive buffer, drained by read() and read_bytes() and refilled with one
+  // bulk socket read whenever it runs empty
+  uint8_t rx_buf_[WEB_SOCKET_RX_BUFFER_SIZE];
+  size_t rx_pos_{0};
+  size_t rx_len_{0};
+
+  // transmit buffer. Writes are collected here and sent in one go by flush()
+  uint8_t tx_buf_[WEB_SOCKET_TX_BUFFER_SIZE];
+  size_t tx_len_{0};
 };
 
 }  // namespace empty_web_socket
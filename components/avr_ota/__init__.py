@@ -3,9 +3,23 @@ from esphome import automation
 from esphome.automation import Condition, maybe_simple_id
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome.components import spi, output
-from esphome.const import CONF_ID, CONF_PORT, CONF_TRIGGER_ID, CONF_RESTORE_MODE
+import esphome.final_validate as fv
+from esphome.components import spi, output, uart
+from esphome.const import CONF_ID, CONF_PORT, CONF_TRIGGER_ID, CONF_RESTORE_MODE, CONF_SPI_ID
 CONF_AVR_ENABLE = "avr_enable_output"
+CONF_BROADCAST_ENABLE = "broadcast_enable_outputs"
+CONF_PIPELINED_WRITES = "pipelined_writes"
+CONF_DIFFERENTIAL_WRITES = "differential_writes"
+CONF_ISP_CLOCK = "isp_clock"
+CONF_PROTOCOL = "protocol"
+CONF_IMAGE_PARTITION = "image_partition"
+CONF_PAGE_BUFFER_SIZE = "page_buffer_size"
+CONF_TRACE_SIZE = "trace_size"
+CONF_DEDICATED_TASK = "dedicated_task"
+CONF_BOOTLOADER_UART = "bootloader_uart_id"
+CONF_BOOTLOADER_BAUD_RATE = "bootloader_baud_rate"
+CONF_SOCKET_TIMEOUT_MIN = "socket_timeout_min"
+CONF_SOCKET_TIMEOUT_MAX = "socket_timeout_max"
 
 _LOGGER = logging.getLogger(__name__)
 
@@ -25,6 +39,14 @@ CONF_ON_AVR_FAILURE = "on_avr_failure"
 avr_ota_ns = cg.esphome_ns.namespace("avr_ota")
 AVROTAComponent = avr_ota_ns.class_("AVROTAComponent",  cg.Component, spi.SPIDevice)
 
+AVRISPProtocol = avr_ota_ns.enum("AVRISPProtocol_t")
+PROTOCOLS = {
+    "AUTO": AVRISPProtocol.AVRISP_PROTOCOL_AUTO,
+    "STK500V1": AVRISPProtocol.AVRISP_PROTOCOL_STK500V1,
+    "STK500V2": AVRISPProtocol.AVRISP_PROTOCOL_STK500V2,
+    "NATIVE": AVRISPProtocol.AVRISP_PROTOCOL_NATIVE,
+}
+
 AVRRestoreMode = avr_ota_ns.enum("AVRRestoreMode_t")
 RESTORE_MODES = {
     "RESTORE_DEFAULT_OFF": AVRRestoreMode.AVR_RESTORE_DEFAULT_OFF,
@@ -41,6 +63,8 @@ ToggleAction = avr_ota_ns.class_("ToggleAction", automation.Action)
 DisableAction = avr_ota_ns.class_("DisableAction", automation.Action)
 EnableAction = avr_ota_ns.class_("EnableAction", automation.Action)
 ResetAction = avr_ota_ns.class_("ResetAction", automation.Action)
+ReflashAction = avr_ota_ns.class_("ReflashAction", automation.Action)
+DumpTraceAction = avr_ota_ns.class_("DumpTraceAction", automation.Action)
 
 AVRCondition = avr_ota_ns.class_("AVRCondition", Condition)
 
@@ -64,13 +88,54 @@ ClientDisconnectedTrigger = avr_ota_ns.class_("DisableTrigger", automation.Trigg
 
 
 
-CONFIG_SCHEMA = output.BINARY_OUTPUT_SCHEMA.extend(cv.Schema({
+def validate_bootloader(config):
+    # A bootloader only serves the one target it runs on and speaks stk500v1
+    if CONF_BOOTLOADER_UART not in config:
+        return config
+    if CONF_BROADCAST_ENABLE in config:
+        raise cv.Invalid(f"{CONF_BROADCAST_ENABLE} needs SPI ISP, not {CONF_BOOTLOADER_UART}")
+    if config[CONF_PROTOCOL] == "STK500V2":
+        raise cv.Invalid(f"The stk500v2 protocol needs SPI ISP, not {CONF_BOOTLOADER_UART}")
+    return config
+
+
+def validate_socket_timeouts(config):
+    if config[CONF_SOCKET_TIMEOUT_MIN] > config[CONF_SOCKET_TIMEOUT_MAX]:
+        raise cv.Invalid(f"{CONF_SOCKET_TIMEOUT_MIN} can't be longer than {CONF_SOCKET_TIMEOUT_MAX}")
+    return config
+
+
+def validate_isp_clock(value):
+    # "auto" negotiates the fastest rate the target syncs at on every session
+    if isinstance(value, str) and value.lower() == "auto":
+        return 0
+    return int(cv.frequency(value))
+
+
+CONFIG_SCHEMA = cv.All(output.BINARY_OUTPUT_SCHEMA.extend(cv.Schema({
         cv.GenerateID(): cv.declare_id(AVROTAComponent),
         cv.Required(CONF_AVR_ENABLE): cv.use_id(output.BinaryOutput),
+        cv.Optional(CONF_BROADCAST_ENABLE): cv.ensure_list(cv.use_id(output.BinaryOutput)),
         cv.Optional(CONF_PORT, 328): cv.port,
         cv.Optional(CONF_RESTORE_MODE, default="ALWAYS_OFF"): cv.enum(
             RESTORE_MODES, upper=True, space="_"
         ),
+        cv.Optional(CONF_PIPELINED_WRITES, default=False): cv.boolean,
+        cv.Optional(CONF_DIFFERENTIAL_WRITES, default=False): cv.boolean,
+        cv.Optional(CONF_ISP_CLOCK, default="200kHz"): validate_isp_clock,
+        cv.Optional(CONF_PROTOCOL, default="AUTO"): cv.enum(PROTOCOLS, upper=True),
+        cv.Optional(CONF_PAGE_BUFFER_SIZE, default=256): cv.int_range(min=32, max=4096),
+        cv.Optional(CONF_TRACE_SIZE): cv.int_range(min=1, max=1024),
+        cv.Optional(CONF_IMAGE_PARTITION): cv.All(cv.only_on_esp32, cv.string_strict),
+        cv.Optional(CONF_DEDICATED_TASK): cv.All(cv.only_on(["esp32", "host"]), cv.boolean),
+        cv.Optional(CONF_BOOTLOADER_UART): cv.use_id(uart.UARTComponent),
+        cv.Optional(CONF_BOOTLOADER_BAUD_RATE, default=115200): cv.int_range(min=1200, max=2000000),
+        cv.Optional(CONF_SOCKET_TIMEOUT_MIN, default="200ms"): cv.All(
+            cv.positive_time_period_milliseconds, cv.Range(min=cv.TimePeriod(milliseconds=10))
+        ),
+        cv.Optional(CONF_SOCKET_TIMEOUT_MAX, default="5s"): cv.All(
+            cv.positive_time_period_milliseconds, cv.Range(max=cv.TimePeriod(seconds=60))
+        ),
         cv.Optional(CONF_ON_ENABLE): automation.validate_automation(
             {
                 cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(EnableTrigger),
@@ -103,9 +168,43 @@ CONFIG_SCHEMA = output.BINARY_OUTPUT_SCHEMA.extend(cv.Schema({
         ),
     })
     .extend(cv.COMPONENT_SCHEMA)
-    .extend(spi.spi_device_schema(cs_pin_required=False))
+    .extend(spi.spi_device_schema(cs_pin_required=False))),
+    validate_bootloader,
+    validate_socket_timeouts,
 )
 
+def _spi_users(config, found):
+    # Every config block at any depth that names an SPI bus
+    if isinstance(config, dict):
+        if CONF_SPI_ID in config:
+            found.append(config)
+        for value in config.values():
+            _spi_users(value, found)
+    elif isinstance(config, list):
+        for value in config:
+            _spi_users(value, found)
+    return found
+
+
+def final_validate_dedicated_task(config):
+    # The engine task only serialises the SPI use of avr_ota itself. Another
+    # SPI device on the bus would cut into a page commit in flight
+    if not config.get(CONF_DEDICATED_TASK, False):
+        return config
+    full_config = fv.full_config.get()
+    for domain, domain_config in full_config.items():
+        if domain == "avr_ota":
+            continue
+        for user in _spi_users(domain_config, []):
+            if str(user[CONF_SPI_ID]) == str(config[CONF_SPI_ID]):
+                raise cv.Invalid(
+                    f"{CONF_DEDICATED_TASK} needs an SPI bus of its own, {domain} uses {config[CONF_SPI_ID]} too"
+                )
+    return config
+
+
+FINAL_VALIDATE_SCHEMA = final_validate_dedicated_task
+
 CHILD_SCHEMA = cv.Schema(
     {
         cv.GenerateID(CONF_HUB_ID): cv.use_id(AVROTAComponent),
@@ -119,13 +218,58 @@ async def to_code(config):
     # Set the config port from the config
     cg.add(var.set_ws_port(config[CONF_PORT]))
 
+    # Clamp the RTT derived socket timeouts to this range
+    cg.add(var.set_socket_timeouts(config[CONF_SOCKET_TIMEOUT_MIN].total_milliseconds,
+                                   config[CONF_SOCKET_TIMEOUT_MAX].total_milliseconds))
+
     # Set AVR Restore mode
     cg.add(var.set_restore_mode(config[CONF_RESTORE_MODE]))
 
+    # Reply to flash pages before their commit completes
+    cg.add(var.set_pipelined_writes(config[CONF_PIPELINED_WRITES]))
+
+    # Skip flash pages that already hold the same data
+    cg.add(var.set_differential_writes(config[CONF_DIFFERENTIAL_WRITES]))
+
+    # Set the ISP clock rate, 0 for auto
+    cg.add(var.set_isp_clock(config[CONF_ISP_CLOCK]))
+
+    # Set the programmer protocol
+    cg.add(var.set_protocol(config[CONF_PROTOCOL]))
+
+    # Size of the page buffer, larger page reads and writes are refused
+    cg.add(var.set_page_buffer_size(config[CONF_PAGE_BUFFER_SIZE]))
+
+    # Compile in command tracing with a ring of this many commands
+    if CONF_TRACE_SIZE in config:
+        cg.add_define("USE_AVR_OTA_TRACE")
+        cg.add_define("AVR_OTA_TRACE_SIZE", config[CONF_TRACE_SIZE])
+
+    # Run the socket and the programmer in their own task
+    if config.get(CONF_DEDICATED_TASK, False):
+        cg.add_define("USE_AVR_OTA_TASK")
+        cg.add(var.set_dedicated_task(True))
+
+    # Program through the serial bootloader instead of SPI ISP
+    if CONF_BOOTLOADER_UART in config:
+        cg.add_define("USE_AVR_OTA_BOOTLOADER")
+        bootloader_uart = await cg.get_variable(config[CONF_BOOTLOADER_UART])
+        cg.add(var.set_bootloader_uart(bootloader_uart))
+        cg.add(var.set_bootloader_baud_rate(config[CONF_BOOTLOADER_BAUD_RATE]))
+
+    # Keep the last programmed image in a data partition for avr_ota.reflash
+    if CONF_IMAGE_PARTITION in config:
+        cg.add(var.set_image_partition(config[CONF_IMAGE_PARTITION]))
+
     # Set the avr enable output from the config
     avr_enable = await cg.get_variable(config[CONF_AVR_ENABLE])
     cg.add(var.set_avr_enable(avr_enable))
 
+    # Identical AVRs on the same bus, programmed together with the first
+    for conf in config.get(CONF_BROADCAST_ENABLE, []):
+        broadcast_enable = await cg.get_variable(conf)
+        cg.add(var.add_broadcast_enable(broadcast_enable))
+
     # Set up triggers
     for conf in config.get(CONF_ON_ENABLE, []):
         trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
@@ -164,6 +308,8 @@ AVR_ACTION_SCHEMA = maybe_simple_id(
 @automation.register_action("avr_ota.enable", EnableAction, AVR_ACTION_SCHEMA)
 @automation.register_action("avr_ota.disable", DisableAction, AVR_ACTION_SCHEMA)
 @automation.register_action("avr_ota.reset", ResetAction, AVR_ACTION_SCHEMA)
+@automation.register_action("avr_ota.reflash", ReflashAction, AVR_ACTION_SCHEMA)
+@automation.register_action("avr_ota.dump_trace", DumpTraceAction, AVR_ACTION_SCHEMA)
 async def avr_action_to_code(config, action_id, template_arg, args):
     paren = await cg.get_variable(config[CONF_ID])
     return cg.new_Pvariable(action_id, template_arg, paren)
@@ -18,6 +18,26 @@ template<typename... Ts> class ResetAction : public Action<Ts...> {
   AVROTAComponent *avr_ota_;
 };
 
+template<typename... Ts> class ReflashAction : public Action<Ts...> {
+ public:
+  explicit ReflashAction(AVROTAComponent *a_avr_ota) : avr_ota_(a_avr_ota) {}
+
+  void play(Ts... x) override { this->avr_ota_->reflash(); }
+
+ protected:
+  AVROTAComponent *avr_ota_;
+};
+
+template<typename... Ts> class DumpTraceAction : public Action<Ts...> {
+ public:
+  explicit DumpTraceAction(AVROTAComponent *a_avr_ota) : avr_ota_(a_avr_ota) {}
+
+  void play(Ts... x) override { this->avr_ota_->dump_trace(); }
+
+ protected:
+  AVROTAComponent *avr_ota_;
+};
+
 template<typename... Ts> class EnableAction : public Action<Ts...> {
  public:
   explicit EnableAction(AVROTAComponent *a_avr_ota) : avr_ota_(a_avr_ota) {}
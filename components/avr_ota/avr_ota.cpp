@@ -1,5 +1,7 @@
 #include "avr_ota.h"
 #include "avr_commands.h"
+#include "stk500v2_commands.h"
+#include "native_commands.h"
 
 // #include "esphome/components/md5/md5.h"
 #include "esphome/components/network/util.h"
@@ -21,11 +23,42 @@ namespace avr_ota {
 #define AVRISP_SWMAJ 1
 #define AVRISP_SWMIN 18
 #define AVRISP_PTIME 10
+#define AVRISP_EETIME 45
+#define AVRISP_POLL_TIMEOUT 25
+#define AVRISP_ERASE_TIME 20  // ms, fallback if the chip erase can't be polled
 #define EECHUNK (32)
+// STK500 SCK duration units: rate = AVRISP_SCK_BASE / duration
+#define AVRISP_SCK_BASE 921600
 #define beget16(addr) (*addr * 256 + *(addr + 1))
+// Requests from the main loop to the engine task
+#define AVRISP_REQUEST_ENABLE 0x01
+#define AVRISP_REQUEST_DISABLE 0x02
+#define AVRISP_REQUEST_RESET 0x04
+#define AVRISP_REQUEST_REFLASH 0x08
+#define AVRISP_REQUEST_DUMP_TRACE 0x10
+#define AVRISP_TASK_IDLE_MS 10  // engine task poll interval without a client
 
 static const char *TAG = "avr_ota.component";
 
+// Sent to clients that connect while another one is programming. avrdude
+// fails on the unexpected first byte instead of waiting for a timeout
+static const uint8_t BUSY_REPLY[NATIVE_REPLY_SIZE] = {NATIVE_MAGIC, NATIVE_STATUS_BUSY, 0, 0, 0, 0, 0, 0};
+
+// ISP clock rates tried when negotiating, slowest first. The ISP clock must
+// stay below a quarter of the target clock, so 4 MHz suits a 16 MHz part
+static const uint32_t AVRISP_CLOCKS[] = {spi::DATA_RATE_75KHZ, spi::DATA_RATE_200KHZ, spi::DATA_RATE_1MHZ,
+                                         spi::DATA_RATE_2MHZ, spi::DATA_RATE_4MHZ};
+static const int AVRISP_CLOCK_COUNT = sizeof(AVRISP_CLOCKS) / sizeof(AVRISP_CLOCKS[0]);
+
+uint32_t avrisp_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
 void AVROTAComponent::store_state() {
   AVRStateRTCState saved;
   saved.enabled = this->is_enabled();
@@ -34,8 +67,16 @@ void AVROTAComponent::store_state() {
 
 // Enables the AVR programmer by creating the web socket server
 bool AVROTAComponent::enable_avr() {
+#ifdef USE_AVR_OTA_TASK
+  // The engine task owns the socket, it starts it on its next pass
+  if (this->task_request_(AVRISP_REQUEST_ENABLE)) return true;
+#endif
+  return this->enable_avr_();
+}
+
+bool AVROTAComponent::enable_avr_() {
   // If the web socket is already running, then don't do anything
-  if (this->is_enabled()) return true;
+  if (this->socket.is_running()) return true;
 
   ESP_LOGD(TAG, "Enabling AVR");
 
@@ -45,9 +86,11 @@ bool AVROTAComponent::enable_avr() {
     ESP_LOGI(TAG, "  Address: %s:%u", network::get_use_address(), this->port_);
     ESP_LOGI(TAG, "  $ avrdude -c stk500v1 -p m328p -P net:%s:%u -b 19200 ...", network::get_use_address(), 
             this->port_);
+    ESP_LOGI(TAG, "  $ tools/avr_ota_upload.py %s firmware.hex --port %u", network::get_use_address(), this->port_);
     
-    this->store_state();
-    this->enable_callback_.call();
+    AVRISP_event_t event{};
+    event.type = AVRISP_EVENT_ENABLED;
+    this->post_event_(event);
   } else
     ESP_LOGW(TAG, "Error starting Web Socket");
 
@@ -56,8 +99,15 @@ bool AVROTAComponent::enable_avr() {
 
 // Disables the AVR programmer by removing the web socket server
 void AVROTAComponent::disable_avr() {
+#ifdef USE_AVR_OTA_TASK
+  if (this->task_request_(AVRISP_REQUEST_DISABLE)) return;
+#endif
+  this->disable_avr_();
+}
+
+void AVROTAComponent::disable_avr_() {
   // If the web socket isn't running, don't do anything
-  if (!this->is_enabled()) return;
+  if (!this->socket.is_running()) return;
 
   ESP_LOGD(TAG, "Disabling AVR");
 
@@ -66,21 +116,30 @@ void AVROTAComponent::disable_avr() {
 
   this->socket.stop();
 
-  this->store_state();
-  this->disable_callback_.call();
+  AVRISP_event_t event{};
+  event.type = AVRISP_EVENT_DISABLED;
+  this->post_event_(event);
 }
 
 void AVROTAComponent::toggle() {
-  if (this->is_enabled()) this->disable();
+  if (this->is_enabled()) this->disable_avr();
   else this->enable_avr();
 }
 
-// Returns true if the AVR Programmer is enabled (by having its socket active)
+// Returns true if the AVR Programmer is enabled (by having its socket active).
+// The socket belongs to the engine, this is what it last reported
 bool AVROTAComponent::is_enabled() {
-  return this->socket.is_running();
+  return this->enabled_;
 }
 
 void AVROTAComponent::reset() {
+#ifdef USE_AVR_OTA_TASK
+  if (this->task_request_(AVRISP_REQUEST_RESET)) return;
+#endif
+  this->reset_();
+}
+
+void AVROTAComponent::reset_() {
   if (this->_state != AVRISP_STATE_IDLE)
     this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
 
@@ -105,17 +164,29 @@ void AVROTAComponent::add_on_avr_callback(std::function<void(AVRISPState_t)> &&c
 // Setup from Component
 void AVROTAComponent::setup() {
   // Set up the SPI bus
+  if (this->isp_clock_ != 0)
+    this->set_data_rate(this->isp_clock_);
+  this->isp_rate_ = this->isp_clock_ != 0 ? this->isp_clock_ : spi::DATA_RATE_200KHZ;
   this->spi_setup();
   this->spi_transaction_active = false;
+  if (this->boot_uart_ != nullptr)
+    boot_setup_();
+
+  this->buff = new uint8_t[this->buff_size_];
 
   // The detault state for the AVR Enable pin should be the Enabled state
   // Note that this setup does not run until after wifi is connected, so it
   // may take a moment for the AVR to come online
   this->set_enable_(true);
 
+  // Find the image store partition
+  if (!this->image_.get_label().empty())
+    this->image_.setup();
+
   // Set up the web socket
   this->socket = WebSocket();
   this->socket.set_port(this->port_);
+  this->socket.set_busy_reply(BUSY_REPLY, sizeof(BUSY_REPLY));
 
   // Restore the AVR as needed based on the restore state
   AVRStateRTCState recovered{};
@@ -156,6 +227,12 @@ void AVROTAComponent::setup() {
   if (recovered.enabled) {
     this->enable_avr();
   }
+
+  // Hand the socket and the SPI bus to the engine task from here on
+#ifdef USE_AVR_OTA_TASK
+  if (this->dedicated_task_ && !this->task_.start("avr_ota", AVROTAComponent::task_run_, this))
+    ESP_LOGW(TAG, "Running the programmer in the main loop");
+#endif
 }
 
 // Dump Config from Component
@@ -164,48 +241,291 @@ void AVROTAComponent::dump_config() {
   ESP_LOGCONFIG(TAG, "  Address: %s:%u", network::get_use_address(), this->port_);
   ESP_LOGCONFIG(TAG, "  $ avrdude -c stk500v1 -p m328p -P net:%s:%u -b 19200 ...", network::get_use_address(),
                 this->port_);
+  ESP_LOGCONFIG(TAG, "  Protocol: %s", this->protocol_ == AVRISP_PROTOCOL_STK500V1   ? "stk500v1"
+                                         : this->protocol_ == AVRISP_PROTOCOL_STK500V2 ? "stk500v2"
+                                         : this->protocol_ == AVRISP_PROTOCOL_NATIVE   ? "native"
+                                                                                       : "auto");
+  if (this->boot_uart_ != nullptr)
+    ESP_LOGCONFIG(TAG, "  Bootloader: UART at %u baud", this->boot_baud_rate_);
+#ifdef USE_AVR_OTA_TASK
+  else if (this->isp_clock_ == 0 && this->task_.is_running())
+    ESP_LOGCONFIG(TAG, "  ISP Clock: auto");
+#endif
+  else if (this->isp_clock_ == 0)
+    ESP_LOGCONFIG(TAG, "  ISP Clock: auto (last %u kHz)", this->isp_rate_ / 1000);
+  else
+    ESP_LOGCONFIG(TAG, "  ISP Clock: %u kHz", this->isp_clock_ / 1000);
+  if (!this->broadcast_enables_.empty())
+    ESP_LOGCONFIG(TAG, "  Broadcast: %u targets", 1 + this->broadcast_enables_.size());
+#ifdef USE_AVR_OTA_TASK
+  // The RTT estimate changes under the engine task, only the range is fixed
+  if (this->task_.is_running())
+    ESP_LOGCONFIG(TAG, "  Socket Timeout: %u-%u ms", this->socket.get_timeout_min(), this->socket.get_timeout_max());
+  else
+#endif
+  if (this->socket.get_srtt_us() != 0)
+    ESP_LOGCONFIG(TAG, "  Socket Timeout: %u ms (%u-%u ms), RTT %u.%03u ms +/- %u.%03u ms", this->socket.get_timeout(),
+                  this->socket.get_timeout_min(), this->socket.get_timeout_max(), this->socket.get_srtt_us() / 1000,
+                  this->socket.get_srtt_us() % 1000, this->socket.get_rttvar_us() / 1000,
+                  this->socket.get_rttvar_us() % 1000);
+  else
+    ESP_LOGCONFIG(TAG, "  Socket Timeout: %u ms (%u-%u ms), no RTT estimate yet", this->socket.get_timeout(),
+                  this->socket.get_timeout_min(), this->socket.get_timeout_max());
+  ESP_LOGCONFIG(TAG, "  Buffers: %u byte pages, %u byte ISP frame, %u byte stk500v2 messages",
+                this->buff_size_, AVRISP_FRAME_SIZE, AVRISP_V2_BUFFER_SIZE);
+  if (!this->image_.get_label().empty())
+    ESP_LOGCONFIG(TAG, "  Image Partition: %s (%s, %u byte slots)", this->image_.get_label().c_str(),
+                  this->image_.is_available() ? "ok" : "missing", this->image_.get_slot_size());
+#ifdef USE_AVR_OTA_TASK
+  if (this->task_.is_running())
+    ESP_LOGCONFIG(TAG, "  Engine: dedicated task on core %d", this->task_.get_core());
+  else
+#endif
+    ESP_LOGCONFIG(TAG, "  Engine: main loop");
+#ifdef USE_AVR_OTA_TRACE
+  ESP_LOGCONFIG(TAG, "  Command Trace: %u entries", AVR_OTA_TRACE_SIZE);
+#endif
+}
+
+void AVROTAComponent::dump_trace() {
+#ifdef USE_AVR_OTA_TASK
+  // The trace is written by the engine task
+  if (this->task_request_(AVRISP_REQUEST_DUMP_TRACE)) return;
+#endif
+  this->dump_trace_();
+}
+
+void AVROTAComponent::dump_trace_() {
+#ifdef USE_AVR_OTA_TRACE
+  this->trace_.dump(TAG);
+#else
+  ESP_LOGW(TAG, "Command tracing is not compiled in, set trace_size to enable it");
+#endif
+}
+
+#ifdef USE_AVR_OTA_TRACE
+// Snapshot of the counters each traced command is measured against
+CommandTraceCounters_t AVROTAComponent::trace_counters_() {
+  return {this->trace_spi_us_, this->socket.wait_us, this->socket.rx_bytes, this->socket.tx_bytes};
 }
+#endif
 
 // Main loop from Component
 void AVROTAComponent::loop() {
-  bool newConnection = this->socket.handle();
+#ifdef USE_AVR_OTA_TASK
+  // The engine runs on its own, only pick up what it reported
+  if (this->task_.is_running()) {
+    AVRISP_event_t event;
+    while (this->events_.pop(&event)) this->handle_event_(event);
+    return;
+  }
+#endif
+  this->isp_step_();
+}
+
+// One pass of the engine: serve the socket, update the ISP state and
+// report a state change
+void AVROTAComponent::isp_step_() {
+  this->socket.handle();
 
   // Update the ISP State based on the websocket
   this->isp_update();
 
-  // Simple print statement if the state changed since last time
   if (this->_state != this->_last_state) {
-    switch (this->_state) {
-      case AVRISP_STATE_IDLE: {
-        if (this->_last_state == AVRISP_STATE_ACTIVE)
-          ESP_LOGI(TAG, "[AVRISP] Complete. Now idle");
-        else
-          ESP_LOGI(TAG, "[AVRISP] Now idle");
-        break;
-      }
-      case AVRISP_STATE_PENDING: {
-        ESP_LOGI(TAG, "[AVRISP] Connection pending");
-        break;
-      }
-      case AVRISP_STATE_ACTIVE: {
-        ESP_LOGI(TAG, "[AVRISP] Programming mode");
-        break;
-      }
-      case AVRISP_STATE_FORCED_SHUTDOWN: {
-        ESP_LOGI(TAG, "[AVRISP] Forced shutdown pending");
-        break;
-      }
-    }
-    // Execute the AVR Callback since the state changed
-    this->avr_callback_.call(this->_state);
+    AVRISP_event_t event{};
+    event.type = AVRISP_EVENT_STATE;
+    event.state = this->_state;
+    this->post_event_(event);
     this->_last_state = this->_state;
   }
 }
 
+// Hand an event to the main loop. Called by the engine
+void AVROTAComponent::post_event_(const AVRISP_event_t &event) {
+#ifdef USE_AVR_OTA_TASK
+  if (this->task_.is_running()) {
+    // Wait for the main loop rather than lose an event
+    while (!this->events_.push(event)) delay(1);
+    return;
+  }
+#endif
+  this->handle_event_(event);
+}
+
+// Act on an event from the engine. Runs in the main loop
+void AVROTAComponent::handle_event_(const AVRISP_event_t &event) {
+  switch (event.type) {
+    case AVRISP_EVENT_ENABLED:
+      this->enabled_ = true;
+      this->store_state();
+      this->enable_callback_.call();
+      return;
+    case AVRISP_EVENT_DISABLED:
+      this->enabled_ = false;
+      this->store_state();
+      this->disable_callback_.call();
+      return;
+    case AVRISP_EVENT_SESSION:
+      this->session_publish_(event);
+      return;
+    case AVRISP_EVENT_STATE:
+      break;
+  }
+
+  // Simple print statement if the state changed since last time
+  switch (event.state) {
+    case AVRISP_STATE_IDLE: {
+      if (this->reported_state_ == AVRISP_STATE_ACTIVE)
+        ESP_LOGI(TAG, "[AVRISP] Complete. Now idle");
+      else
+        ESP_LOGI(TAG, "[AVRISP] Now idle");
+      break;
+    }
+    case AVRISP_STATE_PENDING: {
+      ESP_LOGI(TAG, "[AVRISP] Connection pending");
+      break;
+    }
+    case AVRISP_STATE_ACTIVE: {
+      ESP_LOGI(TAG, "[AVRISP] Programming mode");
+      break;
+    }
+    case AVRISP_STATE_FORCED_SHUTDOWN: {
+      ESP_LOGI(TAG, "[AVRISP] Forced shutdown pending");
+      break;
+    }
+  }
+  this->reported_state_ = event.state;
+  // Execute the AVR Callback since the state changed
+  this->avr_callback_.call(event.state);
+}
+
+#ifdef USE_AVR_OTA_TASK
+// Queue a request for the engine task. Returns false if there is no task
+bool AVROTAComponent::task_request_(uint32_t request) {
+  if (!this->task_.is_running()) return false;
+  this->task_requests_.fetch_or(request);
+  return true;
+}
+
+void AVROTAComponent::task_run_(void *component) { ((AVROTAComponent *) component)->task_loop_(); }
+
+// The engine task. Owns the socket and the SPI bus until reboot
+void AVROTAComponent::task_loop_() {
+  while (true) {
+    uint32_t requests = this->task_requests_.exchange(0);
+    if (requests & AVRISP_REQUEST_DISABLE) this->disable_avr_();
+    if (requests & AVRISP_REQUEST_ENABLE) this->enable_avr_();
+    if (requests & AVRISP_REQUEST_RESET) this->reset_();
+    if (requests & AVRISP_REQUEST_REFLASH) this->reflash_();
+    if (requests & AVRISP_REQUEST_DUMP_TRACE) this->dump_trace_();
+
+    this->isp_step_();
+    EngineTask::feed_wdt();
+
+    // Nothing to read yet. Poll quickly during a session, back off while idle
+    if (!this->socket.available())
+      delay(this->_state == AVRISP_STATE_IDLE ? AVRISP_TASK_IDLE_MS : 1);
+  }
+}
+#endif
+
 // Set the enable gpio pin
 void AVROTAComponent::set_enable_(bool state) {
   // ESP_LOGI(TAG, "Enable Pin Set %s", state ? "on" : "off");
   this->avr_enable_->set_state(state);
+  // Broadcast targets follow the main one, so entering programming mode
+  // joins them all
+  for (auto *target : this->broadcast_enables_) target->set_state(state);
+  this->broadcast_joined_ = !state && !this->broadcast_enables_.empty();
+}
+
+// Put the targets in the right mode for the next instruction. Writes go to
+// every target at once, anything that reads goes to the first one alone
+void AVROTAComponent::broadcast_route_(bool write) {
+  if (this->broadcast_enables_.empty() || !pmode || write == this->broadcast_joined_)
+    return;
+  commit_finish_();
+
+  if (!write) {
+    // Let the others run so only the first target drives MISO
+    for (auto *target : this->broadcast_enables_) target->set_state(true);
+    this->broadcast_joined_ = false;
+    return;
+  }
+
+  // Bring the others back into programming mode. The first target sees the
+  // programming enable as well, which it ignores
+  for (auto *target : this->broadcast_enables_) target->set_state(false);
+  delay(30);
+  uint8_t buf[4] = {0xAC, 0x53, 0x00, 0x00};
+  this->transfer_array(buf, 4);
+  this->broadcast_joined_ = true;
+}
+
+// Remember a broadcast page so every target can be checked against it
+void AVROTAComponent::broadcast_record_(int page, const uint8_t *data, int length) {
+  if (this->broadcast_enables_.empty())
+    return;
+  this->broadcast_pages_.push_back({(uint32_t) page * 2, (uint16_t) length, avrisp_crc32(0, data, length)});
+}
+
+// Pulse the reset of a single target and send it the programming enable.
+// The others must be out of programming mode
+bool AVROTAComponent::program_enable_target_(output::BinaryOutput *target) {
+  target->set_state(true);
+  delayMicroseconds(50);
+  target->set_state(false);
+  delay(30);
+  this->ext_addr_ = 0;
+  uint8_t buf[4] = {0xAC, 0x53, 0x00, 0x00};
+  this->transfer_array(buf, 4);
+  return buf[2] == 0x53;
+}
+
+// Read the pages written this session back from each target in turn,
+// holding the others out of programming mode. Returns the number of
+// targets that don't match
+int AVROTAComponent::broadcast_verify_() {
+  if (this->broadcast_enables_.empty() || this->broadcast_pages_.empty())
+    return 0;
+  commit_finish_();
+
+  uint32_t started = millis();
+  int failed = 0;
+  int targets = 1 + this->broadcast_enables_.size();
+  for (int t = 0; t < targets; t++) {
+    output::BinaryOutput *target = t == 0 ? this->avr_enable_ : this->broadcast_enables_[t - 1];
+    this->avr_enable_->set_state(true);
+    for (auto *other : this->broadcast_enables_) other->set_state(true);
+
+    bool ok = program_enable_target_(target);
+    for (auto &check : this->broadcast_pages_) {
+      if (!ok) break;
+      here = check.addr / 2;
+      uint32_t crc = 0;
+      for (int x = 0; x < check.length; x += this->buff_size_) {
+        int n = std::min<int>(check.length - x, this->buff_size_);
+        read_flash_bytes_(this->buff, n);
+        crc = avrisp_crc32(crc, this->buff, n);
+      }
+      if (crc != check.crc) {
+        ESP_LOGW(TAG, "[AVRISP] Target %d differs in the page at 0x%05x", t + 1, check.addr);
+        ok = false;
+      }
+    }
+    if (!ok) {
+      ESP_LOGW(TAG, "[AVRISP] Target %d failed verification", t + 1);
+      failed++;
+    }
+  }
+  ESP_LOGI(TAG, "[AVRISP] Verified %u pages on %d targets in %u ms, %d failed", this->broadcast_pages_.size(),
+           targets, millis() - started, failed);
+
+  // Only the last target is left in programming mode, callers end it next
+  this->broadcast_joined_ = false;
+  this->broadcast_pages_.clear();
+  error += failed;
+  return failed;
 }
 
 float AVROTAComponent::get_setup_priority() const { return setup_priority::AFTER_WIFI; }
@@ -218,9 +538,7 @@ void AVROTAComponent::set_ws_port(uint16_t port) { this->port_ = port; }
 AVRISPState_t AVROTAComponent::isp_update() {
   switch (this->_state) {
     case AVRISP_STATE_FORCED_SHUTDOWN: {
-      if (this->spi_transaction_active)
-        this->disable();  // SPI.end();
-      this->spi_transaction_active = false;
+      this->session_end_();
 
       // Reset the AVR Device
       this->set_enable_(false);
@@ -233,6 +551,7 @@ AVRISPState_t AVROTAComponent::isp_update() {
     case AVRISP_STATE_IDLE: {
       // If a client is now connected, move to pending
       if (this->socket.status == WebSocketConnected) {
+        this->session_begin_();
         _state = AVRISP_STATE_PENDING;
       }
       break;
@@ -247,21 +566,14 @@ AVRISPState_t AVROTAComponent::isp_update() {
       // If the websocket is still active, then run the avr isp
       if (this->socket.status == WebSocketConnected) {
         _state = AVRISP_STATE_ACTIVE;
-        avrisp();
+        // Only start a command once its first byte is there, so waiting
+        // for the client doesn't hold up the loop
+        if (this->socket.available())
+          avrisp();
       }
       // If the websocket is in any other state, then go idle
       else {
-        // If we were in programming mode, then stop the spi transaction
-        if (pmode) {
-          if (this->spi_transaction_active)
-            this->disable();  // SPI.end();
-          this->spi_transaction_active = false;
-          pmode = 0;
-        }
-
-        // Enable the AVR device
-        this->set_enable_(true);
-
+        this->session_end_();
         _state = AVRISP_STATE_IDLE;
       }
       break;
@@ -270,7 +582,230 @@ AVRISPState_t AVROTAComponent::isp_update() {
   return this->_state;
 }
 
-AVRISPState_t AVROTAComponent::get_avr_state() { return this->_state; }
+AVRISPState_t AVROTAComponent::get_avr_state() {
+#ifdef USE_AVR_OTA_TASK
+  // _state belongs to the engine task, report what the main loop last saw
+  if (this->task_.is_running()) return this->reported_state_;
+#endif
+  return this->_state;
+}
+
+// Clear the session counters when a new client connects
+void AVROTAComponent::session_begin_() {
+  memset(&this->session, 0, sizeof(this->session));
+  this->session.started = millis();
+  this->socket.wait_us = 0;
+  this->sck_request_ = 0;
+  this->session_protocol_ = this->protocol_;
+  this->erased_ = false;
+  this->image_.abort();
+  this->broadcast_pages_.clear();
+  this->broadcast_pages_.shrink_to_fit();
+}
+
+// Tear down a session the client didn't end with LEAVE_PROGMODE. A page
+// still programming is finished before reset is released, and the target
+// leaves programming mode the same way as on a clean leave
+void AVROTAComponent::session_end_() {
+  if (pmode)
+    end_pmode();
+  spi_end_();
+
+  // Enable the AVR device
+  this->set_enable_(true);
+
+  this->session_report_();
+}
+
+// Log the throughput of the session that just ended
+void AVROTAComponent::session_report_() {
+  // An image that wasn't committed by a clean leave is dropped
+  this->image_.abort();
+  if (this->session.started == 0) return;
+
+  this->session.errors += error;
+  error = 0;
+  this->session.socket_wait_us = this->socket.wait_us;
+
+  uint32_t elapsed = millis() - this->session.started;
+  uint32_t bytes = this->session.flash_bytes + this->session.eeprom_bytes;
+  float kbps = elapsed > 0 ? (bytes / 1024.0f) / (elapsed / 1000.0f) : 0.0f;
+  float trips = this->session.pages > 0 ? (float) this->session.commands / this->session.pages : 0.0f;
+
+  ESP_LOGI(TAG, "[AVRISP] Session: %u bytes in %u ms (%.2f KB/s)", bytes, elapsed, kbps);
+  ESP_LOGI(TAG, "[AVRISP]   Flash: %u bytes, %u pages, %.1f round trips per page", this->session.flash_bytes,
+           this->session.pages, trips);
+  if (this->differential_)
+    ESP_LOGI(TAG, "[AVRISP]   Differential: %u pages written, %u pages unchanged", this->session.pages,
+             this->session.pages_skipped);
+  if (this->session.pages_blank > 0 || this->session.words_blank > 0)
+    ESP_LOGI(TAG, "[AVRISP]   Erased: %u blank pages and %u blank words not written", this->session.pages_blank,
+             this->session.words_blank);
+  ESP_LOGI(TAG, "[AVRISP]   Commit: %u ms (%u us/page avg, %u us max)", this->session.commit_us / 1000,
+           this->session.pages > 0 ? this->session.commit_us / this->session.pages : 0, this->session.commit_max_us);
+  ESP_LOGI(TAG, "[AVRISP]   EEPROM: %u bytes in %u ms", this->session.eeprom_bytes, this->session.eeprom_us / 1000);
+  if (this->session.compressed_bytes > 0)
+    ESP_LOGI(TAG, "[AVRISP]   Compressed: %u bytes received, %u bytes decompressed", this->session.compressed_bytes,
+             this->session.decompressed_bytes);
+  ESP_LOGI(TAG, "[AVRISP]   Read: %u bytes, SPI: %u instructions, socket wait: %u ms, errors: %u",
+           this->session.read_bytes, this->session.spi_transactions, this->session.socket_wait_us / 1000,
+           this->session.errors);
+  ESP_LOGI(TAG, "[AVRISP]   Network: RTT %u.%03u ms +/- %u.%03u ms, socket timeout %u ms",
+           this->socket.get_srtt_us() / 1000, this->socket.get_srtt_us() % 1000, this->socket.get_rttvar_us() / 1000,
+           this->socket.get_rttvar_us() % 1000, this->socket.get_timeout());
+  AVRISP_event_t event{};
+  event.type = AVRISP_EVENT_SESSION;
+  event.elapsed = elapsed;
+  event.bytes = bytes;
+  event.kbps = kbps;
+  event.session = this->session;
+  this->post_event_(event);
+  this->session.started = 0;
+}
+
+// Publish the session statistics to any configured sensors
+void AVROTAComponent::session_publish_([[maybe_unused]] const AVRISP_event_t &event) {
+#ifdef USE_SENSOR
+  const AVRISP_session_t &session = event.session;
+  if (this->duration_sensor_ != nullptr)
+    this->duration_sensor_->publish_state(event.elapsed);
+  if (this->bytes_written_sensor_ != nullptr)
+    this->bytes_written_sensor_->publish_state(event.bytes);
+  if (this->bytes_read_sensor_ != nullptr)
+    this->bytes_read_sensor_->publish_state(session.read_bytes);
+  if (this->pages_sensor_ != nullptr)
+    this->pages_sensor_->publish_state(session.pages);
+  if (this->spi_transactions_sensor_ != nullptr)
+    this->spi_transactions_sensor_->publish_state(session.spi_transactions);
+  if (this->commit_time_sensor_ != nullptr)
+    this->commit_time_sensor_->publish_state(session.commit_us / 1000.0f);
+  if (this->eeprom_time_sensor_ != nullptr)
+    this->eeprom_time_sensor_->publish_state(session.eeprom_us / 1000.0f);
+  if (this->socket_wait_time_sensor_ != nullptr)
+    this->socket_wait_time_sensor_->publish_state(session.socket_wait_us / 1000.0f);
+  if (this->errors_sensor_ != nullptr)
+    this->errors_sensor_->publish_state(session.errors);
+  if (this->throughput_sensor_ != nullptr)
+    this->throughput_sensor_->publish_state(event.kbps);
+#endif
+#ifdef USE_TEXT_SENSOR
+  if (this->summary_text_sensor_ != nullptr) {
+    const AVRISP_session_t &session = event.session;
+    char summary[96];
+    snprintf(summary, sizeof(summary), "%u bytes in %u ms (%.2f KB/s), %u pages, %u errors", event.bytes,
+             event.elapsed, event.kbps, session.pages, session.errors);
+    this->summary_text_sensor_->publish_state(summary);
+  }
+#endif
+}
+
+// Add flash data that is about to be programmed to the image being
+// recorded. addr is a byte address
+void AVROTAComponent::image_record_(uint32_t addr, const uint8_t *data, int length) {
+  if (!this->image_.is_available() || this->image_.get_state() == ImageStoreFailed)
+    return;
+  // Without a chip erase the pages that aren't written keep whatever was
+  // there before, which the image wouldn't hold
+  if (!this->erased_) {
+    this->image_.fail();
+    return;
+  }
+  if (this->image_.get_state() == ImageStoreIdle) {
+    // The signature can't be read while a page is still programming, nor
+    // while the broadcast targets drive MISO along with the first one
+    commit_finish_();
+    bool joined = this->broadcast_joined_;
+    broadcast_route_(false);
+    uint32_t signature = read_signature_bytes_();
+    broadcast_route_(joined);
+    if (!this->image_.begin(signature, param.pagesize))
+      return;
+  }
+  this->image_.append(addr, data, length);
+}
+
+// The programmer left programming mode cleanly, keep what was recorded if
+// it is the whole flash: erased first and every page written without error
+void AVROTAComponent::image_commit_() {
+  if (this->image_.get_state() != ImageStoreRecording)
+    return;
+  if (!this->erased_ || this->session.errors > 0 || this->commit_failed_) {
+    ESP_LOGW(TAG, "[AVRISP] Session had errors, the stored image is kept");
+    this->image_.fail();
+    return;
+  }
+  this->image_.commit();
+}
+
+// Reprogram the AVR from the stored image. The records are mapped from
+// flash and loaded into the target from there, so no copy is made in RAM
+bool AVROTAComponent::reflash() {
+#ifdef USE_AVR_OTA_TASK
+  if (this->task_request_(AVRISP_REQUEST_REFLASH)) return true;
+#endif
+  return this->reflash_();
+}
+
+bool AVROTAComponent::reflash_() {
+  if (this->_state != AVRISP_STATE_IDLE) {
+    ESP_LOGW(TAG, "[AVRISP] Can't reflash during a programming session");
+    return false;
+  }
+
+  ImageHeader_t header;
+  const uint8_t *records;
+  if (!this->image_.open(&header, &records))
+    return false;
+
+  uint32_t started = millis();
+  ESP_LOGI(TAG, "[AVRISP] Reflashing image %u: %u pages, signature %06x", header.sequence, header.records,
+           header.signature);
+
+  // Describe the part from the image, there is no SET_DEVICE to go by
+  param.pagesize = header.pagesize;
+  param.polling = 1;
+  param.flashpoll = 0xFF;
+  this->sck_request_ = 0;
+
+  bool ok = false;
+  start_pmode();
+  uint32_t found = this->isp_synced_ ? read_signature_bytes_() : 0;
+  if (!this->isp_synced_) {
+    ESP_LOGW(TAG, "[AVRISP] Reflash failed, target did not sync");
+  } else if (found != header.signature) {
+    ESP_LOGW(TAG, "[AVRISP] Reflash failed, signature mismatch, expected %06x found %06x", header.signature, found);
+  } else {
+    spi_transaction(0xAC, 0x80, 0x00, 0x00);
+    wait_ready_(AVRISP_ERASE_TIME);
+    chip_erased_(0xAC, 0x80);
+
+    const uint8_t *p = records;
+    const uint8_t *end = records + header.length;
+    for (uint32_t i = 0; i < header.records && p + sizeof(ImageRecord_t) <= end; i++) {
+      const ImageRecord_t *record = (const ImageRecord_t *) p;
+      p += sizeof(ImageRecord_t);
+      if (record->length > (uint32_t) (end - p))
+        break;
+      here = record->addr / 2;
+      write_flash_page_(here, p, record->length, false);
+      p += (record->length + 3) & ~3u;
+      EngineTask::feed_wdt();
+    }
+    commit_finish_();
+    ok = !this->commit_failed_ && p == end;
+    this->commit_failed_ = false;
+    if (broadcast_verify_() > 0)
+      ok = false;
+  }
+  end_pmode();
+  this->image_.close();
+
+  if (ok)
+    ESP_LOGI(TAG, "[AVRISP] Reflash complete in %u ms", millis() - started);
+  else if (this->isp_synced_ && found == header.signature)
+    ESP_LOGW(TAG, "[AVRISP] Reflash failed while programming");
+  return ok;
+}
 
 inline void AVROTAComponent::_reject_incoming(void) {
   // TODO: ?? Seems to limit the server to only one client, but these funcions don't exist in esphome
@@ -290,19 +825,74 @@ uint8_t AVROTAComponent::getch() {
   return buf[0];
 }
 
-void AVROTAComponent::fill(int n) {
+bool AVROTAComponent::fill(int n) {
+  // Too big for the page buffer. Read and drop the bytes so the stream
+  // stays in sync, the caller replies with a failure
+  if (n > (int) this->buff_size_) {
+    ESP_LOGW(TAG, "[AVRISP] %d bytes don't fit the %u byte page buffer", n, this->buff_size_);
+    error++;
+    while (n > 0) {
+      int chunk = std::min(n, (int) this->buff_size_);
+      if (!this->socket.read_bytes(this->buff, chunk)) {
+        this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+        break;
+      }
+      n -= chunk;
+    }
+    return false;
+  }
+
   // Read n bytes into the main buffer. If the read times out, then set the state to idle
   if (!this->socket.read_bytes(this->buff, n)) {
     this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
     for (int i = 0; i < n; i++) this->buff[i] = '\00';
   }
+  return true;
 }
 
 uint8_t AVROTAComponent::spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  if (this->boot_uart_ != nullptr)
+    return boot_instruction_(a, b, c, d);
+  this->session.spi_transactions++;
+  AVRISP_TRACE(uint32_t started = micros());
   this->transfer_byte(a);
   this->transfer_byte(b);
   this->transfer_byte(c);
-  return this->transfer_byte(d);
+  uint8_t res = this->transfer_byte(d);
+  AVRISP_TRACE(this->trace_spi_us_ += micros() - started);
+  return res;
+}
+
+// Queue an ISP instruction in the frame, sending the frame first if it's full
+void AVROTAComponent::frame_add_(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  if (this->frame_len_ + 4 > AVRISP_FRAME_SIZE)
+    frame_send_();
+  uint8_t *p = this->frame_ + this->frame_len_;
+  p[0] = a;
+  p[1] = b;
+  p[2] = c;
+  p[3] = d;
+  this->frame_len_ += 4;
+}
+
+// Clock out every queued instruction in one transfer. The bytes read back
+// replace the frame, so the result of instruction i is frame_[4 * i + 3]
+void AVROTAComponent::frame_send_() {
+  if (this->frame_len_ == 0) return;
+  if (this->boot_uart_ != nullptr) {
+    uint8_t *p = this->frame_;
+    for (int i = 0; i < this->frame_len_; i += 4)
+      p[i + 3] = boot_instruction_(p[i], p[i + 1], p[i + 2], p[i + 3]);
+    this->frame_len_ = 0;
+    return;
+  }
+  AVRISP_TRACE(uint32_t started = micros());
+  this->transfer_array(this->frame_, this->frame_len_);
+  AVRISP_TRACE(this->trace_spi_us_ += micros() - started);
+  this->session.spi_transactions += this->frame_len_ / 4;
+  this->frame_len_ = 0;
+  EngineTask::feed_wdt();
+  yield();
 }
 
 void AVROTAComponent::empty_reply() {
@@ -367,6 +957,9 @@ void AVROTAComponent::get_parameter(uint8_t c) {
     case 0x82:
       breply(AVRISP_SWMIN);
       break;
+    case Parm_STK_SCK_DURATION:
+      breply(std::min<uint32_t>(std::max<uint32_t>(AVRISP_SCK_BASE / this->isp_rate_, 1), 255));
+      break;
     case 0x93:
       breply('S');  // serial programmer
       break;
@@ -375,6 +968,18 @@ void AVROTAComponent::get_parameter(uint8_t c) {
   }
 }
 
+void AVROTAComponent::set_parameter(uint8_t c, uint8_t value) {
+  // ESP_LOGI(TAG, "[AVRISP] Set Parameter %02x %02x", c, value);
+  // avrdude -B sends the requested ISP clock period. Honour it for the rest
+  // of the session instead of the configured or negotiated rate
+  if (c == Parm_STK_SCK_DURATION) {
+    this->sck_request_ = AVRISP_SCK_BASE / std::max<uint8_t>(value, 1);
+    ESP_LOGD(TAG, "[AVRISP] Client requested ISP clock %u Hz", this->sck_request_);
+    if (pmode) set_isp_rate_(this->sck_request_);
+  }
+  empty_reply();
+}
+
 void AVROTAComponent::set_parameters() {
   // call this after reading paramter packet into buff[]
   param.devicecode = buff[0];
@@ -396,11 +1001,57 @@ void AVROTAComponent::set_parameters() {
   param.flashsize = buff[16] * 0x01000000 + buff[17] * 0x00010000 + buff[18] * 0x00000100 + buff[19];
 }
 
+void AVROTAComponent::set_ext_parameters() {
+  // call this after reading the extended parameter packet into buff[]
+  // buff[0] is the command size, buff[1] the eeprom page size. The
+  // remaining bytes (pagel, bs2, reset disable) only matter for HV modes
+  param.eeprompagesize = buff[1];
+}
+
 void AVROTAComponent::start_pmode() {
+  // A reset clears the extended address byte
+  this->ext_addr_ = 0;
+  this->load_ext_addr_ = 0;
+  if (this->boot_uart_ != nullptr) {
+    boot_start_pmode_();
+    return;
+  }
   // ESP_LOGI(TAG, "[AVRISP] Start PMode");
-  if (!this->spi_transaction_active) this->enable();
-  this->spi_transaction_active = true;
+  // Start at the requested or configured rate. Auto mode starts at the
+  // bottom of the ladder and works up once the target is in sync
+  uint32_t rate = this->sck_request_ != 0 ? this->sck_request_ : this->isp_clock_;
+  if (rate == 0) rate = AVRISP_CLOCKS[0];
+  set_isp_rate_(rate);
+
+  spi_begin_();
+
+  // If the target doesn't echo programming enable, retry at slower rates
+  bool synced = program_enable_();
+  for (int i = AVRISP_CLOCK_COUNT - 1; i >= 0 && !synced; i--) {
+    if (AVRISP_CLOCKS[i] >= this->isp_rate_) continue;
+    ESP_LOGW(TAG, "[AVRISP] No sync at %u kHz, retrying at %u kHz", this->isp_rate_ / 1000,
+             AVRISP_CLOCKS[i] / 1000);
+    set_isp_rate_(AVRISP_CLOCKS[i]);
+    synced = program_enable_();
+  }
 
+  this->isp_synced_ = synced;
+  if (!synced)
+    ESP_LOGW(TAG, "[AVRISP] Target did not acknowledge programming enable");
+  else if (this->isp_clock_ == 0 && this->sck_request_ == 0)
+    negotiate_clock_();
+  ESP_LOGD(TAG, "[AVRISP] Programming at %u kHz", this->isp_rate_ / 1000);
+
+  this->rdybsy_ = true;
+  this->poll_valid_ = false;
+  this->commit_pending_ = false;
+  this->commit_failed_ = false;
+  pmode = 1;
+}
+
+// Pulse reset and send the programming enable instruction. Returns true if
+// the target echoed the second byte back, meaning it is in sync
+bool AVROTAComponent::program_enable_() {
   // try to sync the bus
   this->transfer_byte(0x00);
 
@@ -411,18 +1062,98 @@ void AVROTAComponent::start_pmode() {
   this->set_enable_(false);
 
   delay(30);
+  this->ext_addr_ = 0;
 
   uint8_t buf[4] = {0xAC, 0x53, 0x00, 0x00};
   this->transfer_array(buf, 4);
 
   // ESP_LOGI(TAG, "Start Buffer %02x %02x %02x %02x", buf[0], buf[1], buf[2], buf[3]);
-  pmode = 1;
+  return buf[2] == 0x53;
+}
+
+uint32_t AVROTAComponent::read_signature_bytes_() {
+  uint32_t sig = spi_transaction(0x30, 0x00, 0x00, 0x00);
+  sig = (sig << 8) | spi_transaction(0x30, 0x00, 0x01, 0x00);
+  sig = (sig << 8) | spi_transaction(0x30, 0x00, 0x02, 0x00);
+  return sig;
+}
+
+// Step the ISP clock up while the target still syncs and reads back the
+// same signature, then settle on the fastest rate that worked
+void AVROTAComponent::negotiate_clock_() {
+  uint32_t signature = read_signature_bytes_();
+  if (signature == 0x000000 || signature == 0xFFFFFF) {
+    ESP_LOGW(TAG, "[AVRISP] Invalid signature %06x, not raising ISP clock", signature);
+    return;
+  }
+
+  uint32_t good = this->isp_rate_;
+  for (int i = 0; i < AVRISP_CLOCK_COUNT; i++) {
+    if (AVRISP_CLOCKS[i] <= good) continue;
+    set_isp_rate_(AVRISP_CLOCKS[i]);
+    if (!program_enable_() || read_signature_bytes_() != signature)
+      break;
+    good = AVRISP_CLOCKS[i];
+  }
+
+  // Re-enter programming mode at the last rate that read back correctly
+  if (this->isp_rate_ != good) {
+    set_isp_rate_(good);
+    program_enable_();
+  }
+}
+
+#ifdef USE_AVR_OTA_TASK
+Mutex AVROTAComponent::spi_lock_;
+#endif
+
+// Take the SPI bus for programming mode. With engine tasks another
+// programmer may have it, wait for its session to end
+void AVROTAComponent::spi_begin_() {
+  if (this->spi_transaction_active) return;
+#ifdef USE_AVR_OTA_TASK
+  while (!spi_lock_.try_lock()) {
+    EngineTask::feed_wdt();
+    delay(1);
+  }
+#endif
+  this->enable();
+  this->spi_transaction_active = true;
+}
+
+void AVROTAComponent::spi_end_() {
+  if (!this->spi_transaction_active) return;
+  this->disable();  // SPI.end();
+  this->spi_transaction_active = false;
+#ifdef USE_AVR_OTA_TASK
+  spi_lock_.unlock();
+#endif
+}
+
+// Change the SPI clock. The device has to be re-registered with the bus for
+// a new rate to take effect
+void AVROTAComponent::set_isp_rate_(uint32_t rate) {
+  if (rate == this->isp_rate_) return;
+
+  bool active = this->spi_transaction_active;
+  if (active) this->disable();
+  this->spi_teardown();
+  this->set_data_rate(rate);
+  this->spi_setup();
+  if (active) this->enable();
+
+  this->isp_rate_ = rate;
 }
 
 void AVROTAComponent::end_pmode() {
+  if (this->boot_uart_ != nullptr) {
+    boot_end_pmode_();
+    return;
+  }
   // ESP_LOGI(TAG, "[AVRISP] End PMode");
-  if (this->spi_transaction_active) this->disable();
-  this->spi_transaction_active = false;
+  // Don't release reset while a pipelined page is still programming
+  commit_finish_();
+  spi_end_();
   this->set_enable_(true);  // setReset(_reset_state);
   pmode = 0;
 }
@@ -432,19 +1163,136 @@ void AVROTAComponent::universal() {
   uint8_t ch;
 
   fill(4);
+  // 0xAC instructions (erase, fuse and lock writes) go to every target
+  broadcast_route_(buff[0] == 0xAC);
   ch = spi_transaction(buff[0], buff[1], buff[2], buff[3]);
+  chip_erased_(buff[0], buff[1]);
+  // avrdude loads the extended address byte itself on large parts
+  if (buff[0] == 0x4D) {
+    this->ext_addr_ = buff[2];
+    this->load_ext_addr_ = buff[2];
+  }
   breply(ch);
 }
 
+// Note a chip erase passed through as a raw instruction
+void AVROTAComponent::chip_erased_(uint8_t a, uint8_t b) {
+  // A bootloader can't erase the chip, pages not written keep their data
+  if (this->boot_uart_ != nullptr) return;
+  if (a == 0xAC && (b & 0xE0) == 0x80) {
+    this->erased_ = true;
+    this->broadcast_pages_.clear();
+  }
+}
+
+// Queue a load program memory instruction. frame_send_() must be called
+// before the page is committed
 void AVROTAComponent::flash(uint8_t hilo, int addr, uint8_t data) {
   // ESP_LOGI(TAG, "[AVRISP] Flash");
-  spi_transaction(0x40 + 8 * hilo, addr >> 8 & 0xFF, addr & 0xFF, data);
+  frame_add_(0x40 + 8 * hilo, addr >> 8 & 0xFF, addr & 0xFF, data);
+
+  // Remember a byte that reads back differently from the poll value so the
+  // commit can be data polled if RDY/BSY isn't available
+  if (data != param.flashpoll) {
+    this->poll_valid_ = true;
+    this->poll_memtype_ = 'F';
+    this->poll_hilo_ = hilo;
+    this->poll_addr_ = addr;
+    this->poll_data_value_ = data;
+  }
 }
 
 void AVROTAComponent::commit(int addr) {
   // ESP_LOGI(TAG, "[AVRISP] Commit");
+  commit_start_(addr);
+  commit_finish_();
+}
+
+// Issue the write page instruction. The target programs the page on its own
+// until commit_finish_() waits for it
+void AVROTAComponent::commit_start_(int addr) {
+  this->commit_started_ = micros();
+  load_extended_address_(addr);
   spi_transaction(0x4C, (addr >> 8) & 0xFF, addr & 0xFF, 0);
-  delay(AVRISP_PTIME);
+  this->commit_pending_ = true;
+}
+
+// Wait for the page started by commit_start_(), if any. Returns false if the
+// target never reported the page as written
+bool AVROTAComponent::commit_finish_() {
+  if (!this->commit_pending_) return true;
+  this->commit_pending_ = false;
+
+  bool res = this->wait_ready_(AVRISP_PTIME);
+  if (!res) {
+    ESP_LOGW(TAG, "[AVRISP] Flash page did not finish programming");
+    this->commit_failed_ = true;
+  }
+
+  this->page_program_us_ = micros() - this->commit_started_;
+  this->session.commit_us += this->page_program_us_;
+  if (this->page_program_us_ > this->session.commit_max_us)
+    this->session.commit_max_us = this->page_program_us_;
+  this->session.pages++;
+  return res;
+}
+
+// Wait for a flash or eeprom write to complete. Uses RDY/BSY polling, then
+// data polling if the device supports it, then a fixed delay of fallback_ms.
+// Returns false only if data polling timed out
+bool AVROTAComponent::wait_ready_(uint32_t fallback_ms) {
+  bool poll_valid = this->poll_valid_;
+  this->poll_valid_ = false;
+
+  // Polling reads MISO, which every joined target drives at once
+  if (this->broadcast_joined_) {
+    delay(fallback_ms);
+    return true;
+  }
+
+  if (this->rdybsy_) {
+    if (this->poll_ready_(AVRISP_POLL_TIMEOUT * 1000))
+      return true;
+    ESP_LOGW(TAG, "[AVRISP] RDY/BSY polling timed out, falling back to %s",
+             param.polling ? "data polling" : "fixed delay");
+    this->rdybsy_ = false;
+  }
+
+  if (param.polling && poll_valid)
+    return this->poll_data_(AVRISP_POLL_TIMEOUT * 1000);
+
+  delay(fallback_ms);
+  return true;
+}
+
+// Poll RDY/BSY (0xF0) until the busy bit clears. Returns false on timeout
+bool AVROTAComponent::poll_ready_(uint32_t timeout_us) {
+  uint32_t started = micros();
+  while (spi_transaction(0xF0, 0x00, 0x00, 0x00) & 0x01) {
+    if (micros() - started > timeout_us)
+      return false;
+    // The engine task may share its core with the main loop
+    yield();
+  }
+  return true;
+}
+
+// Read back the remembered byte until it no longer returns the poll value.
+// Returns false on timeout
+bool AVROTAComponent::poll_data_(uint32_t timeout_us) {
+  uint32_t started = micros();
+  while (true) {
+    uint8_t value;
+    if (this->poll_memtype_ == 'E')
+      value = spi_transaction(0xA0, (this->poll_addr_ >> 8) & 0xFF, this->poll_addr_ & 0xFF, 0xFF);
+    else
+      value = flash_read(this->poll_hilo_, this->poll_addr_);
+    if (value == this->poll_data_value_)
+      return true;
+    if (micros() - started > timeout_us)
+      return false;
+    yield();
+  }
 }
 
 // #define _addr_page(x) (here & 0xFFFFE0)
@@ -464,9 +1312,9 @@ int AVROTAComponent::addr_page(int addr) {
 
 void AVROTAComponent::write_flash(int length) {
   // ESP_LOGI(TAG, "[AVRISP] Write Flash");
-  uint32_t started = millis();
-
-  fill(length);
+  bool fits = fill(length);
+  if (fits)
+    this->session.flash_bytes += length;
 
   if (Sync_CRC_EOP == getch()) {
     // If the write fails, then we are done
@@ -476,7 +1324,7 @@ void AVROTAComponent::write_flash(int length) {
     }
 
     // If the write fails, then we are done
-    if (!this->socket.write(write_flash_pages(length))) {
+    if (!this->socket.write(fits ? write_flash_pages(length) : (uint8_t) Resp_STK_FAILED)) {
       this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
       return;
     }
@@ -492,28 +1340,85 @@ void AVROTAComponent::write_flash(int length) {
 
 uint8_t AVROTAComponent::write_flash_pages(int length) {
   // ESP_LOGI(TAG, "[AVRISP] Write flash pages");
+  // The previous page may still be programming if writes are pipelined
+  commit_finish_();
+
   int x = 0;
-  int page = addr_page(here);
   while (x < length) {
-    App.feed_wdt();
-    yield();
-    if (page != addr_page(here)) {
-      commit(page);
-      page = addr_page(here);
+    // Bytes of buff that belong to the page at here
+    int page = addr_page(here);
+    int n = 0;
+    while (x + n < length && addr_page(here + n / 2) == page) n += 2;
+
+    // Skipped pages are part of the image too
+    image_record_(here * 2, buff + x, n);
+
+    // Leave the page alone if it already holds this data. The read back
+    // sees the real flash contents, so this is also right after a chip erase
+    if (this->differential_ && this->broadcast_enables_.empty() && flash_matches_(buff + x, n)) {
+      here += n / 2;
+      x += n;
+      this->session.pages_skipped++;
+      continue;
     }
-    flash(0, here, buff[x++]);
-    flash(1, here, buff[x++]);
-    here++;
+
+    // When pipelined, reply now and let the last page program while the
+    // next one is received. Any failure is reported on the next reply
+    write_flash_page_(page, buff + x, n, this->pipelined_ && x + n >= length);
+    x += n;
+  }
+
+  if (this->commit_failed_) {
+    this->commit_failed_ = false;
+    this->image_.fail();
+    error++;
+    return Resp_STK_FAILED;
   }
-  commit(page);
   return Resp_STK_OK;
 }
 
+// Load length bytes of data at here and commit the page. The data must not
+// cross a page boundary. After a chip erase 0xFF words are left out, they
+// are already 0xFF in the page buffer, and a page of only 0xFF isn't
+// committed at all
+void AVROTAComponent::write_flash_page_(int page, const uint8_t *data, int length, bool pipeline) {
+  if (this->boot_uart_ != nullptr) {
+    boot_write_page_('F', here, data, length);
+    here += length / 2;
+    return;
+  }
+  broadcast_record_(here, data, length);
+  int loaded = 0;
+  for (int i = 0; i < length; i += 2) {
+    if (this->erased_ && data[i] == 0xFF && data[i + 1] == 0xFF) {
+      this->session.words_blank++;
+      here++;
+      continue;
+    }
+    flash(0, here, data[i]);
+    flash(1, here, data[i + 1]);
+    here++;
+    loaded++;
+  }
+  if (loaded == 0 && this->erased_ && !this->page_loaded_) {
+    this->session.pages_blank++;
+    return;
+  }
+  frame_send_();
+  this->page_loaded_ = false;
+
+  if (pipeline)
+    commit_start_(page);
+  else
+    commit(page);
+}
+
 uint8_t AVROTAComponent::write_eeprom(int length) {
   // ESP_LOGI(TAG, "[AVRISP] Write EEPROM");
   // here is a word address, get the byte address
   int start = here * 2;
   int remaining = length;
+  commit_finish_();
   if (length > param.eepromsize) {
     error++;
     return Resp_STK_FAILED;
@@ -522,7 +1427,7 @@ uint8_t AVROTAComponent::write_eeprom(int length) {
     write_eeprom_chunk(start, EECHUNK);
     start += EECHUNK;
     remaining -= EECHUNK;
-    App.feed_wdt();
+    EngineTask::feed_wdt();
     yield();
   }
   write_eeprom_chunk(start, remaining);
@@ -531,19 +1436,61 @@ uint8_t AVROTAComponent::write_eeprom(int length) {
 // write (length) bytes, (start) is a byte address
 uint8_t AVROTAComponent::write_eeprom_chunk(int start, int length) {
   // ESP_LOGI(TAG, "[AVRISP] Write EEPROM Chunk");
-  // this writes byte-by-byte,
-  // page writing may be faster (4 bytes at a time)
   fill(length);
+  uint32_t started = micros();
   // prog_lamp(0);
+  // use page mode when avrdude sent a usable eeprom page size
+  int pagesize = param.eeprompagesize;
+  if (this->boot_uart_ != nullptr && (start & 1) == 0)
+    boot_write_page_('E', start / 2, buff, length);
+  else if (pagesize > 1 && (pagesize & (pagesize - 1)) == 0)
+    write_eeprom_pages_(start, length);
+  else
+    write_eeprom_bytes_(start, length);
+  // prog_lamp(1);
+  this->session.eeprom_us += micros() - started;
+  this->session.eeprom_bytes += length;
+  return Resp_STK_OK;
+}
+
+// Fallback for parts without eeprom pages: one 0xC0 write per byte
+void AVROTAComponent::write_eeprom_bytes_(int start, int length) {
   for (int x = 0; x < length; x++) {
     int addr = start + x;
     spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buff[x]);
-    App.feed_wdt();
+    eeprom_poll_candidate_(addr, buff[x]);
+    wait_ready_(AVRISP_EETIME);
+    EngineTask::feed_wdt();
     yield();
-    delay(45);
   }
-  // prog_lamp(1);
-  return Resp_STK_OK;
+}
+
+// Load each eeprom page with 0xC1 and program it with a single 0xC2
+void AVROTAComponent::write_eeprom_pages_(int start, int length) {
+  int pagesize = param.eeprompagesize;
+  int x = 0;
+  while (x < length) {
+    int page = (start + x) & ~(pagesize - 1);
+    do {
+      int addr = start + x;
+      frame_add_(0xC1, 0x00, addr & (pagesize - 1), buff[x]);
+      eeprom_poll_candidate_(addr, buff[x]);
+      x++;
+    } while (x < length && ((start + x) & (pagesize - 1)) != 0);
+    frame_add_(0xC2, (page >> 8) & 0xFF, page & 0xFF, 0x00);
+    frame_send_();
+    wait_ready_(AVRISP_EETIME);
+  }
+}
+
+// Remember an eeprom byte that can be data polled after the write
+void AVROTAComponent::eeprom_poll_candidate_(int addr, uint8_t data) {
+  if (data == ((param.eeprompoll >> 8) & 0xFF) || data == (param.eeprompoll & 0xFF))
+    return;
+  this->poll_valid_ = true;
+  this->poll_memtype_ = 'E';
+  this->poll_addr_ = addr;
+  this->poll_data_value_ = data;
 }
 
 void AVROTAComponent::program_page() {
@@ -584,44 +1531,145 @@ void AVROTAComponent::program_page() {
 
 uint8_t AVROTAComponent::flash_read(uint8_t hilo, int addr) {
   // ESP_LOGI(TAG, "[AVRISP] Flash Read");
+  load_extended_address_(addr);
   return spi_transaction(0x20 + hilo * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0);
 }
 
+// Select the 64K word segment of the word address addr on parts over
+// 128 KB. Only sent when the segment changes, so small parts never see it
+void AVROTAComponent::load_extended_address_(int addr) {
+  uint8_t ext = (addr >> 16) & 0xFF;
+  if (ext == this->ext_addr_) return;
+  this->ext_addr_ = ext;
+  spi_transaction(0x4D, 0x00, ext, 0x00);
+}
+
+// Selects the segment of the word address addr, x bytes past here, and
+// returns how many of the next n bytes are in it
+int AVROTAComponent::flash_span_(int addr, int x, int n) {
+  load_extended_address_(addr);
+  return std::min(n, (0x10000 - (addr & 0xFFFF)) * 2 - (x & 1));
+}
+
+// Read (length) flash bytes starting at the word address here into data,
+// advancing here
+void AVROTAComponent::read_flash_bytes_(uint8_t *data, int length) {
+  if (this->boot_uart_ != nullptr) {
+    boot_read_page_('F', here, data, length);
+    here += (length + 1) / 2;
+    return;
+  }
+  int x = 0;
+  while (x < length) {
+    // One read instruction per byte, alternating low and high bytes
+    int n = flash_span_(here + x / 2, x, std::min(length - x, AVRISP_FRAME_SIZE / 4));
+    for (int i = 0; i < n; i++) {
+      int addr = here + (x + i) / 2;
+      frame_add_(0x20 + ((x + i) & 1) * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+    }
+    frame_send_();
+    for (int i = 0; i < n; i++)
+      *(data + x + i) = this->frame_[4 * i + 3];
+    x += n;
+  }
+  here += (length + 1) / 2;
+}
+
+// Compare (length) bytes of data with the flash at the word address here
+bool AVROTAComponent::flash_matches_(const uint8_t *data, int length) {
+  if (this->boot_uart_ != nullptr)
+    return boot_matches_('F', here, data, length);
+  int x = 0;
+  while (x < length) {
+    int n = flash_span_(here + x / 2, x, std::min(length - x, AVRISP_FRAME_SIZE / 4));
+    for (int i = 0; i < n; i++) {
+      int addr = here + (x + i) / 2;
+      frame_add_(0x20 + ((x + i) & 1) * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+    }
+    frame_send_();
+    for (int i = 0; i < n; i++) {
+      if (this->frame_[4 * i + 3] != data[x + i])
+        return false;
+    }
+    x += n;
+  }
+  return true;
+}
+
+// Read (length) eeprom bytes starting at the byte address start into data
+void AVROTAComponent::read_eeprom_bytes_(uint8_t *data, int start, int length) {
+  // The bootloader addresses eeprom in words, odd starts go byte by byte
+  if (this->boot_uart_ != nullptr && (start & 1) == 0) {
+    boot_read_page_('E', start / 2, data, length);
+    return;
+  }
+  int x = 0;
+  while (x < length) {
+    int n = std::min(length - x, AVRISP_FRAME_SIZE / 4);
+    for (int i = 0; i < n; i++) {
+      int addr = start + x + i;
+      frame_add_(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF);
+    }
+    frame_send_();
+    for (int i = 0; i < n; i++)
+      *(data + x + i) = this->frame_[4 * i + 3];
+    x += n;
+  }
+}
+
+// Compare (length) bytes of data with the eeprom at the byte address start
+bool AVROTAComponent::eeprom_matches_(const uint8_t *data, int start, int length) {
+  if (this->boot_uart_ != nullptr && (start & 1) == 0)
+    return boot_matches_('E', start / 2, data, length);
+  int x = 0;
+  while (x < length) {
+    int n = std::min(length - x, AVRISP_FRAME_SIZE / 4);
+    for (int i = 0; i < n; i++) {
+      int addr = start + x + i;
+      frame_add_(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF);
+    }
+    frame_send_();
+    for (int i = 0; i < n; i++) {
+      if (this->frame_[4 * i + 3] != data[x + i])
+        return false;
+    }
+    x += n;
+  }
+  return true;
+}
+
 void AVROTAComponent::flash_read_page(int length) {
   // ESP_LOGI(TAG, "[AVRISP] Flash Read Page");
-  uint8_t *data = (uint8_t *) malloc(length + 1);
-  for (int x = 0; x < length; x += 2) {
-    *(data + x) = flash_read(0, here);
-    *(data + x + 1) = flash_read(1, here);
-    here++;
-    App.feed_wdt();
+  if (length > (int) this->buff_size_) {
+    ESP_LOGW(TAG, "[AVRISP] Read of %d bytes doesn't fit the %u byte page buffer", length, this->buff_size_);
+    error++;
+    if (!this->socket.write(Resp_STK_FAILED)) this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return;
   }
-  *(data + length) = Resp_STK_OK;
-  
+  read_flash_bytes_(this->buff, length);
+  this->session.read_bytes += length;
+
   // If the write fails, then set the state to idle
-  if (!this->socket.write_bytes(data, length + 1)) this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
-  
-  free(data);
+  if (!this->socket.write_bytes(this->buff, length) || !this->socket.write(Resp_STK_OK))
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
   return;
 }
 
 void AVROTAComponent::eeprom_read_page(int length) {
   // ESP_LOGI(TAG, "[AVRISP] EEPROM Read Page");
-  // here again we have a word address
-  uint8_t *data = (uint8_t *) malloc(length + 1);
-  int start = here * 2;
-  for (int x = 0; x < length; x++) {
-    int addr = start + x;
-    uint8_t ee = spi_transaction(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF);
-    *(data + x) = ee;
-    App.feed_wdt();
+  if (length > (int) this->buff_size_) {
+    ESP_LOGW(TAG, "[AVRISP] Read of %d bytes doesn't fit the %u byte page buffer", length, this->buff_size_);
+    error++;
+    if (!this->socket.write(Resp_STK_FAILED)) this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return;
   }
-  *(data + length) = Resp_STK_OK;
+  // here again we have a word address
+  read_eeprom_bytes_(this->buff, here * 2, length);
+  this->session.read_bytes += length;
 
   // If the write fails, then set the state to idle
-  if (!this->socket.write_bytes(data, length + 1)) this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
-
-  free(data);
+  if (!this->socket.write_bytes(this->buff, length) || !this->socket.write(Resp_STK_OK))
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
   return;
 }
 
@@ -692,9 +1740,50 @@ void AVROTAComponent::read_signature() {
 void AVROTAComponent::avrisp() {
   uint8_t data, low, high;
   uint8_t ch = getch();
+
+  // The first byte of a session tells the protocols apart
+  if (this->session_protocol_ == AVRISP_PROTOCOL_AUTO && this->_state != AVRISP_STATE_FORCED_SHUTDOWN) {
+    if (ch == MESSAGE_START)
+      this->session_protocol_ = AVRISP_PROTOCOL_STK500V2;
+    else if (ch == NATIVE_MAGIC)
+      this->session_protocol_ = AVRISP_PROTOCOL_NATIVE;
+    else
+      this->session_protocol_ = AVRISP_PROTOCOL_STK500V1;
+    ESP_LOGD(TAG, "[AVRISP] Detected %s client",
+             this->session_protocol_ == AVRISP_PROTOCOL_STK500V2 ? "stk500v2"
+             : this->session_protocol_ == AVRISP_PROTOCOL_NATIVE ? "native upload"
+                                                                 : "stk500v1");
+  }
+  AVRISP_TRACE(this->trace_.begin(ch, this->trace_counters_()));
+  if (this->session_protocol_ == AVRISP_PROTOCOL_STK500V2 && this->boot_uart_ != nullptr) {
+    // stk500v2 sends raw ISP instructions for everything, it needs SPI
+    ESP_LOGW(TAG, "[AVRISP] stk500v2 clients need SPI ISP, not the bootloader");
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    AVRISP_TRACE(this->trace_.end(this->trace_counters_()));
+    return;
+  }
+  if (this->session_protocol_ == AVRISP_PROTOCOL_STK500V2) {
+    stk500v2(ch);
+    AVRISP_TRACE(this->trace_.end(this->trace_counters_()));
+    return;
+  }
+  if (this->session_protocol_ == AVRISP_PROTOCOL_NATIVE) {
+    native_upload(ch);
+    AVRISP_TRACE(this->trace_.end(this->trace_counters_()));
+    return;
+  }
+
+  this->session.commands++;
   // AVRISP_DEBUG("CMD 0x%02x", ch);
+
+  // A pipelined page commit must finish before anything else uses the target
+  if (ch != Cmnd_STK_LOAD_ADDRESS && ch != Cmnd_STK_PROG_PAGE)
+    commit_finish_();
+  if (ch == Cmnd_STK_PROG_PAGE || ch == Cmnd_STK_READ_PAGE)
+    broadcast_route_(ch == Cmnd_STK_PROG_PAGE);
   switch (ch) {
     case Cmnd_STK_GET_SYNC:
+      this->session.errors += error;
       error = 0;
       empty_reply();
       break;
@@ -722,14 +1811,21 @@ void AVROTAComponent::avrisp() {
       get_parameter(getch());
       break;
 
+    case Cmnd_STK_SET_PARAMETER:
+      data = getch();
+      set_parameter(data, getch());
+      break;
+
     case Cmnd_STK_SET_DEVICE:
+      param.eeprompagesize = 0;
       fill(20);
       set_parameters();
       empty_reply();
       break;
 
-    case Cmnd_STK_SET_DEVICE_EXT:  // ignored
+    case Cmnd_STK_SET_DEVICE_EXT:
       fill(5);
+      set_ext_parameters();
       empty_reply();
       break;
 
@@ -741,6 +1837,7 @@ void AVROTAComponent::avrisp() {
     case Cmnd_STK_LOAD_ADDRESS:
       here = getch();
       here += 256 * getch();
+      here += this->load_ext_addr_ << 16;
       // AVRISP_DEBUG("here=0x%04x", here);
       empty_reply();
       break;
@@ -771,9 +1868,13 @@ void AVROTAComponent::avrisp() {
       break;
 
     case Cmnd_STK_LEAVE_PROGMODE:
+      broadcast_verify_();
+      this->session.errors += error;
       error = 0;
       end_pmode();
+      image_commit_();
       empty_reply();
+      this->socket.flush();
       delay(5);
       ESP_LOGI(TAG, "Command STK Leave Program Mode -> Socket Close");
       this->socket.close();
@@ -782,6 +1883,7 @@ void AVROTAComponent::avrisp() {
       break;
 
     case Cmnd_STK_READ_SIGN:
+      broadcast_route_(false);
       read_signature();
       break;
       // expecting a command, not Sync_CRC_EOP
@@ -807,6 +1909,11 @@ void AVROTAComponent::avrisp() {
         }
       }
   }
+
+  // Send the complete reply for this command as a single segment
+  if (this->socket.status == WebSocketConnected && !this->socket.flush())
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+  AVRISP_TRACE(this->trace_.end(this->trace_counters_()));
 }
 
 }  // namespace avr_ota
@@ -6,14 +6,43 @@
 #include "esphome/core/component.h"
 #include "esphome/components/spi/spi.h"
 #include "esphome/components/output/binary_output.h"
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
+#ifdef USE_TEXT_SENSOR
+#include "esphome/components/text_sensor/text_sensor.h"
+#endif
 
 #include "WebSocket.h"
+#include "ImageStore.h"
+#include "CommandTrace.h"
+#include "EngineTask.h"
+#include "Heatshrink.h"
+#include "SpscQueue.h"
+
+#include <atomic>
+
+#include <vector>
 
 namespace esphome
 {
+namespace uart
+{
+class UARTComponent;
+}
 namespace avr_ota
 {
 
+// Size of the buffer used to batch ISP instructions into one SPI transfer.
+// Holds 128 four byte instructions
+static const int AVRISP_FRAME_SIZE = 512;
+
+// Default size of the page buffer, enough for the largest AVR flash page
+static const size_t AVRISP_PAGE_BUFFER_SIZE = 256;
+
+// Largest stk500v2 message body
+static const int AVRISP_V2_BUFFER_SIZE = 275;
+
 // programmer states
 typedef enum {
     AVRISP_STATE_IDLE = 0,       // no active TCP session
@@ -22,6 +51,14 @@ typedef enum {
     AVRISP_STATE_FORCED_SHUTDOWN // programmer will shut down due to a socket failure or shutdown
 } AVRISPState_t;
 
+// programmer protocols
+typedef enum {
+    AVRISP_PROTOCOL_AUTO = 0,    // detected from the first byte of each session
+    AVRISP_PROTOCOL_STK500V1,    // avrdude -c stk500v1 / arduino
+    AVRISP_PROTOCOL_STK500V2,    // avrdude -c stk500v2 / avrispv2
+    AVRISP_PROTOCOL_NATIVE,      // tools/avr_ota_upload.py streaming upload
+} AVRISPProtocol_t;
+
 typedef enum {
   AVR_RESTORE_DEFAULT_OFF,
   AVR_RESTORE_DEFAULT_ON,
@@ -48,8 +85,71 @@ typedef struct {
     int pagesize;
     int eepromsize;
     int flashsize;
+    int eeprompagesize;  // from Cmnd_STK_SET_DEVICE_EXT, 0 if not sent
 } AVRISP_parameter_t;
 
+// timing and throughput counters for a single programming session
+typedef struct {
+    uint32_t started;      // millis() when the session became active
+    uint32_t commands;     // stk500 commands handled (one round trip each)
+    uint32_t flash_bytes;  // flash bytes received for programming
+    uint32_t pages;        // flash pages committed
+    uint32_t pages_skipped; // flash pages left alone because they already matched
+    uint32_t pages_blank;  // all 0xFF flash pages not committed after a chip erase
+    uint32_t words_blank;  // 0xFF flash words not loaded after a chip erase
+    uint32_t commit_us;    // time spent in commit()
+    uint32_t commit_max_us; // slowest single page commit
+    uint32_t eeprom_bytes; // eeprom bytes received for programming
+    uint32_t eeprom_us;    // time spent in write_eeprom_chunk()
+    uint32_t read_bytes;   // flash and eeprom bytes read back for the client
+    uint32_t spi_transactions; // four byte ISP instructions sent
+    uint32_t socket_wait_us; // time spent waiting for data from the client
+    uint32_t errors;       // NOSYNC and failed commands, from error
+    uint32_t compressed_bytes;   // compressed native payload bytes received
+    uint32_t decompressed_bytes; // bytes they decompressed to
+} AVRISP_session_t;
+
+// things the engine reports to the main loop
+typedef enum {
+    AVRISP_EVENT_STATE = 0,      // the programmer state changed
+    AVRISP_EVENT_SESSION,        // a session ended, publish its statistics
+    AVRISP_EVENT_ENABLED,        // the web socket was started
+    AVRISP_EVENT_DISABLED,       // the web socket was stopped
+} AVRISPEventType_t;
+
+typedef struct {
+    AVRISPEventType_t type;
+    AVRISPState_t state;         // AVRISP_EVENT_STATE: the new state
+    uint32_t elapsed;            // AVRISP_EVENT_SESSION: duration in ms
+    uint32_t bytes;              // AVRISP_EVENT_SESSION: flash and eeprom bytes programmed
+    float kbps;                  // AVRISP_EVENT_SESSION: throughput
+    AVRISP_session_t session;    // AVRISP_EVENT_SESSION: the counters
+} AVRISP_event_t;
+
+// state of a native streaming upload
+typedef struct {
+    char memtype;          // 'F' or 'E'
+    bool verify;           // read back each page after writing
+    int pagesize;          // bytes per page, 1 for byte-wise eeprom
+    int32_t page;          // byte address of the page held in buff, -1 if none
+    uint32_t next;         // pages below this address have been written
+    uint16_t pages;        // pages written
+    uint8_t hex_state;     // 0 waiting for ':', 1 high nibble, 2 low nibble
+    uint8_t hex_high;      // pending high nibble
+    int hex_len;           // record bytes collected in msg_
+    uint32_t hex_base;     // extended segment / linear address
+} AVRISP_native_t;
+
+// a flash page written while broadcasting, checked on every target at the end
+typedef struct {
+    uint32_t addr;         // byte address
+    uint16_t length;
+    uint32_t crc;          // avrisp_crc32() of the data
+} AVRISP_page_check_t;
+
+// CRC-32 (zlib polynomial), crc is the result of the previous call or 0
+uint32_t avrisp_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
 // Struct for the data stored in persistent storage
 typedef struct {
   bool enabled{false};
@@ -71,9 +171,54 @@ class AVROTAComponent : public EntityBase, public Component,
     // Connect the AVR Enable output. For use by the code builder
     void set_avr_enable(output::BinaryOutput *avr_enable) { avr_enable_ = avr_enable; }
 
+    // Add the enable output of another identical AVR on the same SPI bus.
+    // Writes are then broadcast to all of them and each is verified on its own
+    void add_broadcast_enable(output::BinaryOutput *avr_enable) { broadcast_enables_.push_back(avr_enable); }
+
     // Set the restore mode of this avr
     void set_restore_mode(AVRRestoreMode_t restore_mode) { restore_mode_ = restore_mode; }
 
+    // Reply to a flash page as soon as its commit has started and receive the
+    // next page while the target programs
+    void set_pipelined_writes(bool pipelined) { pipelined_ = pipelined; }
+
+    // Read back each flash page before loading it and skip pages that
+    // already hold the same data
+    void set_differential_writes(bool differential) { differential_ = differential; }
+
+    // Set the size of the page buffer. Larger page reads and writes are
+    // refused. Must be set before setup()
+    void set_page_buffer_size(size_t size) { buff_size_ = size; }
+
+    // Set the protocol spoken on the port
+    void set_protocol(AVRISPProtocol_t protocol) { protocol_ = protocol; }
+
+    // Set the ISP clock in Hz. 0 negotiates the fastest rate the target syncs at
+    void set_isp_clock(uint32_t isp_clock) { isp_clock_ = isp_clock; }
+
+    // Program through a serial bootloader (Optiboot) on this UART instead of
+    // SPI ISP. The enable output is pulsed to reset the target into it
+    void set_bootloader_uart(uart::UARTComponent *uart) { boot_uart_ = uart; }
+    // Baud rate of the bootloader. The UART is switched to it for each
+    // session and back to its own rate afterwards
+    void set_bootloader_baud_rate(uint32_t baud_rate) { boot_baud_rate_ = baud_rate; }
+
+    // Keep the last programmed image in this data partition (ESP32 only)
+    void set_image_partition(const std::string &label) { image_.set_label(label); }
+
+    // Reprogram the AVR from the stored image. Blocks until done, returns
+    // false if there is no usable image or programming failed. With a
+    // dedicated task it is handed to the task and returns true
+    bool reflash();
+
+    // Run the socket and the programmer in their own task instead of the
+    // main loop. Needs dedicated_task so the task code is compiled in
+    void set_dedicated_task(bool dedicated) { dedicated_task_ = dedicated; }
+
+    // Floor and ceiling of the socket read and write timeouts in ms. In
+    // between they follow the round trip time of the client
+    void set_socket_timeouts(uint32_t min_ms, uint32_t max_ms) { socket.set_timeouts(min_ms, max_ms); }
+
     // Getter and setter for the web socket port
     void set_ws_port(uint16_t port);
     uint16_t get_ws_port() const;
@@ -87,7 +232,8 @@ class AVROTAComponent : public EntityBase, public Component,
     // Activate or Deactivate the AVR Programmer
     void toggle();
 
-    // Returns true if the AVR Programmer is enabled (the socket is running)
+    // Returns true if the AVR Programmer is enabled (the socket is running),
+    // as last reported by the engine
     bool is_enabled();
 
     // Stops any in progress AVR actions and resets the coprocessor
@@ -104,6 +250,29 @@ class AVROTAComponent : public EntityBase, public Component,
     AVRISPState_t isp_update();
 
     AVRISPState_t get_avr_state();
+
+    // Log the command trace and latency histograms, if tracing is compiled in
+    void dump_trace();
+
+    // Time the last flash page took to program, in microseconds
+    uint32_t get_page_program_time() const { return this->page_program_us_; }
+
+    // Session statistics, published once when each session ends
+#ifdef USE_SENSOR
+    void set_duration_sensor(sensor::Sensor *sensor) { duration_sensor_ = sensor; }
+    void set_bytes_written_sensor(sensor::Sensor *sensor) { bytes_written_sensor_ = sensor; }
+    void set_bytes_read_sensor(sensor::Sensor *sensor) { bytes_read_sensor_ = sensor; }
+    void set_pages_sensor(sensor::Sensor *sensor) { pages_sensor_ = sensor; }
+    void set_spi_transactions_sensor(sensor::Sensor *sensor) { spi_transactions_sensor_ = sensor; }
+    void set_commit_time_sensor(sensor::Sensor *sensor) { commit_time_sensor_ = sensor; }
+    void set_eeprom_time_sensor(sensor::Sensor *sensor) { eeprom_time_sensor_ = sensor; }
+    void set_socket_wait_time_sensor(sensor::Sensor *sensor) { socket_wait_time_sensor_ = sensor; }
+    void set_errors_sensor(sensor::Sensor *sensor) { errors_sensor_ = sensor; }
+    void set_throughput_sensor(sensor::Sensor *sensor) { throughput_sensor_ = sensor; }
+#endif
+#ifdef USE_TEXT_SENSOR
+    void set_summary_text_sensor(text_sensor::TextSensor *sensor) { summary_text_sensor_ = sensor; }
+#endif
     
   protected:
     CallbackManager<void(void)> enable_callback_{};
@@ -120,8 +289,26 @@ class AVROTAComponent : public EntityBase, public Component,
     output::BinaryOutput *avr_enable_;
     void set_enable_(bool);
 
+    // broadcast programming. While joined every target is in programming
+    // mode and sees the same instructions. Reads need a single target
+    // driving MISO, so the others are released first
+    std::vector<output::BinaryOutput *> broadcast_enables_;
+    bool broadcast_joined_{false};
+    std::vector<AVRISP_page_check_t> broadcast_pages_;
+    void broadcast_route_(bool write);
+    void broadcast_record_(int page, const uint8_t *data, int length);
+    int broadcast_verify_();
+    bool program_enable_target_(output::BinaryOutput *target);
+
     // SPI Vars
     bool spi_transaction_active;
+    void spi_begin_();
+    void spi_end_();
+#ifdef USE_AVR_OTA_TASK
+    // Held from enable() to disable(), so the engine tasks of several
+    // programmers on one bus take turns
+    static Mutex spi_lock_;
+#endif
 
     // Websocket vars
     WebSocket socket;
@@ -132,22 +319,83 @@ class AVROTAComponent : public EntityBase, public Component,
 
     void avrisp(void);           // handle incoming STK500 commands
 
+    // stk500v2 engine, see stk500v2.cpp
+    void stk500v2(uint8_t start);   // handle one stk500v2 message
+    bool stk500v2_read_(uint8_t *buf, int len);
+    void stk500v2_reply_(uint8_t seq, int len);
+    int stk500v2_command_();
+    uint8_t stk500v2_program_(bool eeprom);
+    int stk500v2_read_memory_(bool eeprom);
+    uint8_t stk500v2_get_parameter_(uint8_t);
+    void stk500v2_set_parameter_(uint8_t, uint8_t);
+    // bootloader backend, see optiboot.cpp. Used instead of SPI when
+    // boot_uart_ is set
+    uart::UARTComponent *boot_uart_{nullptr};
+    uint32_t boot_baud_rate_{115200};
+    uint32_t boot_app_baud_rate_{0};  // rate of the UART outside sessions
+    uint32_t boot_signature_{0};      // read when the bootloader syncs
+    void boot_setup_();
+    bool boot_read_(uint8_t *buf, int len, uint32_t timeout_ms);
+    bool boot_command_(const uint8_t *cmd, int len, const uint8_t *data, int data_len, uint8_t *reply,
+                       int reply_len, uint32_t timeout_ms);
+    bool boot_load_address_(int addr);
+    void boot_start_pmode_();
+    void boot_end_pmode_();
+    bool boot_write_page_(char memtype, int addr, const uint8_t *data, int length);
+    bool boot_read_page_(char memtype, int addr, uint8_t *data, int length);
+    bool boot_matches_(char memtype, int addr, const uint8_t *data, int length);
+    uint8_t boot_instruction_(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+    // native streaming upload, see native_upload.cpp
+    void native_upload(uint8_t start);
+    uint8_t native_run_(const uint8_t *header);
+    uint8_t native_store_(uint32_t addr, uint8_t value);
+    uint8_t native_hex_(uint8_t c);
+    uint8_t native_byte_(uint8_t format, uint32_t *addr, uint8_t c);
+    uint8_t native_flush_page_();
+    AVRISP_native_t native;
+    Heatshrink heatshrink_;  // decompresses native uploads, holds a fixed window
+
+    AVRISPProtocol_t protocol_{AVRISP_PROTOCOL_AUTO};
+    AVRISPProtocol_t session_protocol_{AVRISP_PROTOCOL_AUTO};
+    uint8_t msg_[AVRISP_V2_BUFFER_SIZE];
+    int msg_len_{0};
+
     uint8_t getch(void);        // retrieve a character from the remote end
     uint8_t spi_transaction(uint8_t, uint8_t, uint8_t, uint8_t);
+    void frame_add_(uint8_t, uint8_t, uint8_t, uint8_t);
+    void frame_send_();
     void empty_reply(void);
     void breply(uint8_t);
 
     void get_parameter(uint8_t);
+    void set_parameter(uint8_t, uint8_t);
     void set_parameters(void);
+    void set_ext_parameters(void);
     int addr_page(int);
     void flash(uint8_t, int, uint8_t);
     void write_flash(int);
     uint8_t write_flash_pages(int length);
+    void write_flash_page_(int page, const uint8_t *data, int length, bool pipeline);
+    void chip_erased_(uint8_t a, uint8_t b);
     uint8_t write_eeprom(int length);
     uint8_t write_eeprom_chunk(int start, int length);
+    void write_eeprom_bytes_(int start, int length);
+    void write_eeprom_pages_(int start, int length);
+    void eeprom_poll_candidate_(int addr, uint8_t data);
     void commit(int addr);
+    void commit_start_(int addr);
+    bool commit_finish_();
+    bool wait_ready_(uint32_t fallback_ms);
+    bool poll_ready_(uint32_t timeout_us);
+    bool poll_data_(uint32_t timeout_us);
     void program_page();
     uint8_t flash_read(uint8_t hilo, int addr);
+    void load_extended_address_(int addr);
+    int flash_span_(int addr, int x, int n);
+    void read_flash_bytes_(uint8_t *data, int length);
+    bool flash_matches_(const uint8_t *data, int length);
+    bool eeprom_matches_(const uint8_t *data, int start, int length);
+    void read_eeprom_bytes_(uint8_t *data, int start, int length);
     void flash_read_page(int length);
     void eeprom_read_page(int length);
     void read_page();
@@ -155,23 +403,123 @@ class AVROTAComponent : public EntityBase, public Component,
 
     void universal(void);
 
-    void fill(int);             // fill the buffer with n bytes
+    bool fill(int);             // fill the buffer with n bytes
     void start_pmode(void);     // enter program mode
     void end_pmode(void);       // exit program mode
 
-    AVRISPState_t _state;
-    AVRISPState_t _last_state;
+    // ISP clock negotiation
+    bool program_enable_();
+    uint32_t read_signature_bytes_();
+    void negotiate_clock_();
+    void set_isp_rate_(uint32_t rate);
+    uint32_t isp_clock_{spi::DATA_RATE_200KHZ};  // configured rate, 0 for auto
+    uint32_t isp_rate_{spi::DATA_RATE_200KHZ};   // rate currently in use
+    uint32_t sck_request_{0};  // rate requested by Parm_STK_SCK_DURATION
+    bool isp_synced_{false};   // target echoed the last programming enable
+
+    AVRISPState_t _state{AVRISP_STATE_IDLE};
+    AVRISPState_t _last_state{AVRISP_STATE_IDLE};
+
+    // The engine: socket handling, isp_update() and everything below it.
+    // Runs in loop(), or in task_ with dedicated_task. Callbacks, triggers
+    // and sensors stay in the main loop and are reached through events
+    void isp_step_();
+    void post_event_(const AVRISP_event_t &event);
+    void handle_event_(const AVRISP_event_t &event);
+    AVRISPState_t reported_state_{AVRISP_STATE_IDLE};  // last state handled by the main loop
+    std::atomic<bool> enabled_{false};  // socket running, as last reported by the engine
+    bool enable_avr_();
+    void disable_avr_();
+    void reset_();
+    bool reflash_();
+    void dump_trace_();
+    bool dedicated_task_{false};
+#ifdef USE_AVR_OTA_TASK
+    EngineTask task_;
+    SpscQueue<AVRISP_event_t, 16> events_;  // engine task to main loop
+    std::atomic<uint32_t> task_requests_{0};  // AVRISP_REQUEST_* from the main loop
+    bool task_request_(uint32_t request);
+    void task_loop_();
+    static void task_run_(void *component);
+#endif
+
+    // throughput counters for the current session
+    AVRISP_session_t session{};
+    void session_begin_();
+    void session_end_();
+    void session_report_();
+    void session_publish_(const AVRISP_event_t &event);
+#ifdef USE_SENSOR
+    sensor::Sensor *duration_sensor_{nullptr};
+    sensor::Sensor *bytes_written_sensor_{nullptr};
+    sensor::Sensor *bytes_read_sensor_{nullptr};
+    sensor::Sensor *pages_sensor_{nullptr};
+    sensor::Sensor *spi_transactions_sensor_{nullptr};
+    sensor::Sensor *commit_time_sensor_{nullptr};
+    sensor::Sensor *eeprom_time_sensor_{nullptr};
+    sensor::Sensor *socket_wait_time_sensor_{nullptr};
+    sensor::Sensor *errors_sensor_{nullptr};
+    sensor::Sensor *throughput_sensor_{nullptr};
+#endif
+#ifdef USE_TEXT_SENSOR
+    text_sensor::TextSensor *summary_text_sensor_{nullptr};
+#endif
+
+#ifdef USE_AVR_OTA_TRACE
+    CommandTrace trace_;
+    uint32_t trace_spi_us_{0};  // running total of time in SPI transfers
+    CommandTraceCounters_t trace_counters_();
+#endif
+
+    // image store, see reflash()
+    ImageStore image_;
+    void image_record_(uint32_t addr, const uint8_t *data, int length);
+    void image_commit_();
 
     // programmer settings, set by remote end
     AVRISP_parameter_t param;
-    // page buffer
-    uint8_t buff[256];
+    // page buffer, allocated once in setup() so no request allocates.
+    // Requests that don't fit are refused
+    uint8_t *buff{nullptr};
+    size_t buff_size_{AVRISP_PAGE_BUFFER_SIZE};
+
+    // batched ISP instructions, sent with a single transfer_array()
+    uint8_t frame_[AVRISP_FRAME_SIZE];
+    int frame_len_{0};
 
     int error = 0;
     bool pmode = 0;
 
-    // address for reading and writing, set by 'U' command
+    // address for reading and writing, set by 'U' command. A word address,
+    // bits 16 and up select the 64K word segment of parts over 128 KB
     int here;
+    // extended address byte the target holds, and the one the stk500v1
+    // client last loaded, the high byte of its 'U' addresses
+    uint8_t ext_addr_{0};
+    uint8_t load_ext_addr_{0};
+
+    // completion polling. rdybsy_ is cleared for the rest of the session if
+    // the target never answers the RDY/BSY instruction
+    bool rdybsy_{true};
+    bool poll_valid_{false};
+    char poll_memtype_;
+    uint8_t poll_hilo_;
+    int poll_addr_;
+    uint8_t poll_data_value_;
+    uint32_t page_program_us_{0};
+
+    // pipelined page writes. A commit started by commit_start_() stays
+    // pending until commit_finish_(), and a failure is reported on the next
+    // flash page reply
+    bool pipelined_{false};
+    bool differential_{false};
+    // the target was chip erased this session, so its flash reads 0xFF
+    // until written and 0xFF words don't need to be loaded
+    bool erased_{false};
+    bool page_loaded_{false};  // words were loaded without committing the page
+    bool commit_pending_{false};
+    bool commit_failed_{false};
+    uint32_t commit_started_;
 
 
 };
@@ -0,0 +1,66 @@
+//**************************************************************************
+//*
+//* Native streaming upload protocol for the avr_ota port
+//*
+//* The client sends one header followed by the whole image in a single
+//* stream. The ESP programs and verifies the image locally and answers
+//* with a single status reply. All multi-byte fields are big endian.
+//* A compressed payload is decompressed as it arrives, the format then
+//* applies to the decompressed stream.
+//*
+//* Header (24 bytes):
+//*   0  magic        0xA5 'A' 'V' 'R'
+//*   4  version      NATIVE_VERSION
+//*   5  memtype      'F' flash or 'E' eeprom
+//*   6  format       NATIVE_FORMAT_*
+//*   7  flags        NATIVE_FLAG_*
+//*   8  signature    3 bytes, 00 00 00 to skip the signature check
+//*   11 compression  NATIVE_COMPRESS_*, version 2 only (reserved in 1)
+//*   12 pagesize     page size in bytes, 0 or 1 for byte-wise eeprom
+//*   14 window       heatshrink window bits, version 2 only
+//*   15 lookahead    heatshrink lookahead bits, version 2 only
+//*   16 size         payload bytes on the wire
+//*   20 crc32        CRC-32 (IEEE) of the payload bytes on the wire
+//*
+//* Reply (8 bytes):
+//*   0  magic        0xA5
+//*   1  status       NATIVE_STATUS_*
+//*   2  pages        pages written
+//*   4  elapsed      milliseconds from header to reply
+//*
+//**************************************************************************
+
+#define NATIVE_MAGIC               0xA5  // first byte, not an stk500 command
+#define NATIVE_VERSION             2     // highest version understood
+#define NATIVE_VERSION_MIN         1     // uncompressed uploads may still send 1
+#define NATIVE_HEADER_SIZE         24
+#define NATIVE_REPLY_SIZE          8
+
+// *****************[ Payload formats ]***************************
+
+#define NATIVE_FORMAT_RAW          0x00  // binary image starting at address 0
+#define NATIVE_FORMAT_IHEX         0x01  // Intel HEX text
+
+// *****************[ Compression ]***************************
+
+#define NATIVE_COMPRESS_NONE       0x00
+#define NATIVE_COMPRESS_HEATSHRINK 0x01  // heatshrink LZSS, window and lookahead from the header
+
+// *****************[ Header flags ]***************************
+
+#define NATIVE_FLAG_ERASE          0x01  // chip erase before programming flash
+#define NATIVE_FLAG_VERIFY         0x02  // read back every page after writing
+
+// *****************[ Status codes ]***************************
+
+#define NATIVE_STATUS_OK           0x00
+#define NATIVE_STATUS_BAD_HEADER   0x01
+#define NATIVE_STATUS_NO_SYNC      0x02
+#define NATIVE_STATUS_SIGNATURE    0x03
+#define NATIVE_STATUS_HEX_ERROR    0x04
+#define NATIVE_STATUS_ORDER        0x05  // data for a page that was already written
+#define NATIVE_STATUS_WRITE_FAILED 0x06
+#define NATIVE_STATUS_VERIFY       0x07
+#define NATIVE_STATUS_CRC          0x08
+#define NATIVE_STATUS_CONNECTION   0x09
+#define NATIVE_STATUS_BUSY         0x0A  // another client is programming, sent unprompted
@@ -0,0 +1,316 @@
+#include "avr_ota.h"
+#include "avr_commands.h"
+#include "native_commands.h"
+
+#include "esphome/core/application.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace avr_ota {
+
+#define NATIVE_ERASE_TIME 20  // ms, fallback if the chip erase can't be polled
+#define NATIVE_CHUNK 128      // payload bytes read from the socket at a time
+
+static const char *TAG = "avr_ota.native";
+
+static uint32_t native_get32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// Handle a native upload session. start is the first header byte, already
+// read by avrisp(). The whole image is programmed before this returns
+void AVROTAComponent::native_upload(uint8_t start) {
+  uint32_t started = millis();
+
+  uint8_t header[NATIVE_HEADER_SIZE];
+  header[0] = start;
+  if (!this->socket.read_bytes(header + 1, NATIVE_HEADER_SIZE - 1)) {
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return;
+  }
+
+  this->session.commands++;
+  uint8_t status = native_run_(header);
+  if (pmode) end_pmode();
+  if (status != NATIVE_STATUS_OK) {
+    ESP_LOGW(TAG, "[AVRISP] Native upload failed with status %u after %u pages", status, this->native.pages);
+    this->image_.fail();
+    error++;
+  } else {
+    image_commit_();
+  }
+
+  // A dropped connection can't be answered
+  if (status == NATIVE_STATUS_CONNECTION) {
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return;
+  }
+
+  uint32_t elapsed = millis() - started;
+  uint8_t reply[NATIVE_REPLY_SIZE] = {NATIVE_MAGIC,
+                                      status,
+                                      (uint8_t) (this->native.pages >> 8),
+                                      (uint8_t) (this->native.pages & 0xFF),
+                                      (uint8_t) (elapsed >> 24),
+                                      (uint8_t) (elapsed >> 16),
+                                      (uint8_t) (elapsed >> 8),
+                                      (uint8_t) (elapsed & 0xFF)};
+  if (!this->socket.write_bytes(reply, NATIVE_REPLY_SIZE) || !this->socket.flush()) {
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return;
+  }
+
+  ESP_LOGI(TAG, "Native Upload Complete -> Socket Close");
+  this->socket.close();
+}
+
+// Check the header, prepare the target and stream the payload into it.
+// Returns the status for the reply
+uint8_t AVROTAComponent::native_run_(const uint8_t *header) {
+  uint8_t memtype = header[5];
+  uint8_t format = header[6];
+  uint8_t flags = header[7];
+  uint32_t signature = (uint32_t) header[8] << 16 | (uint32_t) header[9] << 8 | header[10];
+  uint8_t compression = header[4] >= 2 ? header[11] : NATIVE_COMPRESS_NONE;
+  int pagesize = header[12] * 256 + header[13];
+  uint32_t size = native_get32(header + 16);
+  uint32_t crc = native_get32(header + 20);
+
+  memset(&this->native, 0, sizeof(this->native));
+  this->native.page = -1;
+
+  if (header[1] != 'A' || header[2] != 'V' || header[3] != 'R' || header[4] < NATIVE_VERSION_MIN ||
+      header[4] > NATIVE_VERSION)
+    return NATIVE_STATUS_BAD_HEADER;
+  if (compression == NATIVE_COMPRESS_HEATSHRINK) {
+    if (!this->heatshrink_.begin(header[14], header[15]))
+      return NATIVE_STATUS_BAD_HEADER;
+  } else if (compression != NATIVE_COMPRESS_NONE) {
+    return NATIVE_STATUS_BAD_HEADER;
+  }
+  if (memtype != 'F' && memtype != 'E')
+    return NATIVE_STATUS_BAD_HEADER;
+  if (format != NATIVE_FORMAT_RAW && format != NATIVE_FORMAT_IHEX)
+    return NATIVE_STATUS_BAD_HEADER;
+  // flash needs one of the page sizes addr_page() knows, eeprom may be
+  // written byte by byte
+  if (pagesize <= 1 && memtype == 'E')
+    pagesize = 1;
+  if (pagesize < 1 || pagesize > (int) this->buff_size_ || (pagesize & (pagesize - 1)) != 0 ||
+      (memtype == 'F' && (pagesize < 32 || pagesize > 256)))
+    return NATIVE_STATUS_BAD_HEADER;
+
+  ESP_LOGI(TAG, "[AVRISP] Native upload: %u bytes of %s%s %s, %d byte pages", size,
+           compression == NATIVE_COMPRESS_HEATSHRINK ? "compressed " : "",
+           format == NATIVE_FORMAT_IHEX ? "Intel HEX" : "raw", memtype == 'F' ? "flash" : "eeprom", pagesize);
+
+  // There is no SET_DEVICE in this protocol, so describe the part from the header
+  this->native.memtype = memtype;
+  // Broadcast targets are verified together at the end instead of per page
+  this->native.verify = (flags & NATIVE_FLAG_VERIFY) && this->broadcast_enables_.empty();
+  this->native.pagesize = pagesize;
+  param.pagesize = memtype == 'F' ? pagesize : 0;
+  param.eeprompagesize = memtype == 'E' ? pagesize : 0;
+  param.polling = 1;
+  param.flashpoll = 0xFF;
+  param.eeprompoll = 0xFFFF;
+
+  start_pmode();
+  if (!this->isp_synced_)
+    return NATIVE_STATUS_NO_SYNC;
+
+  uint32_t found = read_signature_bytes_();
+  if (signature != 0 && found != signature) {
+    ESP_LOGW(TAG, "[AVRISP] Signature mismatch, expected %06x found %06x", signature, found);
+    return NATIVE_STATUS_SIGNATURE;
+  }
+
+  if (memtype == 'F' && (flags & NATIVE_FLAG_ERASE)) {
+    spi_transaction(0xAC, 0x80, 0x00, 0x00);
+    wait_ready_(NATIVE_ERASE_TIME);
+    chip_erased_(0xAC, 0x80);
+  }
+
+  // Stream the payload straight into the page buffer
+  uint8_t chunk[NATIVE_CHUNK];
+  uint32_t addr = 0;
+  uint32_t received = 0;
+  uint32_t computed = 0;
+  uint8_t status = NATIVE_STATUS_OK;
+  while (received < size) {
+    int n = std::min<uint32_t>(size - received, NATIVE_CHUNK);
+    if (!this->socket.read_bytes(chunk, n))
+      return NATIVE_STATUS_CONNECTION;
+    received += n;
+    computed = avrisp_crc32(computed, chunk, n);
+
+    // Keep reading after an error so the client gets the reply, but stop programming
+    for (int i = 0; i < n && status == NATIVE_STATUS_OK; i++) {
+      if (compression == NATIVE_COMPRESS_NONE) {
+        status = native_byte_(format, &addr, chunk[i]);
+        continue;
+      }
+      // Decompressed bytes are read straight out of the window
+      int produced = this->heatshrink_.push(chunk[i]);
+      for (int j = 0; j < produced && status == NATIVE_STATUS_OK; j++)
+        status = native_byte_(format, &addr, this->heatshrink_.output(j, produced));
+    }
+  }
+
+  if (compression != NATIVE_COMPRESS_NONE) {
+    uint32_t decoded = this->heatshrink_.get_decoded();
+    this->session.compressed_bytes += size;
+    this->session.decompressed_bytes += decoded;
+    ESP_LOGI(TAG, "[AVRISP] Decompressed %u bytes from %u (%.1fx)", decoded, size,
+             size > 0 ? (float) decoded / size : 0.0f);
+  }
+
+  if (status == NATIVE_STATUS_OK)
+    status = native_flush_page_();
+  commit_finish_();
+  if (status == NATIVE_STATUS_OK && this->commit_failed_)
+    status = NATIVE_STATUS_WRITE_FAILED;
+  if (status == NATIVE_STATUS_OK && computed != crc)
+    status = NATIVE_STATUS_CRC;
+  if (status == NATIVE_STATUS_OK && (flags & NATIVE_FLAG_VERIFY) && broadcast_verify_() > 0)
+    status = NATIVE_STATUS_VERIFY;
+  return status;
+}
+
+// Feed one byte of the (decompressed) payload in the given format
+uint8_t AVROTAComponent::native_byte_(uint8_t format, uint32_t *addr, uint8_t c) {
+  if (format == NATIVE_FORMAT_RAW)
+    return native_store_((*addr)++, c);
+  return native_hex_(c);
+}
+
+// Place one image byte. Pages are written as soon as the stream moves past
+// them, so images have to arrive in ascending page order
+uint8_t AVROTAComponent::native_store_(uint32_t addr, uint8_t value) {
+  int32_t page = addr & ~(uint32_t) (this->native.pagesize - 1);
+  if (page != this->native.page) {
+    uint8_t status = native_flush_page_();
+    if (status != NATIVE_STATUS_OK)
+      return status;
+    if ((uint32_t) page < this->native.next)
+      return NATIVE_STATUS_ORDER;
+    this->native.page = page;
+    memset(buff, 0xFF, this->native.pagesize);
+  }
+  buff[addr - page] = value;
+  return NATIVE_STATUS_OK;
+}
+
+// Program (and optionally verify) the page held in buff
+uint8_t AVROTAComponent::native_flush_page_() {
+  if (this->native.page < 0)
+    return NATIVE_STATUS_OK;
+
+  int page = this->native.page;
+  int pagesize = this->native.pagesize;
+  this->native.page = -1;
+  this->native.next = page + pagesize;
+  this->native.pages++;
+
+  if (this->native.memtype == 'F') {
+    here = page / 2;
+    this->session.flash_bytes += pagesize;
+    if (write_flash_pages(pagesize) != Resp_STK_OK)
+      return NATIVE_STATUS_WRITE_FAILED;
+  } else {
+    uint32_t started = micros();
+    // Same dispatch as write_eeprom_chunk, the bootloader takes whole pages
+    if (this->boot_uart_ != nullptr && (page & 1) == 0)
+      boot_write_page_('E', page / 2, buff, pagesize);
+    else if (pagesize > 1)
+      write_eeprom_pages_(page, pagesize);
+    else
+      write_eeprom_bytes_(page, pagesize);
+    this->session.eeprom_us += micros() - started;
+    this->session.eeprom_bytes += pagesize;
+  }
+
+  if (!this->native.verify)
+    return NATIVE_STATUS_OK;
+
+  // Compare with the target a frame at a time, buff still holds the page
+  commit_finish_();
+  bool match;
+  if (this->native.memtype == 'F') {
+    here = page / 2;
+    match = flash_matches_(buff, pagesize);
+  } else {
+    match = eeprom_matches_(buff, page, pagesize);
+  }
+  if (!match) {
+    ESP_LOGW(TAG, "[AVRISP] Verify failed for page at 0x%05x", page);
+    return NATIVE_STATUS_VERIFY;
+  }
+  return NATIVE_STATUS_OK;
+}
+
+// Feed one character of an Intel HEX stream. Records are decoded into msg_
+uint8_t AVROTAComponent::native_hex_(uint8_t c) {
+  if (c == ':') {
+    this->native.hex_len = 0;
+    this->native.hex_state = 1;
+    return NATIVE_STATUS_OK;
+  }
+  // Line endings and anything between records are skipped
+  if (this->native.hex_state == 0 || c == '\r' || c == '\n' || c == ' ')
+    return NATIVE_STATUS_OK;
+
+  uint8_t nibble;
+  if (c >= '0' && c <= '9')
+    nibble = c - '0';
+  else if (c >= 'A' && c <= 'F')
+    nibble = c - 'A' + 10;
+  else if (c >= 'a' && c <= 'f')
+    nibble = c - 'a' + 10;
+  else
+    return NATIVE_STATUS_HEX_ERROR;
+
+  if (this->native.hex_state == 1) {
+    this->native.hex_high = nibble;
+    this->native.hex_state = 2;
+    return NATIVE_STATUS_OK;
+  }
+  this->msg_[this->native.hex_len++] = this->native.hex_high << 4 | nibble;
+  this->native.hex_state = 1;
+
+  // length, address (2), type, data, checksum
+  int len = this->msg_[0];
+  if (this->native.hex_len < 5 + len)
+    return NATIVE_STATUS_OK;
+  this->native.hex_state = 0;
+
+  uint8_t sum = 0;
+  for (int i = 0; i < 5 + len; i++) sum += this->msg_[i];
+  if (sum != 0)
+    return NATIVE_STATUS_HEX_ERROR;
+
+  uint32_t offset = this->msg_[1] << 8 | this->msg_[2];
+  uint8_t *data = this->msg_ + 4;
+  switch (this->msg_[3]) {
+    case 0x00:  // data
+      for (int i = 0; i < len; i++) {
+        uint8_t status = native_store_(this->native.hex_base + offset + i, data[i]);
+        if (status != NATIVE_STATUS_OK)
+          return status;
+      }
+      break;
+    case 0x02:  // extended segment address
+      this->native.hex_base = (uint32_t) (data[0] << 8 | data[1]) << 4;
+      break;
+    case 0x04:  // extended linear address
+      this->native.hex_base = (uint32_t) (data[0] << 8 | data[1]) << 16;
+      break;
+    default:  // end of file and start addresses need no action
+      break;
+  }
+  return NATIVE_STATUS_OK;
+}
+
+}  // namespace avr_ota
+}  // namespace esphome
@@ -0,0 +1,261 @@
+#include "avr_ota.h"
+#include "avr_commands.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef USE_AVR_OTA_BOOTLOADER
+#include "esphome/components/uart/uart.h"
+#endif
+
+//**************************************************************************
+//*
+//* Bootloader backend: programs the target through Optiboot (or any
+//* stk500v1 serial bootloader) over a UART instead of SPI ISP. The front
+//* ends are unchanged, the page level helpers hand whole pages to the
+//* bootloader and raw ISP instructions are emulated by boot_instruction_()
+//*
+//**************************************************************************
+
+namespace esphome {
+namespace avr_ota {
+
+static const char *TAG = "avr_ota.optiboot";
+
+#ifdef USE_AVR_OTA_BOOTLOADER
+
+#define BOOT_RESET_MS 1        // reset pulse that starts the bootloader
+#define BOOT_SYNC_TRIES 20     // GET_SYNC attempts while the bootloader starts
+#define BOOT_SYNC_TIMEOUT 50   // ms to wait for each GET_SYNC reply
+#define BOOT_TIMEOUT 250       // ms to wait for the reply to any other command
+
+// Remember the rate the application talks at, sessions switch to the
+// bootloader rate and back to this one
+void AVROTAComponent::boot_setup_() { this->boot_app_baud_rate_ = this->boot_uart_->get_baud_rate(); }
+
+// Read len bytes from the bootloader, giving up after timeout_ms
+bool AVROTAComponent::boot_read_(uint8_t *buf, int len, uint32_t timeout_ms) {
+  uint32_t start = millis();
+  int at = 0;
+  while (at < len) {
+    if (this->boot_uart_->available() > 0) {
+      if (!this->boot_uart_->read_byte(buf + at))
+        return false;
+      at++;
+      continue;
+    }
+    if (millis() - start > timeout_ms)
+      return false;
+    EngineTask::feed_wdt();
+    yield();
+  }
+  return true;
+}
+
+// Send an stk500v1 command, the optional data and CRC_EOP, then read the
+// reply: INSYNC, reply_len bytes into reply and OK
+bool AVROTAComponent::boot_command_(const uint8_t *cmd, int len, const uint8_t *data, int data_len, uint8_t *reply,
+                                    int reply_len, uint32_t timeout_ms) {
+  AVRISP_TRACE(uint32_t started = micros());
+  static const uint8_t EOP = Sync_CRC_EOP;
+  this->boot_uart_->write_array(cmd, len);
+  if (data_len > 0)
+    this->boot_uart_->write_array(data, data_len);
+  this->boot_uart_->write_array(&EOP, 1);
+  this->session.spi_transactions++;
+
+  uint8_t status;
+  bool ok = boot_read_(&status, 1, timeout_ms) && status == Resp_STK_INSYNC;
+  ok = ok && (reply_len == 0 || boot_read_(reply, reply_len, timeout_ms));
+  ok = ok && boot_read_(&status, 1, timeout_ms) && status == Resp_STK_OK;
+  AVRISP_TRACE(this->trace_spi_us_ += micros() - started);
+  if (!ok)
+    ESP_LOGW(TAG, "[AVRISP] Bootloader did not answer command 0x%02x", cmd[0]);
+  return ok;
+}
+
+// Set the bootloader address. It takes word addresses for flash and
+// eeprom alike, like the stk500v1 front end. The 64K word segment goes
+// in an STK_UNIVERSAL 0x4D, which Optiboot turns into RAMPZ
+bool AVROTAComponent::boot_load_address_(int addr) {
+  load_extended_address_(addr);
+  uint8_t cmd[3] = {Cmnd_STK_LOAD_ADDRESS, (uint8_t) (addr & 0xFF), (uint8_t) ((addr >> 8) & 0xFF)};
+  return boot_command_(cmd, 3, nullptr, 0, nullptr, 0, BOOT_TIMEOUT);
+}
+
+// Reset the target into the bootloader and sync with it
+void AVROTAComponent::boot_start_pmode_() {
+  // The link may run at another rate for the application. Taken once, the
+  // UART may still be at the bootloader rate here
+  if (this->boot_app_baud_rate_ == 0)
+    boot_setup_();
+  if (this->boot_baud_rate_ != this->boot_app_baud_rate_) {
+    this->boot_uart_->set_baud_rate(this->boot_baud_rate_);
+    this->boot_uart_->load_settings(false);
+  }
+
+  this->set_enable_(false);
+  delay(BOOT_RESET_MS);
+  this->set_enable_(true);
+
+  bool synced = false;
+  uint8_t cmd[1] = {Cmnd_STK_GET_SYNC};
+  for (int i = 0; i < BOOT_SYNC_TRIES && !synced; i++) {
+    // Drop whatever the application or a previous attempt left behind
+    uint8_t junk;
+    while (this->boot_uart_->available() > 0) this->boot_uart_->read_byte(&junk);
+    synced = boot_command_(cmd, 1, nullptr, 0, nullptr, 0, BOOT_SYNC_TIMEOUT);
+  }
+
+  uint8_t sig[3] = {0, 0, 0};
+  if (synced) {
+    cmd[0] = Cmnd_STK_ENTER_PROGMODE;
+    synced = boot_command_(cmd, 1, nullptr, 0, nullptr, 0, BOOT_TIMEOUT);
+    cmd[0] = Cmnd_STK_READ_SIGN;
+    synced = synced && boot_command_(cmd, 1, nullptr, 0, sig, 3, BOOT_TIMEOUT);
+  }
+  this->boot_signature_ = (sig[0] << 16) | (sig[1] << 8) | sig[2];
+
+  this->isp_synced_ = synced;
+  if (!synced)
+    ESP_LOGW(TAG, "[AVRISP] Bootloader did not sync at %u baud", this->boot_baud_rate_);
+  else
+    ESP_LOGD(TAG, "[AVRISP] Bootloader in sync at %u baud, signature %06x", this->boot_baud_rate_,
+             this->boot_signature_);
+
+  this->commit_pending_ = false;
+  this->commit_failed_ = false;
+  pmode = 1;
+}
+
+// Leave the bootloader, it starts the application
+void AVROTAComponent::boot_end_pmode_() {
+  if (this->isp_synced_) {
+    uint8_t cmd[1] = {Cmnd_STK_LEAVE_PROGMODE};
+    boot_command_(cmd, 1, nullptr, 0, nullptr, 0, BOOT_TIMEOUT);
+  }
+  this->boot_uart_->flush();
+  if (this->boot_baud_rate_ != this->boot_app_baud_rate_) {
+    this->boot_uart_->set_baud_rate(this->boot_app_baud_rate_);
+    this->boot_uart_->load_settings(false);
+  }
+  pmode = 0;
+}
+
+// Write one page of flash ('F') or eeprom ('E') at the word address addr
+bool AVROTAComponent::boot_write_page_(char memtype, int addr, const uint8_t *data, int length) {
+  uint8_t cmd[4] = {Cmnd_STK_PROG_PAGE, (uint8_t) ((length >> 8) & 0xFF), (uint8_t) (length & 0xFF),
+                    (uint8_t) memtype};
+  uint32_t started = micros();
+  bool ok = boot_load_address_(addr) && boot_command_(cmd, 4, data, length, nullptr, 0, BOOT_TIMEOUT);
+  if (memtype == 'F') {
+    uint32_t took = micros() - started;
+    this->session.pages++;
+    this->session.commit_us += took;
+    if (took > this->session.commit_max_us)
+      this->session.commit_max_us = took;
+    this->page_program_us_ = took;
+  }
+  if (!ok)
+    this->commit_failed_ = true;
+  return ok;
+}
+
+// Read length bytes of flash ('F') or eeprom ('E') at the word address addr
+bool AVROTAComponent::boot_read_page_(char memtype, int addr, uint8_t *data, int length) {
+  uint8_t cmd[4] = {Cmnd_STK_READ_PAGE, (uint8_t) ((length >> 8) & 0xFF), (uint8_t) (length & 0xFF),
+                    (uint8_t) memtype};
+  if (boot_load_address_(addr) && boot_command_(cmd, 4, nullptr, 0, data, length, BOOT_TIMEOUT))
+    return true;
+  memset(data, 0xFF, length);
+  return false;
+}
+
+// Compare length bytes of data with flash or eeprom at the word address addr
+bool AVROTAComponent::boot_matches_(char memtype, int addr, const uint8_t *data, int length) {
+  // The frame isn't needed for instructions, read back into it
+  for (int x = 0; x < length; x += AVRISP_FRAME_SIZE) {
+    int n = std::min(length - x, AVRISP_FRAME_SIZE);
+    if (!boot_read_page_(memtype, addr + x / 2, this->frame_, n) || memcmp(this->frame_, data + x, n) != 0)
+      return false;
+  }
+  return true;
+}
+
+// Emulate an ISP instruction with bootloader commands. Anything without an
+// equivalent is passed on as STK_UNIVERSAL, which Optiboot answers with 0
+uint8_t AVROTAComponent::boot_instruction_(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  int addr = (b << 8) | c;
+  uint8_t value;
+  switch (a) {
+    case 0x30:  // read signature byte
+      return (this->boot_signature_ >> (8 * (2 - (c & 0x03)))) & 0xFF;
+    case 0xF0:  // RDY/BSY, every command completes before its reply
+      return 0x00;
+    case 0xAC:
+      // Optiboot erases each page as it is written, there is no chip
+      // erase. Fuse and lock writes aren't possible either
+      return 0x00;
+    case 0x20:  // read flash low byte
+    case 0x28:  // read flash high byte
+      {
+        // In the 64K word segment last selected with 0x4D
+        uint8_t word[2];
+        boot_read_page_('F', addr | (this->ext_addr_ << 16), word, 2);
+        return word[a == 0x28 ? 1 : 0];
+      }
+    case 0xA0:  // read eeprom byte
+      {
+        // Word address, so read the pair holding the byte
+        uint8_t pair[2];
+        boot_read_page_('E', addr / 2, pair, 2);
+        return pair[addr & 1];
+      }
+    case 0xC0:  // write eeprom byte
+      {
+        uint8_t pair[2];
+        if (addr & 1) {
+          boot_read_page_('E', addr / 2, pair, 2);
+          pair[1] = d;
+          boot_write_page_('E', addr / 2, pair, 2);
+        } else {
+          boot_write_page_('E', addr / 2, &d, 1);
+        }
+        return 0x00;
+      }
+    default:
+      {
+        uint8_t cmd[5] = {Cmnd_STK_UNIVERSAL, a, b, c, d};
+        if (!boot_command_(cmd, 5, nullptr, 0, &value, 1, BOOT_TIMEOUT))
+          return 0x00;
+        return value;
+      }
+  }
+}
+
+#else
+
+// Without a bootloader UART there is nothing to talk to. boot_uart_ is
+// never set, so none of these are reached
+
+void AVROTAComponent::boot_setup_() {}
+bool AVROTAComponent::boot_read_(uint8_t *buf, int len, uint32_t timeout_ms) { return false; }
+bool AVROTAComponent::boot_command_(const uint8_t *cmd, int len, const uint8_t *data, int data_len, uint8_t *reply,
+                                    int reply_len, uint32_t timeout_ms) {
+  return false;
+}
+bool AVROTAComponent::boot_load_address_(int addr) { return false; }
+void AVROTAComponent::boot_start_pmode_() { ESP_LOGW(TAG, "Bootloader programming is not compiled in"); }
+void AVROTAComponent::boot_end_pmode_() {}
+bool AVROTAComponent::boot_write_page_(char memtype, int addr, const uint8_t *data, int length) { return false; }
+bool AVROTAComponent::boot_read_page_(char memtype, int addr, uint8_t *data, int length) { return false; }
+bool AVROTAComponent::boot_matches_(char memtype, int addr, const uint8_t *data, int length) { return false; }
+uint8_t AVROTAComponent::boot_instruction_(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { return 0x00; }
+
+#endif
+
+}  // namespace avr_ota
+}  // namespace esphome
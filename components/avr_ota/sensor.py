@@ -0,0 +1,78 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.const import (
+    DEVICE_CLASS_DURATION,
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    UNIT_BYTES,
+    UNIT_MILLISECOND,
+)
+from . import CHILD_SCHEMA, CONF_HUB_ID
+
+DEPENDENCIES = ["avr_ota"]
+
+CONF_DURATION = "duration"
+CONF_BYTES_WRITTEN = "bytes_written"
+CONF_BYTES_READ = "bytes_read"
+CONF_PAGES = "pages"
+CONF_SPI_TRANSACTIONS = "spi_transactions"
+CONF_COMMIT_TIME = "commit_time"
+CONF_EEPROM_TIME = "eeprom_time"
+CONF_SOCKET_WAIT_TIME = "socket_wait_time"
+CONF_ERRORS = "errors"
+CONF_THROUGHPUT = "throughput"
+
+
+def _time_schema():
+    return sensor.sensor_schema(
+        unit_of_measurement=UNIT_MILLISECOND,
+        accuracy_decimals=0,
+        device_class=DEVICE_CLASS_DURATION,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    )
+
+
+def _count_schema(unit=None):
+    return sensor.sensor_schema(
+        unit_of_measurement=unit,
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    )
+
+
+# Each sensor is published once when a programming session ends
+SENSORS = {
+    CONF_DURATION: ("set_duration_sensor", _time_schema()),
+    CONF_BYTES_WRITTEN: ("set_bytes_written_sensor", _count_schema(UNIT_BYTES)),
+    CONF_BYTES_READ: ("set_bytes_read_sensor", _count_schema(UNIT_BYTES)),
+    CONF_PAGES: ("set_pages_sensor", _count_schema()),
+    CONF_SPI_TRANSACTIONS: ("set_spi_transactions_sensor", _count_schema()),
+    CONF_COMMIT_TIME: ("set_commit_time_sensor", _time_schema()),
+    CONF_EEPROM_TIME: ("set_eeprom_time_sensor", _time_schema()),
+    CONF_SOCKET_WAIT_TIME: ("set_socket_wait_time_sensor", _time_schema()),
+    CONF_ERRORS: ("set_errors_sensor", _count_schema()),
+    CONF_THROUGHPUT: (
+        "set_throughput_sensor",
+        sensor.sensor_schema(
+            unit_of_measurement="KB/s",
+            accuracy_decimals=2,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+    ),
+}
+
+CONFIG_SCHEMA = CHILD_SCHEMA.extend(
+    {cv.Optional(key): schema for key, (_, schema) in SENSORS.items()}
+)
+
+
+async def to_code(config):
+    hub = await cg.get_variable(config[CONF_HUB_ID])
+    for key, (setter, _) in SENSORS.items():
+        if key in config:
+            sens = await sensor.new_sensor(config[key])
+            cg.add(getattr(hub, setter)(sens))
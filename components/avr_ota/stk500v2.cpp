@@ -0,0 +1,386 @@
+#include "avr_ota.h"
+#include "stk500v2_commands.h"
+
+#include "esphome/core/application.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace avr_ota {
+
+#define STK500V2_HWVER 2
+#define STK500V2_SWMAJ 2
+#define STK500V2_SWMIN 10
+#define STK500V2_VTARGET 50  // 5.0V, the target supply isn't measured
+#define STK500V2_XTAL 7372800
+#define STK500V2_SIGN_ON "AVRISP_2"
+
+static const char *TAG = "avr_ota.stk500v2";
+
+// SCK durations 0-3 are fixed rates, larger ones follow the STK500 formula
+static const uint32_t STK500V2_SCK_RATES[] = {921600, 230400, 57600, 28800};
+
+static uint32_t stk500v2_sck_rate(uint8_t duration) {
+  if (duration < 4)
+    return STK500V2_SCK_RATES[duration];
+  return STK500V2_XTAL / (24 * duration + 10);
+}
+
+// Read from the socket, shutting the session down if the read fails
+bool AVROTAComponent::stk500v2_read_(uint8_t *buf, int len) {
+  if (!this->socket.read_bytes(buf, len)) {
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+    return false;
+  }
+  return true;
+}
+
+// Handle one stk500v2 message. start is the first byte, already read by avrisp()
+void AVROTAComponent::stk500v2(uint8_t start) {
+  // Anything outside a message is noise. Skip it until the next start byte
+  if (start != MESSAGE_START) return;
+
+  // sequence, size (big endian), token
+  uint8_t header[4];
+  if (!stk500v2_read_(header, 4)) return;
+
+  uint8_t seq = header[0];
+  int size = header[1] * 256 + header[2];
+  if (header[3] != TOKEN || size == 0 || size > AVRISP_V2_BUFFER_SIZE) {
+    ESP_LOGW(TAG, "[AVRISP] Bad stk500v2 header, size %d token %02x", size, header[3]);
+    error++;
+    return;
+  }
+
+  uint8_t checksum;
+  if (!stk500v2_read_(this->msg_, size)) return;
+  if (!stk500v2_read_(&checksum, 1)) return;
+  this->msg_len_ = size;
+
+  uint8_t sum = MESSAGE_START ^ header[0] ^ header[1] ^ header[2] ^ header[3];
+  for (int i = 0; i < size; i++) sum ^= this->msg_[i];
+  if (sum != checksum) {
+    ESP_LOGW(TAG, "[AVRISP] stk500v2 checksum error");
+    error++;
+    this->msg_[0] = ANSWER_CKSUM_ERROR;
+    this->msg_[1] = STATUS_CKSUM_ERROR;
+    stk500v2_reply_(seq, 2);
+    return;
+  }
+
+  this->session.commands++;
+
+  // A pipelined page commit must finish before anything else uses the target
+  uint8_t cmd = this->msg_[0];
+  AVRISP_TRACE(this->trace_.set_command(cmd));
+  if (cmd != CMD_LOAD_ADDRESS && cmd != CMD_PROGRAM_FLASH_ISP)
+    commit_finish_();
+
+  // Writes go to every broadcast target, reads to the first one alone
+  switch (cmd) {
+    case CMD_CHIP_ERASE_ISP:
+    case CMD_PROGRAM_FLASH_ISP:
+    case CMD_PROGRAM_EEPROM_ISP:
+    case CMD_PROGRAM_FUSE_ISP:
+    case CMD_PROGRAM_LOCK_ISP:
+      broadcast_route_(true);
+      break;
+    case CMD_READ_FLASH_ISP:
+    case CMD_READ_EEPROM_ISP:
+    case CMD_READ_FUSE_ISP:
+    case CMD_READ_LOCK_ISP:
+    case CMD_READ_SIGNATURE_ISP:
+    case CMD_READ_OSCCAL_ISP:
+    case CMD_SPI_MULTI:
+      broadcast_route_(false);
+      break;
+    case CMD_LEAVE_PROGMODE_ISP:
+      broadcast_verify_();
+      break;
+    default:
+      break;
+  }
+
+  stk500v2_reply_(seq, stk500v2_command_());
+}
+
+// Send msg_[0..len) as the answer to message seq
+void AVROTAComponent::stk500v2_reply_(uint8_t seq, int len) {
+  uint8_t header[STK500V2_HEADER_SIZE] = {MESSAGE_START, seq, (uint8_t) (len >> 8), (uint8_t) (len & 0xFF), TOKEN};
+
+  uint8_t sum = 0;
+  for (int i = 0; i < STK500V2_HEADER_SIZE; i++) sum ^= header[i];
+  for (int i = 0; i < len; i++) sum ^= this->msg_[i];
+
+  if (!this->socket.write_bytes(header, STK500V2_HEADER_SIZE) || !this->socket.write_bytes(this->msg_, len) ||
+      !this->socket.write(sum) || !this->socket.flush())
+    this->_state = AVRISP_STATE_FORCED_SHUTDOWN;
+}
+
+// Execute the command in msg_ and build the answer in place. Returns the
+// length of the answer
+int AVROTAComponent::stk500v2_command_() {
+  uint8_t cmd = this->msg_[0];
+  // ESP_LOGI(TAG, "[AVRISP] stk500v2 command %02x", cmd);
+  switch (cmd) {
+    case CMD_SIGN_ON:
+      this->msg_[1] = STATUS_CMD_OK;
+      this->msg_[2] = strlen(STK500V2_SIGN_ON);
+      memcpy(this->msg_ + 3, STK500V2_SIGN_ON, strlen(STK500V2_SIGN_ON));
+      return 3 + strlen(STK500V2_SIGN_ON);
+
+    case CMD_SET_PARAMETER:
+      stk500v2_set_parameter_(this->msg_[1], this->msg_[2]);
+      this->msg_[1] = STATUS_CMD_OK;
+      return 2;
+
+    case CMD_GET_PARAMETER:
+      this->msg_[2] = stk500v2_get_parameter_(this->msg_[1]);
+      this->msg_[1] = STATUS_CMD_OK;
+      return 3;
+
+    case CMD_LOAD_ADDRESS:
+      // Bit 31 asks for the extended address byte to be loaded as well
+      here = ((uint32_t) this->msg_[1] << 24 | (uint32_t) this->msg_[2] << 16 | (uint32_t) this->msg_[3] << 8 |
+              this->msg_[4]) &
+             0x7FFFFFFF;
+      this->msg_[1] = STATUS_CMD_OK;
+      return 2;
+
+    case CMD_ENTER_PROGMODE_ISP:
+      // The timing parameters are ignored, start_pmode() does its own sync
+      start_pmode();
+      this->msg_[1] = this->isp_synced_ ? STATUS_CMD_OK : STATUS_CMD_FAILED;
+      return 2;
+
+    case CMD_LEAVE_PROGMODE_ISP:
+      this->session.errors += error;
+      error = 0;
+      end_pmode();
+      image_commit_();
+      this->msg_[1] = STATUS_CMD_OK;
+      return 2;
+
+    case CMD_CHIP_ERASE_ISP: {
+      // eraseDelay, pollMethod, cmd1-4
+      uint8_t erase_delay = this->msg_[1];
+      uint8_t poll_method = this->msg_[2];
+      spi_transaction(this->msg_[3], this->msg_[4], this->msg_[5], this->msg_[6]);
+      chip_erased_(this->msg_[3], this->msg_[4]);
+      if (poll_method == 1)
+        wait_ready_(erase_delay);
+      else
+        delay(erase_delay);
+      this->msg_[1] = STATUS_CMD_OK;
+      return 2;
+    }
+
+    case CMD_PROGRAM_FLASH_ISP:
+    case CMD_PROGRAM_EEPROM_ISP:
+      this->msg_[1] = stk500v2_program_(cmd == CMD_PROGRAM_EEPROM_ISP);
+      return 2;
+
+    case CMD_READ_FLASH_ISP:
+    case CMD_READ_EEPROM_ISP:
+      return stk500v2_read_memory_(cmd == CMD_READ_EEPROM_ISP);
+
+    case CMD_PROGRAM_FUSE_ISP:
+    case CMD_PROGRAM_LOCK_ISP:
+      spi_transaction(this->msg_[1], this->msg_[2], this->msg_[3], this->msg_[4]);
+      this->msg_[1] = STATUS_CMD_OK;
+      this->msg_[2] = STATUS_CMD_OK;
+      return 3;
+
+    case CMD_READ_FUSE_ISP:
+    case CMD_READ_LOCK_ISP:
+    case CMD_READ_SIGNATURE_ISP:
+    case CMD_READ_OSCCAL_ISP: {
+      // RetAddr is the 1-based index of the result in the four returned bytes
+      uint8_t ret_addr = this->msg_[1];
+      uint8_t buf[4] = {this->msg_[2], this->msg_[3], this->msg_[4], this->msg_[5]};
+      AVRISP_TRACE(uint32_t started = micros());
+      this->transfer_array(buf, 4);
+      AVRISP_TRACE(this->trace_spi_us_ += micros() - started);
+      this->session.spi_transactions++;
+      this->msg_[1] = STATUS_CMD_OK;
+      this->msg_[2] = buf[(ret_addr - 1) & 0x03];
+      this->msg_[3] = STATUS_CMD_OK;
+      return 4;
+    }
+
+    case CMD_SPI_MULTI: {
+      // NumTx, NumRx, RxStartAddr, TxData
+      int num_tx = this->msg_[1];
+      int num_rx = this->msg_[2];
+      int rx_start = this->msg_[3];
+      int total = std::max(num_tx, rx_start + num_rx);
+      memcpy(this->frame_, this->msg_ + 4, num_tx);
+      memset(this->frame_ + num_tx, 0, total - num_tx);
+      // A raw Load Extended Address moves the segment load_extended_address_()
+      // thinks the target is in
+      for (int x = 0; x + 3 < num_tx; x += 4) {
+        if (this->frame_[x] == 0x4D)
+          this->ext_addr_ = this->frame_[x + 2];
+      }
+      AVRISP_TRACE(uint32_t started = micros());
+      this->transfer_array(this->frame_, total);
+      AVRISP_TRACE(this->trace_spi_us_ += micros() - started);
+      // Counted in four byte instructions like everything else
+      this->session.spi_transactions += (total + 3) / 4;
+      this->msg_[1] = STATUS_CMD_OK;
+      memcpy(this->msg_ + 2, this->frame_ + rx_start, num_rx);
+      this->msg_[2 + num_rx] = STATUS_CMD_OK;
+      return 3 + num_rx;
+    }
+
+    default:
+      ESP_LOGE(TAG, "[AVRISP] Unknown stk500v2 command: %02x", cmd);
+      error++;
+      this->msg_[1] = STATUS_CMD_UNKNOWN;
+      return 2;
+  }
+}
+
+// Handle CMD_PROGRAM_FLASH_ISP / CMD_PROGRAM_EEPROM_ISP. Returns the status
+uint8_t AVROTAComponent::stk500v2_program_(bool eeprom) {
+  // NumBytes (big endian), mode, delay, cmd1 (load / write), cmd2 (write
+  // page), cmd3 (read), poll1, poll2, data
+  int length = this->msg_[1] * 256 + this->msg_[2];
+  uint8_t mode = this->msg_[3];
+  uint8_t delay_ms = this->msg_[4];
+  uint8_t cmd1 = this->msg_[5];
+  uint8_t cmd2 = this->msg_[6];
+  uint8_t *data = this->msg_ + 10;
+  if (10 + length > this->msg_len_) {
+    error++;
+    return STATUS_CMD_FAILED;
+  }
+
+  // The previous page may still be programming if writes are pipelined
+  commit_finish_();
+
+  if (!eeprom) {
+    this->session.flash_bytes += length;
+    int page = here;
+    image_record_(here * 2, data, length);
+    if ((mode & STK500V2_MODE_PAGE) && (mode & STK500V2_MODE_WRITE_PAGE) && this->differential_ &&
+        this->broadcast_enables_.empty() && flash_matches_(data, length)) {
+      // The page already holds this data
+      here += length / 2;
+      this->session.pages_skipped++;
+    } else if ((mode & STK500V2_MODE_PAGE) && (mode & STK500V2_MODE_WRITE_PAGE)) {
+      // avrdude sends one page per block and asks for it to be written
+      write_flash_page_(page, data, length & ~1, this->pipelined_);
+    } else if (mode & STK500V2_MODE_PAGE) {
+      for (int x = 0; x + 1 < length; x += 2) {
+        flash(0, here, data[x]);
+        flash(1, here, data[x + 1]);
+        here++;
+      }
+      frame_send_();
+      this->page_loaded_ = true;
+    } else {
+      // word mode, each byte is written and waited on by itself
+      for (int x = 0; x < length; x++) {
+        load_extended_address_(here);
+        spi_transaction(cmd1 | ((x & 1) << 3), (here >> 8) & 0xFF, here & 0xFF, data[x]);
+        wait_ready_(delay_ms);
+        if (x & 1) here++;
+      }
+    }
+
+    if (this->commit_failed_) {
+      this->commit_failed_ = false;
+      this->image_.fail();
+      error++;
+      return STATUS_CMD_FAILED;
+    }
+    return STATUS_CMD_OK;
+  }
+
+  // eeprom addresses are byte addresses in stk500v2
+  uint32_t started = micros();
+  int start = here;
+  if (mode & STK500V2_MODE_PAGE) {
+    for (int x = 0; x < length; x++) {
+      int addr = start + x;
+      frame_add_(cmd1, 0x00, addr & 0xFF, data[x]);
+      eeprom_poll_candidate_(addr, data[x]);
+    }
+    if (mode & STK500V2_MODE_WRITE_PAGE)
+      frame_add_(cmd2, (start >> 8) & 0xFF, start & 0xFF, 0x00);
+    frame_send_();
+    if (mode & STK500V2_MODE_WRITE_PAGE)
+      wait_ready_(delay_ms);
+  } else {
+    for (int x = 0; x < length; x++) {
+      int addr = start + x;
+      spi_transaction(cmd1, (addr >> 8) & 0xFF, addr & 0xFF, data[x]);
+      eeprom_poll_candidate_(addr, data[x]);
+      wait_ready_(delay_ms);
+      EngineTask::feed_wdt();
+    }
+  }
+  here += length;
+  this->session.eeprom_us += micros() - started;
+  this->session.eeprom_bytes += length;
+  return STATUS_CMD_OK;
+}
+
+// Handle CMD_READ_FLASH_ISP / CMD_READ_EEPROM_ISP. Returns the answer length
+int AVROTAComponent::stk500v2_read_memory_(bool eeprom) {
+  // NumBytes (big endian), cmd1
+  int length = this->msg_[1] * 256 + this->msg_[2];
+  if (length > AVRISP_V2_BUFFER_SIZE - 3) {
+    error++;
+    this->msg_[1] = STATUS_CMD_FAILED;
+    return 2;
+  }
+
+  if (eeprom) {
+    read_eeprom_bytes_(this->msg_ + 2, here, length);
+    here += length;
+  } else {
+    read_flash_bytes_(this->msg_ + 2, length);
+  }
+
+  this->session.read_bytes += length;
+  this->msg_[1] = STATUS_CMD_OK;
+  this->msg_[2 + length] = STATUS_CMD_OK;
+  return 3 + length;
+}
+
+uint8_t AVROTAComponent::stk500v2_get_parameter_(uint8_t c) {
+  switch (c) {
+    case PARAM_HW_VER:
+      return STK500V2_HWVER;
+    case PARAM_SW_MAJOR:
+      return STK500V2_SWMAJ;
+    case PARAM_SW_MINOR:
+      return STK500V2_SWMIN;
+    case PARAM_VTARGET:
+      return STK500V2_VTARGET;
+    case PARAM_SCK_DURATION:
+      // Report the fastest duration that doesn't exceed the current clock
+      for (int duration = 0; duration < 255; duration++) {
+        if (stk500v2_sck_rate(duration) <= this->isp_rate_)
+          return duration;
+      }
+      return 255;
+    default:
+      return 0;
+  }
+}
+
+void AVROTAComponent::stk500v2_set_parameter_(uint8_t c, uint8_t value) {
+  // avrdude -B sends the requested ISP clock period. Honour it for the rest
+  // of the session instead of the configured or negotiated rate
+  if (c == PARAM_SCK_DURATION) {
+    this->sck_request_ = stk500v2_sck_rate(value);
+    ESP_LOGD(TAG, "[AVRISP] Client requested ISP clock %u Hz", this->sck_request_);
+    if (pmode) set_isp_rate_(this->sck_request_);
+  }
+}
+
+}  // namespace avr_ota
+}  // namespace esphome
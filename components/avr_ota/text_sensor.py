@@ -0,0 +1,25 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import text_sensor
+from esphome.const import ENTITY_CATEGORY_DIAGNOSTIC
+from . import CHILD_SCHEMA, CONF_HUB_ID
+
+DEPENDENCIES = ["avr_ota"]
+
+CONF_SUMMARY = "summary"
+
+# Published once when a programming session ends
+CONFIG_SCHEMA = CHILD_SCHEMA.extend(
+    {
+        cv.Optional(CONF_SUMMARY): text_sensor.text_sensor_schema(
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+    }
+)
+
+
+async def to_code(config):
+    hub = await cg.get_variable(config[CONF_HUB_ID])
+    if CONF_SUMMARY in config:
+        sens = await text_sensor.new_text_sensor(config[CONF_SUMMARY])
+        cg.add(hub.set_summary_text_sensor(sens))
@@ -0,0 +1,81 @@
+#include "rig.h"
+
+#include "esphome/core/log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Programs emulated parts through avrisp() with an avrdude style stk500v1
+// session and reports what the session counters and the scripted client
+// saw. Runs on the virtual clock, so the times are those of the emulated
+// link and target, not of this machine
+//
+//   $ avr_ota_bench_isp [latency_us ...]
+
+using namespace avr_test;
+
+struct Result {
+  double kbps;
+  double trips_per_page;
+  uint32_t elapsed_ms;
+  AVRISP_session_t session;
+  uint32_t spi_bytes;
+};
+
+static Result run(const AvrPart &part, size_t flash_size, size_t eeprom_size, uint32_t latency_us, bool pipelined,
+                  uint32_t isp_clock) {
+  Rig rig(part);
+  rig.ota.set_pipelined_writes(pipelined);
+  rig.ota.set_isp_clock(isp_clock);
+  rig.start();
+
+  auto flash = test_image(flash_size, 7);
+  auto eeprom = test_image(eeprom_size, 8);
+  auto c = rig.client(latency_us);
+  stk500v1_program(*c, part, flash, eeprom, false);
+  uint64_t started = esphome::host::now_ns();
+  if (!rig.run(c) || !std::equal(flash.begin(), flash.end(), rig.target.flash.begin())) {
+    fprintf(stderr, "%s session failed\n", part.name);
+    exit(1);
+  }
+
+  Result r{};
+  r.session = rig.ota.get_session();
+  r.elapsed_ms = (c->finished_ns - started) / 1000000;
+  r.kbps = (flash_size + eeprom_size) / 1024.0 / ((c->finished_ns - started) / 1e9);
+  // Every command the client waited for, per flash page sent
+  r.trips_per_page = (double) c->round_trips() / ((flash_size + part.flash_page_size - 1) / part.flash_page_size);
+  r.spi_bytes = rig.bus.bytes;
+  return r;
+}
+
+int main(int argc, char **argv) {
+  esphome::host::set_log_level(ESPHOME_LOG_LEVEL_ERROR);
+  std::vector<uint32_t> latencies;
+  for (int i = 1; i < argc; i++) latencies.push_back(atoi(argv[i]));
+  if (latencies.empty())
+    latencies = {250, 1000, 5000};
+
+  struct {
+    const AvrPart *part;
+    size_t flash;
+    size_t eeprom;
+  } loads[] = {{&ATMEGA328P, 32 * 1024 - 512, 1024}, {&ATMEGA2560, 256 * 1024, 4096}};
+
+  printf("%-10s %6s %5s %8s %9s %8s %9s %11s %11s %9s %9s\n", "part", "rtt/2", "pipe", "KB/s", "trips/pg",
+         "cmds/pg", "total ms", "commit ms", "eeprom ms", "SPI ins", "wait ms");
+  for (auto &load : loads) {
+    for (uint32_t latency : latencies) {
+      for (bool pipelined : {false, true}) {
+        Result r = run(*load.part, load.flash, load.eeprom, latency, pipelined, 4000000);
+        const AVRISP_session_t &s = r.session;
+        printf("%-10s %6u %5s %8.2f %9.2f %8.2f %9u %11.1f %11.1f %9u %9.1f\n", load.part->name, latency,
+               pipelined ? "yes" : "no", r.kbps, r.trips_per_page,
+               s.pages > 0 ? (double) s.commands / s.pages : 0.0, r.elapsed_ms, s.commit_us / 1000.0,
+               s.eeprom_us / 1000.0, s.spi_transactions, s.socket_wait_us / 1000.0);
+      }
+    }
+  }
+  return 0;
+}
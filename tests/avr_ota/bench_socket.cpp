@@ -0,0 +1,252 @@
+#include "WebSocket.h"
+#include "host.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Measures the WebSocket transport on real POSIX sockets over loopback,
+// with a client thread on the other end. latency_us is added by the client
+// in each direction before it sends or acts on what it received, like a
+// slow network would. Runs on the real clock
+//
+//   read        per byte read() of a stream
+//   read_bytes  128 byte read_bytes() of a stream
+//   write_bytes 128 byte write_bytes() of a stream, flushed at the end
+//   sync        1 byte request, 1 byte reply, like GET_SYNC
+//   page        133 byte request, 2 byte reply, like PROG_PAGE
+//   read_page   4 byte request, 130 byte reply, like READ_PAGE
+//
+//   $ avr_ota_bench_socket [latency_us ...]
+
+using namespace esphome::avr_ota;
+using bench_clock = std::chrono::steady_clock;
+
+static const size_t STREAM_BYTES = 256 * 1024;
+static const size_t CHUNK = 128;
+static const int ROUND_TRIPS = 200;
+
+// The WebSocket with the port the system picked for it
+class BenchSocket : public WebSocket {
+ public:
+  uint16_t bound_port() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (this->server_->getsockname((struct sockaddr *) &addr, &len) != 0)
+      return 0;
+    return ntohs(addr.sin_port);
+  }
+};
+
+static double since_us(bench_clock::time_point started) {
+  return std::chrono::duration<double, std::micro>(bench_clock::now() - started).count();
+}
+
+static void sleep_us(uint32_t us) {
+  if (us > 0)
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+// The client end, a blocking socket
+class Client {
+ public:
+  Client(uint16_t port, uint32_t latency_us) : latency_us_(latency_us) {
+    this->fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+    ::setsockopt(this->fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(this->fd_, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+      perror("connect");
+      exit(1);
+    }
+  }
+  ~Client() { ::close(this->fd_); }
+
+  // Data leaves after the one way latency
+  void send(const std::vector<uint8_t> &data) {
+    sleep_us(this->latency_us_);
+    size_t at = 0;
+    while (at < data.size()) {
+      ssize_t n = ::send(this->fd_, data.data() + at, data.size() - at, MSG_NOSIGNAL);
+      if (n <= 0) {
+        perror("send");
+        exit(1);
+      }
+      at += n;
+    }
+  }
+
+  // Everything has arrived one latency after the ESP sent the last of it
+  void receive(size_t len) {
+    std::vector<uint8_t> buf(std::min<size_t>(len, 65536));
+    size_t at = 0;
+    while (at < len) {
+      ssize_t n = ::recv(this->fd_, buf.data(), std::min(buf.size(), len - at), 0);
+      if (n <= 0) {
+        perror("recv");
+        exit(1);
+      }
+      at += n;
+    }
+    sleep_us(this->latency_us_);
+  }
+
+ protected:
+  int fd_;
+  uint32_t latency_us_;
+};
+
+struct Stats {
+  const char *name;
+  int count;
+  double mean_us;
+  double p50_us;
+  double p99_us;
+  double kb_per_s;
+};
+
+static Stats summarize(const char *name, std::vector<double> times_us, size_t bytes) {
+  std::sort(times_us.begin(), times_us.end());
+  double total = 0;
+  for (double t : times_us) total += t;
+  Stats s{name, (int) times_us.size()};
+  s.mean_us = total / times_us.size();
+  s.p50_us = times_us[times_us.size() / 2];
+  s.p99_us = times_us[std::min(times_us.size() - 1, times_us.size() * 99 / 100)];
+  s.kb_per_s = bytes / 1024.0 / (total / 1e6);
+  return s;
+}
+
+[[noreturn]] static void fail(const char *what) {
+  fprintf(stderr, "%s failed\n", what);
+  exit(1);
+}
+
+// A stream of len bytes read by the ESP with read() or read_bytes(). Per
+// call times, from the first byte on
+static Stats bench_read(BenchSocket &ws, Client &client, bool bytewise) {
+  std::thread sender([&] { client.send(std::vector<uint8_t>(STREAM_BYTES, 0x55)); });
+  uint8_t buf[CHUNK];
+  size_t step = bytewise ? 1 : CHUNK;
+  // Wait for the stream to start, the latency isn't part of the throughput
+  if (!ws.read(buf))
+    fail("read");
+  std::vector<double> times;
+  times.reserve(STREAM_BYTES / step);
+  for (size_t at = 1; at + step <= STREAM_BYTES; at += step) {
+    auto started = bench_clock::now();
+    bool ok = bytewise ? ws.read(buf) : ws.read_bytes(buf, step);
+    times.push_back(since_us(started));
+    if (!ok)
+      fail(bytewise ? "read" : "read_bytes");
+  }
+  // Whatever is left of the stream
+  size_t left = (STREAM_BYTES - 1) % step;
+  if (left > 0 && !ws.read_bytes(buf, left))
+    fail("read_bytes");
+  sender.join();
+  return summarize(bytewise ? "read" : "read_bytes", times, (STREAM_BYTES - 1 - left));
+}
+
+// A stream sent with write_bytes(). Per call times, the flush and the
+// client draining it are in the throughput
+static Stats bench_write(BenchSocket &ws, Client &client) {
+  std::thread receiver([&] {
+    client.receive(STREAM_BYTES);
+    client.send({0x10});
+  });
+  uint8_t buf[CHUNK];
+  std::fill(buf, buf + CHUNK, 0xAA);
+  std::vector<double> times;
+  auto started = bench_clock::now();
+  for (size_t at = 0; at < STREAM_BYTES; at += CHUNK) {
+    auto call = bench_clock::now();
+    if (!ws.write_bytes(buf, CHUNK))
+      fail("write_bytes");
+    times.push_back(since_us(call));
+  }
+  if (!ws.flush())
+    fail("flush");
+  uint8_t ack;
+  if (!ws.read(&ack))
+    fail("read");
+  double total = since_us(started);
+  receiver.join();
+  Stats s = summarize("write_bytes", times, STREAM_BYTES);
+  s.kb_per_s = STREAM_BYTES / 1024.0 / (total / 1e6);
+  return s;
+}
+
+// Round trips of request bytes in, reply bytes out, timed by the client
+static Stats bench_round_trip(const char *name, BenchSocket &ws, Client &client, size_t request, size_t reply) {
+  std::vector<double> times;
+  std::thread driver([&] {
+    std::vector<uint8_t> data(request, 0x20);
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+      auto started = bench_clock::now();
+      client.send(data);
+      client.receive(reply);
+      times.push_back(since_us(started));
+    }
+  });
+  std::vector<uint8_t> buf(std::max(request, reply), 0x14);
+  for (int i = 0; i < ROUND_TRIPS; i++) {
+    if (!ws.read_bytes(buf.data(), request) || !ws.write_bytes(buf.data(), reply) || !ws.flush())
+      fail(name);
+  }
+  driver.join();
+  return summarize(name, times, ROUND_TRIPS * (request + reply));
+}
+
+static void run(uint32_t latency_us) {
+  BenchSocket ws;
+  ws.set_port(0);
+  if (!ws.start())
+    fail("start");
+  Client client(ws.bound_port(), latency_us);
+  auto limit = bench_clock::now() + std::chrono::seconds(5);
+  while (ws.status != WebSocketConnected) {
+    ws.handle();
+    if (bench_clock::now() > limit)
+      fail("accept");
+  }
+
+  std::vector<Stats> results = {
+      bench_read(ws, client, true),
+      bench_read(ws, client, false),
+      bench_write(ws, client),
+      bench_round_trip("sync", ws, client, 1, 1),
+      bench_round_trip("page", ws, client, 133, 2),
+      bench_round_trip("read_page", ws, client, 4, 130),
+  };
+  for (auto &s : results)
+    printf("%-12s %8u %7d %10.2f %10.2f %10.2f %10.1f\n", s.name, latency_us, s.count, s.mean_us, s.p50_us, s.p99_us,
+           s.kb_per_s);
+  ws.stop();
+}
+
+int main(int argc, char **argv) {
+  esphome::host::use_virtual_clock(false);
+  esphome::host::set_log_level(ESPHOME_LOG_LEVEL_ERROR);
+  std::vector<uint32_t> latencies;
+  for (int i = 1; i < argc; i++) latencies.push_back(atoi(argv[i]));
+  if (latencies.empty())
+    latencies = {0, 250, 1000};
+
+  printf("%-12s %8s %7s %10s %10s %10s %10s\n", "test", "rtt/2 us", "count", "mean us", "p50 us", "p99 us", "KB/s");
+  for (uint32_t latency : latencies) run(latency);
+  return 0;
+}
@@ -0,0 +1,39 @@
+#include "check.h"
+
+#include <cstring>
+
+namespace avr_test {
+
+static int failures = 0;
+
+std::vector<Case> &cases() {
+  static std::vector<Case> all;
+  return all;
+}
+
+void fail(const char *file, int line, const char *expr) {
+  fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", file, line, expr);
+  failures++;
+}
+
+int run(int argc, char **argv) {
+  int failed = 0, ran = 0;
+  for (auto &c : cases()) {
+    if (argc > 1 && strstr(c.name, argv[1]) == nullptr)
+      continue;
+    int before = failures;
+    fprintf(stderr, "[ RUN  ] %s\n", c.name);
+    try {
+      c.run();
+    } catch (Abort &) {
+    }
+    bool ok = failures == before;
+    fprintf(stderr, "[ %s ] %s\n", ok ? " OK " : "FAIL", c.name);
+    failed += !ok;
+    ran++;
+  }
+  fprintf(stderr, "%d of %d passed\n", ran - failed, ran);
+  return failed == 0 && ran > 0 ? 0 : 1;
+}
+
+}  // namespace avr_test
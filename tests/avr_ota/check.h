@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+// Just enough of a test framework for the host tests: TEST() registers a
+// case, CHECK() records a failure and carries on, REQUIRE() ends the case
+namespace avr_test {
+
+struct Case {
+  const char *name;
+  std::function<void()> run;
+};
+
+std::vector<Case> &cases();
+void fail(const char *file, int line, const char *expr);
+// Run every case, or those whose name contains argv[1]. Returns the exit
+// status for main()
+int run(int argc, char **argv);
+
+struct Register {
+  Register(const char *name, std::function<void()> run) { cases().push_back({name, std::move(run)}); }
+};
+
+struct Abort {};
+
+}  // namespace avr_test
+
+#define TEST(name) \
+  static void test_##name(); \
+  static avr_test::Register register_##name(#name, test_##name); \
+  static void test_##name()
+
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) \
+      avr_test::fail(__FILE__, __LINE__, #expr); \
+  } while (0)
+
+#define CHECK_EQ(a, b) \
+  do { \
+    auto check_a_ = (a); \
+    auto check_b_ = (b); \
+    if (!(check_a_ == check_b_)) { \
+      fprintf(stderr, "  %s = %lld, %s = %lld\n", #a, (long long) check_a_, #b, (long long) check_b_); \
+      avr_test::fail(__FILE__, __LINE__, #a " == " #b); \
+    } \
+  } while (0)
+
+#define REQUIRE(expr) \
+  do { \
+    if (!(expr)) { \
+      avr_test::fail(__FILE__, __LINE__, #expr); \
+      throw avr_test::Abort(); \
+    } \
+  } while (0)
@@ -0,0 +1,4 @@
+#include "check.h"
+
+// Runs every case, or those whose name contains the first argument
+int main(int argc, char **argv) { return avr_test::run(argc, argv); }
@@ -0,0 +1,331 @@
+#include "AvrTarget.h"
+
+#include "host.h"
+
+#include <algorithm>
+
+namespace avr_emulator {
+
+// ATmega328P datasheet, table 28-18 and 28-19
+const AvrPart ATMEGA328P = {
+    "ATmega328P", 0x1E950F, 32 * 1024, 128, 1024, 4, {0x62, 0xD9, 0xFF}, 0x9A, 4500, 3600, 9000, 4500, 16000000,
+};
+
+// ATmega2560 datasheet, table 30-16 and 30-17
+const AvrPart ATMEGA2560 = {
+    "ATmega2560", 0x1E9801, 256 * 1024, 256, 4096, 8, {0x62, 0x99, 0xFF}, 0x9A, 4500, 9000, 9000, 4500, 16000000,
+};
+
+// The reset line has to be held low this long before programming enable
+static const uint64_t RESET_SETTLE_NS = 20000000;
+
+AvrTarget::AvrTarget(const AvrPart &part)
+    : flash(part.flash_size, 0xFF),
+      eeprom(part.eeprom_size, 0xFF),
+      part_(part),
+      page_buffer_(part.flash_page_size, 0xFF),
+      eeprom_buffer_(part.eeprom_page_size, 0xFF) {
+  std::copy(part.fuses, part.fuses + 3, this->fuses);
+}
+
+bool AvrTarget::busy() {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->settle_();
+  return this->pending_ != WRITE_NONE;
+}
+
+void AvrTarget::write_state(bool state) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->settle_();
+  if (state) {
+    // Running the application. A write still in progress is cut short
+    if (!this->in_reset_)
+      return;
+    if (this->pending_ != WRITE_NONE) {
+      this->stats.interrupted_writes++;
+      this->finish_write_(false);
+    }
+    this->in_reset_ = false;
+    this->programming_ = false;
+    this->ext_addr_ = 0;
+    std::fill(this->page_buffer_.begin(), this->page_buffer_.end(), 0xFF);
+    return;
+  }
+  if (this->in_reset_)
+    return;
+  this->in_reset_ = true;
+  this->reset_at_ns_ = esphome::host::now_ns();
+  this->programming_ = false;
+  this->position_ = 0;
+}
+
+uint8_t AvrTarget::clock(uint8_t mosi, uint32_t rate) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->settle_();
+  if (!this->in_reset_)
+    return 0xFF;
+
+  // Too fast for the part to sample, it sees a different byte
+  bool garbled = (uint64_t) rate * 4 > this->part_.f_cpu;
+  if (garbled) {
+    this->stats.rate_violations++;
+    mosi ^= 0x5A;
+  }
+
+  uint8_t out;
+  int pos = this->position_;
+  if (pos == 0)
+    out = 0x00;
+  else if (!this->programming_)
+    // Only a programming enable in sync echoes its second byte
+    out = pos == 2 && this->bytes_[0] == 0xAC && this->bytes_[1] == 0x53 &&
+                  esphome::host::now_ns() - this->reset_at_ns_ >= RESET_SETTLE_NS
+              ? 0x53
+              : 0xFF;
+  else if (pos < 3)
+    out = this->bytes_[pos - 1];
+  else
+    out = this->read_(this->bytes_);
+  if (garbled)
+    out = 0xFF;
+
+  this->bytes_[pos] = mosi;
+  if (++this->position_ < 4)
+    return out;
+  this->position_ = 0;
+
+  if (!this->programming_) {
+    if (this->bytes_[0] != 0xAC || this->bytes_[1] != 0x53)
+      return out;
+    if (garbled || esphome::host::now_ns() - this->reset_at_ns_ < RESET_SETTLE_NS) {
+      this->stats.failed_enables++;
+      return out;
+    }
+    this->programming_ = true;
+    this->stats.enables++;
+    return out;
+  }
+
+  uint8_t in[4];
+  std::copy(this->bytes_, this->bytes_ + 4, in);
+  this->instruction_(in, &out);
+  return out;
+}
+
+// The data byte of the instruction in, clocked out during its fourth byte
+uint8_t AvrTarget::read_(const uint8_t *in) {
+  bool busy = this->pending_ != WRITE_NONE;
+  uint32_t addr = in[1] << 8 | in[2];
+  switch (in[0]) {
+    case 0xF0:
+      return busy ? 0x01 : 0x00;
+    case 0x20:
+    case 0x28: {
+      // Reads 0xFF while programming, which data polling relies on
+      uint32_t byte = ((this->ext_addr_ << 16 | addr) * 2 + (in[0] == 0x28)) % this->part_.flash_size;
+      return busy ? 0xFF : this->flash[byte];
+    }
+    case 0xA0:
+      return busy ? 0xFF : this->eeprom[addr % this->part_.eeprom_size];
+    case 0x30:
+      switch (in[2] & 0x03) {
+        case 0:
+          return this->part_.signature >> 16;
+        case 1:
+          return this->part_.signature >> 8;
+        case 2:
+          return this->part_.signature;
+        default:
+          return 0xFF;
+      }
+    case 0x50:
+      return in[1] == 0x08 ? this->fuses[2] : this->fuses[0];
+    case 0x58:
+      return in[1] == 0x08 ? this->fuses[1] : this->lock;
+    case 0x38:
+      return this->part_.calibration;
+    default:
+      return 0x00;
+  }
+}
+
+void AvrTarget::instruction_(uint8_t *in, uint8_t *out) {
+  this->stats.instructions++;
+  uint32_t addr = in[1] << 8 | in[2];
+  switch (in[0]) {
+    case 0xF0:
+      this->stats.polls++;
+      return;
+    case 0x20:
+    case 0x28:
+      this->stats.flash_reads++;
+      return;
+    case 0xA0:
+      this->stats.eeprom_reads++;
+      return;
+    case 0x30:
+    case 0x38:
+    case 0x50:
+    case 0x58:
+      return;
+    default:
+      break;
+  }
+
+  // The part ignores anything else until the running write is done
+  if (this->pending_ != WRITE_NONE) {
+    this->stats.busy_violations++;
+    return;
+  }
+
+  switch (in[0]) {
+    case 0x4D:
+      this->stats.ext_loads++;
+      this->ext_addr_ = in[2];
+      return;
+    case 0x40:
+    case 0x48: {
+      this->stats.page_loads++;
+      uint32_t words = this->part_.flash_page_size / 2;
+      this->page_buffer_[(addr & (words - 1)) * 2 + (in[0] == 0x48)] = in[3];
+      return;
+    }
+    case 0x4C: {
+      this->stats.page_writes++;
+      uint32_t words = this->part_.flash_page_size / 2;
+      this->pending_addr_ = ((this->ext_addr_ << 16 | addr) & ~(words - 1)) * 2 % this->part_.flash_size;
+      this->pending_page_ = this->page_buffer_;
+      // The page buffer is cleared by the write
+      std::fill(this->page_buffer_.begin(), this->page_buffer_.end(), 0xFF);
+      this->pending_ = WRITE_FLASH_PAGE;
+      this->start_write_(this->part_.flash_write_us);
+      return;
+    }
+    case 0xC0:
+      this->stats.eeprom_byte_writes++;
+      this->pending_addr_ = addr % this->part_.eeprom_size;
+      this->pending_value_ = in[3];
+      this->pending_ = WRITE_EEPROM_BYTE;
+      this->start_write_(this->part_.eeprom_write_us);
+      return;
+    case 0xC1: {
+      this->stats.eeprom_page_loads++;
+      uint32_t offset = in[2] & (this->part_.eeprom_page_size - 1);
+      this->eeprom_buffer_[offset] = in[3];
+      this->eeprom_loaded_[offset] = in[3];
+      return;
+    }
+    case 0xC2:
+      this->stats.eeprom_page_writes++;
+      this->pending_addr_ = (addr & ~(this->part_.eeprom_page_size - 1)) % this->part_.eeprom_size;
+      this->pending_ = WRITE_EEPROM_PAGE;
+      this->start_write_(this->part_.eeprom_write_us);
+      return;
+    case 0xAC:
+      if ((in[1] & 0xE0) == 0x80) {
+        this->stats.chip_erases++;
+        this->pending_ = WRITE_ERASE;
+        this->start_write_(this->part_.erase_us);
+      } else if (in[1] == 0xA0 || in[1] == 0xA8 || in[1] == 0xA4 || in[1] == 0xE0) {
+        this->stats.fuse_writes++;
+        this->pending_fuse_ = in[1];
+        this->pending_value_ = in[3];
+        this->pending_ = WRITE_FUSE;
+        this->start_write_(this->part_.fuse_write_us);
+      }
+      return;
+    default:
+      return;
+  }
+}
+
+void AvrTarget::start_write_(uint32_t duration_us) {
+  this->busy_until_ns_ = esphome::host::now_ns() + (uint64_t) duration_us * 1000;
+}
+
+void AvrTarget::settle_() {
+  if (this->pending_ != WRITE_NONE && esphome::host::now_ns() >= this->busy_until_ns_)
+    this->finish_write_(true);
+}
+
+// Apply the pending write. An incomplete one leaves half of its bytes
+// behind, like a page whose programming was cut off
+void AvrTarget::finish_write_(bool complete) {
+  switch (this->pending_) {
+    case WRITE_FLASH_PAGE: {
+      // Programming can only clear bits, that's what the chip erase is for
+      size_t n = complete ? this->pending_page_.size() : this->pending_page_.size() / 2;
+      for (size_t i = 0; i < n; i++)
+        this->flash[this->pending_addr_ + i] &= this->pending_page_[i];
+      break;
+    }
+    case WRITE_EEPROM_BYTE:
+      if (complete)
+        this->eeprom[this->pending_addr_] = this->pending_value_;
+      break;
+    case WRITE_EEPROM_PAGE:
+      if (complete) {
+        for (auto &loaded : this->eeprom_loaded_)
+          this->eeprom[this->pending_addr_ + loaded.first] = loaded.second;
+      }
+      this->eeprom_loaded_.clear();
+      std::fill(this->eeprom_buffer_.begin(), this->eeprom_buffer_.end(), 0xFF);
+      break;
+    case WRITE_ERASE:
+      std::fill(this->flash.begin(), complete ? this->flash.end() : this->flash.begin() + this->flash.size() / 2,
+                0xFF);
+      if (complete) {
+        std::fill(this->eeprom.begin(), this->eeprom.end(), 0xFF);
+        this->lock = 0xFF;
+      }
+      break;
+    case WRITE_FUSE:
+      if (!complete)
+        break;
+      if (this->pending_fuse_ == 0xA0)
+        this->fuses[0] = this->pending_value_;
+      else if (this->pending_fuse_ == 0xA8)
+        this->fuses[1] = this->pending_value_;
+      else if (this->pending_fuse_ == 0xA4)
+        this->fuses[2] = this->pending_value_;
+      else
+        this->lock = this->pending_value_;
+      break;
+    case WRITE_NONE:
+      break;
+  }
+  this->pending_ = WRITE_NONE;
+}
+
+void IspBus::select(esphome::spi::SPIClient *device, bool selected) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  if (selected) {
+    if (this->selected_ != nullptr && this->selected_ != device)
+      this->overlaps++;
+    this->selected_ = device;
+  } else if (this->selected_ == device) {
+    this->selected_ = nullptr;
+  }
+}
+
+void IspBus::transfer(esphome::spi::SPIClient *device, uint8_t *data, size_t len, uint32_t rate) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->transfers++;
+  this->bytes += len;
+  if (this->selected_ != device)
+    this->unselected_bytes += len;
+  // The real clock moves on by itself
+  bool timed = esphome::host::is_virtual_clock();
+  uint64_t byte_ns = (8000000000ULL + rate - 1) / rate;
+  if (timed)
+    esphome::host::advance_ns(this->transfer_overhead_ns);
+  for (size_t i = 0; i < len; i++) {
+    uint8_t miso = 0xFF;
+    for (auto *target : this->targets_) miso &= target->clock(data[i], rate);
+    data[i] = miso;
+    if (timed)
+      esphome::host::advance_ns(byte_ns);
+  }
+}
+
+}  // namespace avr_emulator
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "esphome/components/output/binary_output.h"
+#include "esphome/components/spi/spi.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace avr_emulator {
+
+// What differs between the emulated parts. Times are the datasheet
+// t_WD_* maximums for serial programming, in microseconds
+struct AvrPart {
+  const char *name;
+  uint32_t signature;
+  uint32_t flash_size;       // bytes
+  uint32_t flash_page_size;  // bytes
+  uint32_t eeprom_size;
+  uint32_t eeprom_page_size;
+  uint8_t fuses[3];          // low, high, extended as shipped
+  uint8_t calibration;
+  uint32_t flash_write_us;
+  uint32_t eeprom_write_us;
+  uint32_t erase_us;
+  uint32_t fuse_write_us;
+  uint32_t f_cpu;            // the ISP clock must stay at or below f_cpu / 4
+};
+
+extern const AvrPart ATMEGA328P;
+extern const AvrPart ATMEGA2560;
+
+// Counters a test can assert on
+struct AvrStats {
+  uint32_t enables;            // programming enables that synced
+  uint32_t failed_enables;     // programming enables that didn't
+  uint32_t instructions;       // complete four byte instructions
+  uint32_t ext_loads;          // 0x4D load extended address
+  uint32_t page_loads;         // 0x40 / 0x48 load program memory page
+  uint32_t page_writes;        // 0x4C write program memory page
+  uint32_t eeprom_byte_writes; // 0xC0
+  uint32_t eeprom_page_loads;  // 0xC1
+  uint32_t eeprom_page_writes; // 0xC2
+  uint32_t chip_erases;
+  uint32_t fuse_writes;
+  uint32_t polls;              // 0xF0 RDY/BSY
+  uint32_t flash_reads;        // 0x20 / 0x28
+  uint32_t eeprom_reads;       // 0xA0
+  uint32_t busy_violations;    // anything but a poll or a read sent while busy
+  uint32_t interrupted_writes; // reset released before a write finished
+  uint32_t rate_violations;    // bytes clocked faster than f_cpu / 4
+};
+
+// One AVR on the ISP bus. Its reset line is the avr_enable output of the
+// component: on (high) runs the part, off (low) holds it in reset, where
+// it accepts serial programming instructions. Writes take the datasheet
+// time and are only applied once it has passed
+class AvrTarget : public esphome::output::BinaryOutput {
+ public:
+  explicit AvrTarget(const AvrPart &part);
+
+  const AvrPart &part() const { return this->part_; }
+  AvrStats stats{};
+
+  // Whole memories, addressed in bytes
+  std::vector<uint8_t> flash;
+  std::vector<uint8_t> eeprom;
+  uint8_t fuses[3];
+  uint8_t lock{0xFF};
+
+  bool in_reset() const { return this->in_reset_; }
+  bool programming() const { return this->programming_; }
+  bool busy();
+
+  // Clock one byte in. Returns what the part drives on MISO, 0xFF when it
+  // isn't listening
+  uint8_t clock(uint8_t mosi, uint32_t rate);
+
+ protected:
+  void write_state(bool state) override;
+  void instruction_(uint8_t *in, uint8_t *out);
+  uint8_t read_(const uint8_t *in);
+  void start_write_(uint32_t duration_us);
+  void settle_();
+  void finish_write_(bool complete);
+
+  // A write that has been started and is applied once it completes
+  enum WriteKind { WRITE_NONE, WRITE_FLASH_PAGE, WRITE_EEPROM_BYTE, WRITE_EEPROM_PAGE, WRITE_ERASE, WRITE_FUSE };
+  WriteKind pending_{WRITE_NONE};
+  uint32_t pending_addr_{0};
+  uint8_t pending_value_{0};
+  uint8_t pending_fuse_{0};
+  uint64_t busy_until_ns_{0};
+
+  const AvrPart &part_;
+  bool in_reset_{false};
+  uint64_t reset_at_ns_{0};
+  bool programming_{false};
+  uint8_t bytes_[4];
+  int position_{0};
+  uint8_t ext_addr_{0};
+  std::vector<uint8_t> page_buffer_;
+  std::vector<uint8_t> pending_page_;
+  std::vector<uint8_t> eeprom_buffer_;
+  std::map<uint32_t, uint8_t> eeprom_loaded_;
+  // The reset line and the bus may be driven from different threads
+  std::mutex lock_;
+};
+
+// The SPI bus with one or more targets on it. Broadcast targets share
+// SCK and MOSI, MISO is the wired AND of everything driving it. Every byte
+// takes eight clock periods of the host clock
+class IspBus : public esphome::spi::SPIHostBus {
+ public:
+  void add(AvrTarget *target) { this->targets_.push_back(target); }
+
+  void select(esphome::spi::SPIClient *device, bool selected) override;
+  void transfer(esphome::spi::SPIClient *device, uint8_t *data, size_t len, uint32_t rate) override;
+
+  // Fixed cost of each transfer() call on top of the bits, the setup of
+  // an SPI transaction on the ESP
+  uint32_t transfer_overhead_ns{10000};
+
+  uint32_t bytes{0};
+  uint32_t transfers{0};
+  // bytes clocked by a device that hadn't enabled the bus
+  uint32_t unselected_bytes{0};
+  // a device enabled the bus while another one had it
+  uint32_t overlaps{0};
+
+ protected:
+  std::vector<AvrTarget *> targets_;
+  esphome::spi::SPIClient *selected_{nullptr};
+  std::mutex lock_;
+};
+
+}  // namespace avr_emulator
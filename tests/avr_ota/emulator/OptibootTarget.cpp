@@ -0,0 +1,202 @@
+#include "OptibootTarget.h"
+
+#include "avr_commands.h"
+#include "host.h"
+
+#include <algorithm>
+
+namespace avr_emulator {
+
+using esphome::host::now_ns;
+
+// Optiboot's watchdog timeout without a command
+static const uint64_t BOOT_TIMEOUT_NS = 1000000000;
+// What a poll of an empty receive buffer costs the ESP
+static const uint64_t POLL_NS = 10000;
+
+OptibootTarget::OptibootTarget(const AvrPart &part, uint32_t boot_baud)
+    : flash(part.flash_size, 0xFF), eeprom(part.eeprom_size, 0xFF), part_(part), boot_baud_(boot_baud) {}
+
+bool OptibootTarget::in_bootloader() {
+  if (this->in_boot_ && now_ns() - this->last_ns_ > BOOT_TIMEOUT_NS) {
+    this->in_boot_ = false;
+    this->stats.timeouts++;
+  }
+  return this->in_boot_;
+}
+
+void OptibootTarget::write_state(bool state) {
+  if (!state) {
+    this->in_reset_ = true;
+    this->in_boot_ = false;
+    return;
+  }
+  if (!this->in_reset_)
+    return;
+  // Out of reset the bootloader runs first
+  this->in_reset_ = false;
+  this->in_boot_ = true;
+  this->last_ns_ = now_ns();
+  this->command_buf_.clear();
+  this->ext_addr_ = 0;
+  this->stats.starts++;
+}
+
+void OptibootTarget::write_array(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    esphome::host::advance_ns(this->byte_ns_());
+    if (this->in_reset_ || !this->in_bootloader()) {
+      this->stats.app_bytes++;
+      continue;
+    }
+    if (this->baud_rate_ != this->boot_baud_) {
+      this->stats.garbled_bytes++;
+      continue;
+    }
+    this->command_buf_.push_back(data[i]);
+    this->command_();
+  }
+}
+
+// Answer the command in command_buf_ once it is complete
+void OptibootTarget::command_() {
+  const auto &c = this->command_buf_;
+  size_t need;
+  switch (c[0]) {
+    case Cmnd_STK_GET_PARAMETER:
+      need = 3;
+      break;
+    case Cmnd_STK_SET_DEVICE:
+      need = 22;
+      break;
+    case Cmnd_STK_SET_DEVICE_EXT:
+      need = 7;
+      break;
+    case Cmnd_STK_LOAD_ADDRESS:
+      need = 4;
+      break;
+    case Cmnd_STK_READ_PAGE:
+      need = 5;
+      break;
+    case Cmnd_STK_UNIVERSAL:
+      need = 6;
+      break;
+    case Cmnd_STK_PROG_PAGE:
+      need = c.size() < 3 ? 5 : 5 + (c[1] << 8 | c[2]);
+      break;
+    default:
+      need = 2;
+      break;
+  }
+  if (c.size() < need)
+    return;
+
+  std::vector<uint8_t> command(c.begin(), c.end());
+  this->command_buf_.clear();
+  this->last_ns_ = now_ns();
+  if (command.back() != Sync_CRC_EOP) {
+    // verifySpace() lets the watchdog reset the part, into the application
+    this->stats.sync_errors++;
+    this->in_boot_ = false;
+    return;
+  }
+  this->stats.commands++;
+
+  uint32_t byte_addr = ((uint32_t) this->ext_addr_ << 16 | this->address_) * 2;
+  switch (command[0]) {
+    case Cmnd_STK_GET_PARAMETER:
+      reply_({(uint8_t) (command[1] == Parm_STK_SW_MAJOR ? 8 : command[1] == Parm_STK_SW_MINOR ? 3 : 0x03)}, 0);
+      return;
+    case Cmnd_STK_LOAD_ADDRESS:
+      this->address_ = command[1] | command[2] << 8;
+      break;
+    case Cmnd_STK_UNIVERSAL:
+      if (command[1] == 0x4D)
+        this->ext_addr_ = command[3];
+      reply_({0x00}, 0);
+      return;
+    case Cmnd_STK_READ_SIGN:
+      reply_({(uint8_t) (this->part_.signature >> 16), (uint8_t) (this->part_.signature >> 8),
+              (uint8_t) this->part_.signature},
+             0);
+      return;
+    case Cmnd_STK_PROG_PAGE: {
+      size_t length = command[1] << 8 | command[2];
+      const uint8_t *data = command.data() + 4;
+      this->stats.page_writes++;
+      if (command[3] == 'E') {
+        for (size_t i = 0; i < length; i++) this->eeprom[(byte_addr + i) % this->part_.eeprom_size] = data[i];
+        reply_({}, (uint64_t) this->part_.eeprom_write_us * 1000 * length);
+        return;
+      }
+      // The page is erased and then written, both take the write time
+      uint32_t page = byte_addr - byte_addr % this->part_.flash_page_size;
+      std::fill(this->flash.begin() + page, this->flash.begin() + page + this->part_.flash_page_size, 0xFF);
+      for (size_t i = 0; i < length; i++) this->flash[(byte_addr + i) % this->part_.flash_size] = data[i];
+      reply_({}, 2ULL * this->part_.flash_write_us * 1000);
+      return;
+    }
+    case Cmnd_STK_READ_PAGE: {
+      size_t length = command[1] << 8 | command[2];
+      const auto &memory = command[3] == 'E' ? this->eeprom : this->flash;
+      std::vector<uint8_t> data(length);
+      for (size_t i = 0; i < length; i++) data[i] = memory[(byte_addr + i) % memory.size()];
+      this->stats.page_reads++;
+      reply_(data, 0);
+      return;
+    }
+    case Cmnd_STK_LEAVE_PROGMODE:
+      reply_({}, 0);
+      this->stats.leaves++;
+      this->in_boot_ = false;
+      return;
+    default:
+      break;
+  }
+  reply_({}, 0);
+}
+
+// Queue INSYNC, data and OK, the OK ok_delay_ns after the rest
+void OptibootTarget::reply_(const std::vector<uint8_t> &data, uint64_t ok_delay_ns) {
+  uint64_t at = std::max(now_ns(), this->rx_.empty() ? 0 : this->rx_.back().ready_ns);
+  at += this->byte_ns_();
+  this->rx_.push_back({at, Resp_STK_INSYNC});
+  for (uint8_t b : data) {
+    at += this->byte_ns_();
+    this->rx_.push_back({at, b});
+  }
+  this->rx_.push_back({at + ok_delay_ns + this->byte_ns_(), Resp_STK_OK});
+}
+
+int OptibootTarget::available() {
+  uint64_t now = now_ns();
+  int n = 0;
+  for (auto &b : this->rx_) {
+    if (b.ready_ns > now)
+      break;
+    n++;
+  }
+  // Waiting moves the virtual clock on
+  if (n == 0)
+    esphome::host::advance_ns(POLL_NS);
+  return n;
+}
+
+bool OptibootTarget::peek_byte(uint8_t *data) {
+  if (this->available() == 0)
+    return false;
+  *data = this->rx_.front().value;
+  return true;
+}
+
+bool OptibootTarget::read_array(uint8_t *data, size_t len) {
+  if ((size_t) this->available() < len)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    data[i] = this->rx_.front().value;
+    this->rx_.pop_front();
+  }
+  return true;
+}
+
+}  // namespace avr_emulator
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "AvrTarget.h"
+
+#include "esphome/components/output/binary_output.h"
+#include "esphome/components/uart/uart.h"
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace avr_emulator {
+
+// Counters a test can assert on
+struct OptibootStats {
+  uint32_t starts;         // bootloader runs after a reset
+  uint32_t commands;       // answered commands
+  uint32_t page_writes;    // PROG_PAGE, flash and eeprom
+  uint32_t page_reads;     // READ_PAGE
+  uint32_t leaves;         // LEAVE_PROGMODE, the application started
+  uint32_t timeouts;       // the bootloader gave up waiting and started the application
+  uint32_t sync_errors;    // a command without CRC_EOP, which restarts it
+  uint32_t garbled_bytes;  // sent to the bootloader at the wrong baud rate
+  uint32_t app_bytes;      // sent while the application was running
+};
+
+// An AVR running Optiboot, seen from the ESP end of its UART. Its reset
+// line is the avr_enable output of the component: releasing reset starts
+// the bootloader, which answers stk500v1 commands at boot_baud until
+// LEAVE_PROGMODE or a second without one. Bytes take ten bit times each
+// way and a flash page the datasheet time to write
+class OptibootTarget : public esphome::uart::UARTComponent, public esphome::output::BinaryOutput {
+ public:
+  OptibootTarget(const AvrPart &part, uint32_t boot_baud);
+
+  OptibootStats stats{};
+  std::vector<uint8_t> flash;
+  std::vector<uint8_t> eeprom;
+
+  bool in_bootloader();
+
+  void write_array(const uint8_t *data, size_t len) override;
+  bool peek_byte(uint8_t *data) override;
+  bool read_array(uint8_t *data, size_t len) override;
+  int available() override;
+  void flush() override {}
+
+ protected:
+  void write_state(bool state) override;
+  void command_();
+  void reply_(const std::vector<uint8_t> &data, uint64_t ok_delay_ns);
+  uint64_t byte_ns_() const { return 10000000000ULL / this->baud_rate_; }
+
+  const AvrPart &part_;
+  uint32_t boot_baud_;
+  bool in_reset_{false};
+  bool in_boot_{false};
+  uint64_t last_ns_{0};     // last command, for the bootloader timeout
+  uint32_t address_{0};     // word address from LOAD_ADDRESS
+  uint8_t ext_addr_{0};     // 64K word segment from UNIVERSAL 0x4D
+  std::vector<uint8_t> command_buf_;
+
+  // Reply bytes with the time they have arrived
+  struct RxByte {
+    uint64_t ready_ns;
+    uint8_t value;
+  };
+  std::deque<RxByte> rx_;
+};
+
+}  // namespace avr_emulator
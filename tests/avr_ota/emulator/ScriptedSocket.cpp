@@ -0,0 +1,214 @@
+#include "ScriptedSocket.h"
+
+#include "host.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace avr_emulator {
+
+using esphome::host::now_ns;
+
+size_t ScriptedClient::round_trips() const {
+  size_t trips = 0;
+  for (size_t i = 0; i < this->answered_ && i < this->steps.size(); i++) {
+    if (this->steps[i].reply > 0)
+      trips++;
+  }
+  return trips;
+}
+
+void ScriptedClient::connect_(uint64_t now) {
+  this->connected_ns = now;
+  // The first request follows the handshake
+  this->send_from_(0, now + 2ULL * this->latency_us * 1000);
+}
+
+// Put step and the ones after it that don't wait for a reply on the link
+void ScriptedClient::send_from_(size_t step, uint64_t leave_ns) {
+  uint64_t latency = (uint64_t) this->latency_us * 1000;
+  while (step < this->steps.size()) {
+    const ScriptStep &s = this->steps[step];
+    uint64_t start = std::max(leave_ns, this->link_free_ns_) + latency;
+    this->in_flight_.push_back({start, s.send, 0});
+    this->link_free_ns_ = start - latency + s.send.size() * this->ns_per_byte_();
+    this->sent_ = ++step;
+    if (s.reply > 0)
+      return;
+    // Nothing to wait for, this step counts as answered once it's out
+    this->answered_ = step;
+    this->replies.emplace_back();
+  }
+  if (this->close_at_end)
+    this->fin_ns_ = this->link_free_ns_ + latency;
+  if (this->finished_ns == 0)
+    this->finished_ns = this->link_free_ns_;
+}
+
+// The ESP sent len bytes
+void ScriptedClient::reply_(const uint8_t *data, size_t len, uint64_t now) {
+  this->received.insert(this->received.end(), data, data + len);
+  while (len > 0 && this->answered_ < this->sent_) {
+    if (this->replies.size() <= this->answered_)
+      this->replies.emplace_back();
+    auto &reply = this->replies[this->answered_];
+    size_t want = this->steps[this->answered_].reply - reply.size();
+    size_t n = std::min(want, len);
+    reply.insert(reply.end(), data, data + n);
+    data += n;
+    len -= n;
+    if (reply.size() < this->steps[this->answered_].reply)
+      return;
+    // Complete, the client sees it one latency and the reply later
+    this->answered_++;
+    uint64_t seen = now + (uint64_t) this->latency_us * 1000 + reply.size() * this->ns_per_byte_() +
+                    (uint64_t) this->steps[this->answered_ - 1].pause_us * 1000;
+    if (this->answered_ == this->steps.size()) {
+      this->finished_ns = seen;
+      if (this->close_at_end)
+        this->fin_ns_ = seen + (uint64_t) this->latency_us * 1000;
+      return;
+    }
+    this->send_from_(this->answered_, seen);
+  }
+}
+
+ssize_t ScriptedConnection::read(void *buf, size_t len) {
+  if (this->closed_) {
+    errno = EBADF;
+    return -1;
+  }
+  ScriptedClient &c = *this->client_;
+  uint64_t now = now_ns();
+  uint64_t per_byte = c.ns_per_byte_();
+  size_t at = 0;
+  while (at < len && !c.in_flight_.empty()) {
+    auto &segment = c.in_flight_.front();
+    if (now < segment.start_ns)
+      break;
+    size_t arrived = segment.data.size();
+    if (per_byte > 0)
+      arrived = std::min<uint64_t>(arrived, (now - segment.start_ns) / per_byte + 1);
+    size_t n = std::min(arrived - segment.consumed, len - at);
+    memcpy((uint8_t *) buf + at, segment.data.data() + segment.consumed, n);
+    segment.consumed += n;
+    at += n;
+    if (segment.consumed < segment.data.size())
+      break;
+    c.in_flight_.pop_front();
+  }
+  if (at > 0)
+    return at;
+  if (c.in_flight_.empty() && c.fin_ns_ != 0 && now >= c.fin_ns_)
+    return 0;
+  errno = EAGAIN;
+  return -1;
+}
+
+ssize_t ScriptedConnection::readv(const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = this->read(iov[i].iov_base, iov[i].iov_len);
+    if (n <= 0)
+      return total > 0 ? total : n;
+    total += n;
+    if ((size_t) n < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
+
+ssize_t ScriptedConnection::write(const void *buf, size_t len) {
+  if (this->closed_ || (this->client_->fin_ns_ != 0 && now_ns() >= this->client_->fin_ns_)) {
+    errno = EPIPE;
+    return -1;
+  }
+  this->client_->reply_((const uint8_t *) buf, len, now_ns());
+  return len;
+}
+
+ssize_t ScriptedConnection::writev(const struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = this->write(iov[i].iov_base, iov[i].iov_len);
+    if (n < 0)
+      return total > 0 ? total : n;
+    total += n;
+  }
+  return total;
+}
+
+int ScriptedConnection::close() {
+  if (!this->closed_) {
+    this->closed_ = true;
+    this->client_->closed_by_esp = true;
+    if (this->client_->finished_ns == 0)
+      this->client_->finished_ns = now_ns();
+  }
+  return 0;
+}
+
+// The listening socket socket_ip() returns while a ScriptedNetwork exists
+class ScriptedListener : public ScriptedConnection {
+ public:
+  explicit ScriptedListener(ScriptedNetwork *network) : ScriptedConnection(nullptr), network_(network) {}
+
+  int bind(const struct sockaddr *addr, socklen_t addrlen) override {
+    this->port_ = ntohs(((const struct sockaddr_in *) addr)->sin_port);
+    return 0;
+  }
+  std::unique_ptr<Socket> accept(struct sockaddr *addr, socklen_t *addrlen) override {
+    auto client = this->network_->accept_(this->port_);
+    if (client == nullptr) {
+      errno = EAGAIN;
+      return nullptr;
+    }
+    return std::unique_ptr<Socket>(new ScriptedConnection(client));
+  }
+  int close() override { return 0; }
+  ssize_t read(void *buf, size_t len) override {
+    errno = EAGAIN;
+    return -1;
+  }
+  ssize_t write(const void *buf, size_t len) override {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+ protected:
+  ScriptedNetwork *network_;
+  uint16_t port_{0};
+};
+
+ScriptedNetwork::ScriptedNetwork() {
+  esphome::host::set_socket_factory([this](int type, int protocol) -> std::unique_ptr<esphome::socket::Socket> {
+    return std::unique_ptr<esphome::socket::Socket>(new ScriptedListener(this));
+  });
+}
+
+ScriptedNetwork::~ScriptedNetwork() { esphome::host::set_socket_factory(nullptr); }
+
+std::shared_ptr<ScriptedClient> ScriptedNetwork::connect(std::shared_ptr<ScriptedClient> client) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  client->connect_(now_ns());
+  this->pending_.push_back(client);
+  return client;
+}
+
+std::shared_ptr<ScriptedClient> ScriptedNetwork::accept_(uint16_t port) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  uint64_t now = now_ns();
+  for (size_t i = 0; i < this->pending_.size(); i++) {
+    auto client = this->pending_[i];
+    if (client->port != 0 && client->port != port)
+      continue;
+    if (now < client->connected_ns + (uint64_t) client->latency_us * 1000)
+      continue;
+    this->pending_.erase(this->pending_.begin() + i);
+    client->accepted = true;
+    return client;
+  }
+  return nullptr;
+}
+
+}  // namespace avr_emulator
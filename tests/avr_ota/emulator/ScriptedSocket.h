@@ -0,0 +1,129 @@
+#pragma once
+
+#include "esphome/components/socket/socket.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace avr_emulator {
+
+// One request of a scripted client: the bytes it sends and how many reply
+// bytes it waits for before sending the next one. Requests without a reply
+// are sent straight after each other, like a stream
+struct ScriptStep {
+  std::vector<uint8_t> send;
+  size_t reply;
+  uint32_t pause_us;  // wait after the reply, like avrdude after a chip erase
+};
+
+// A client on the other end of a TCP connection, driven by the host clock.
+// Each request leaves when the reply to the one before has come back, so it
+// reaches the ESP two one way latencies after the ESP flushed that reply,
+// and arrives at the link rate from there on
+class ScriptedClient {
+ public:
+  std::vector<ScriptStep> steps;
+  // Close the connection after the last reply (or straight after sending
+  // the last step if it expects none). Otherwise the client just goes quiet
+  bool close_at_end{true};
+
+  uint32_t latency_us{1000};     // one way
+  uint32_t bytes_per_ms{1000};   // link rate, 0 for unlimited
+  uint16_t port{0};              // listener to connect to, 0 for any
+
+  // Results
+  std::vector<uint8_t> received;             // everything the ESP sent
+  std::vector<std::vector<uint8_t>> replies;  // the reply to each step
+  bool accepted{false};
+  bool closed_by_esp{false};
+  uint64_t connected_ns{0};
+  uint64_t finished_ns{0};     // last step answered or the ESP closed
+
+  // All steps answered, or the ESP gave up on the connection
+  bool done() const { return this->closed_by_esp || (this->finished_ns != 0 && this->answered_ == this->steps.size()); }
+  // Steps that were answered in full
+  size_t answered() const { return this->answered_; }
+  // Round trips the client waited for
+  size_t round_trips() const;
+
+  // Append a step
+  void send(std::vector<uint8_t> data, size_t reply, uint32_t pause_us = 0) {
+    this->steps.push_back({std::move(data), reply, pause_us});
+  }
+
+ protected:
+  friend class ScriptedConnection;
+  friend class ScriptedNetwork;
+
+  // Data on its way to the ESP. Byte i of a segment arrives at
+  // start_ns + i * ns_per_byte
+  struct Segment {
+    uint64_t start_ns;
+    std::vector<uint8_t> data;
+    size_t consumed;
+  };
+  void connect_(uint64_t now_ns);
+  void send_from_(size_t step, uint64_t leave_ns);
+  void reply_(const uint8_t *data, size_t len, uint64_t now_ns);
+  uint64_t ns_per_byte_() const { return this->bytes_per_ms == 0 ? 0 : 1000000 / this->bytes_per_ms; }
+
+  std::deque<Segment> in_flight_;
+  uint64_t link_free_ns_{0};   // when the link has sent everything queued
+  size_t sent_{0};             // steps handed to the link
+  size_t answered_{0};         // steps whose reply is complete
+  uint64_t fin_ns_{0};         // when the close reaches the ESP, 0 if not closing
+};
+
+// The ESP end of a scripted connection
+class ScriptedConnection : public esphome::socket::Socket {
+ public:
+  explicit ScriptedConnection(std::shared_ptr<ScriptedClient> client) : client_(std::move(client)) {}
+
+  std::unique_ptr<Socket> accept(struct sockaddr *addr, socklen_t *addrlen) override { return nullptr; }
+  int bind(const struct sockaddr *addr, socklen_t addrlen) override { return 0; }
+  int close() override;
+  int shutdown(int how) override { return 0; }
+  int getpeername(struct sockaddr *addr, socklen_t *addrlen) override { return -1; }
+  std::string getpeername() override { return "scripted"; }
+  int getsockname(struct sockaddr *addr, socklen_t *addrlen) override { return -1; }
+  std::string getsockname() override { return "esp"; }
+  int getsockopt(int level, int optname, void *optval, socklen_t *optlen) override { return 0; }
+  int setsockopt(int level, int optname, const void *optval, socklen_t optlen) override { return 0; }
+  int listen(int backlog) override { return 0; }
+  ssize_t read(void *buf, size_t len) override;
+  ssize_t readv(const struct iovec *iov, int iovcnt) override;
+  ssize_t write(const void *buf, size_t len) override;
+  ssize_t writev(const struct iovec *iov, int iovcnt) override;
+  ssize_t sendto(const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) override {
+    return this->write(buf, len);
+  }
+  int setblocking(bool blocking) override { return 0; }
+
+ protected:
+  std::shared_ptr<ScriptedClient> client_;
+  bool closed_{false};
+};
+
+// Stands in for the network: socket_ip() hands out a listener that accepts
+// the clients connected here once their connection is established. Clients
+// may be connected from another thread than the one accepting them
+class ScriptedNetwork {
+ public:
+  ScriptedNetwork();
+  ~ScriptedNetwork();
+
+  // The client connects now
+  std::shared_ptr<ScriptedClient> connect(std::shared_ptr<ScriptedClient> client);
+
+  // The next client for port whose connection is up, nullptr if none
+  std::shared_ptr<ScriptedClient> accept_(uint16_t port);
+
+ protected:
+  std::vector<std::shared_ptr<ScriptedClient>> pending_;
+  std::mutex lock_;
+};
+
+}  // namespace avr_emulator
@@ -0,0 +1,223 @@
+#include "Scripts.h"
+
+#include "avr_commands.h"
+#include "native_commands.h"
+#include "stk500v2_commands.h"
+
+#include <algorithm>
+
+namespace avr_emulator {
+
+std::vector<uint8_t> test_image(size_t size, uint32_t seed) {
+  std::vector<uint8_t> image(size);
+  uint32_t x = seed * 2654435761u + 1;
+  for (size_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    // Every 512 bytes the last 48 are left blank
+    image[i] = (i % 512) >= 464 ? 0xFF : (uint8_t) x;
+  }
+  return image;
+}
+
+void stk500v1_prologue(ScriptedClient &client, const AvrPart &part, bool erase) {
+  client.send({Cmnd_STK_GET_SYNC, Sync_CRC_EOP}, 2);
+  for (uint8_t parameter : {Parm_STK_HW_VER, Parm_STK_SW_MAJOR, Parm_STK_SW_MINOR})
+    client.send({Cmnd_STK_GET_PARAMETER, parameter, Sync_CRC_EOP}, 3);
+
+  uint32_t page = part.flash_page_size, eeprom = part.eeprom_size, flash = part.flash_size;
+  client.send({Cmnd_STK_SET_DEVICE,
+               0x86, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x03, 0xFF, 0xFF, 0xFF, 0xFF,
+               (uint8_t) (page >> 8), (uint8_t) page,
+               (uint8_t) (eeprom >> 8), (uint8_t) eeprom,
+               (uint8_t) (flash >> 24), (uint8_t) (flash >> 16), (uint8_t) (flash >> 8), (uint8_t) flash,
+               Sync_CRC_EOP},
+              2);
+  client.send({Cmnd_STK_SET_DEVICE_EXT, 0x05, (uint8_t) part.eeprom_page_size, 0xD7, 0xC2, 0x00, Sync_CRC_EOP}, 2);
+  client.send({Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP}, 2);
+  client.send({Cmnd_STK_READ_SIGN, Sync_CRC_EOP}, 5);
+  if (!erase)
+    return;
+  // avrdude sleeps for the chip_erase_delay of the part after the erase
+  client.send({Cmnd_STK_UNIVERSAL, 0xAC, 0x80, 0x00, 0x00, Sync_CRC_EOP}, 3, part.erase_us);
+}
+
+void stk500v1_page(ScriptedClient &client, char memtype, uint32_t byte_addr, const uint8_t *data, size_t length,
+                   uint8_t *ext) {
+  uint32_t word = byte_addr / 2;
+  if (memtype == 'F' && ((word >> 16) & 0xFF) != *ext) {
+    *ext = (word >> 16) & 0xFF;
+    client.send({Cmnd_STK_UNIVERSAL, 0x4D, 0x00, *ext, 0x00, Sync_CRC_EOP}, 3);
+  }
+  client.send({Cmnd_STK_LOAD_ADDRESS, (uint8_t) word, (uint8_t) (word >> 8), Sync_CRC_EOP}, 2);
+  std::vector<uint8_t> cmd = {Cmnd_STK_PROG_PAGE, (uint8_t) (length >> 8), (uint8_t) length, (uint8_t) memtype};
+  cmd.insert(cmd.end(), data, data + length);
+  cmd.push_back(Sync_CRC_EOP);
+  client.send(cmd, 2);
+}
+
+void stk500v1_program(ScriptedClient &client, const AvrPart &part, const std::vector<uint8_t> &flash,
+                      const std::vector<uint8_t> &eeprom, bool verify) {
+  stk500v1_prologue(client, part);
+
+  uint8_t ext = 0;
+  for (size_t addr = 0; addr < flash.size(); addr += part.flash_page_size) {
+    size_t n = std::min<size_t>(part.flash_page_size, flash.size() - addr);
+    stk500v1_page(client, 'F', addr, flash.data() + addr, n, &ext);
+  }
+  // avrdude writes eeprom in chunks of the page buffer size it was given
+  for (size_t addr = 0; addr < eeprom.size(); addr += part.flash_page_size) {
+    size_t n = std::min<size_t>(part.flash_page_size, eeprom.size() - addr);
+    stk500v1_page(client, 'E', addr, eeprom.data() + addr, n, &ext);
+  }
+
+  if (verify) {
+    for (size_t addr = 0; addr < flash.size(); addr += part.flash_page_size) {
+      size_t n = std::min<size_t>(part.flash_page_size, flash.size() - addr);
+      uint32_t word = addr / 2;
+      if (((word >> 16) & 0xFF) != ext) {
+        ext = (word >> 16) & 0xFF;
+        client.send({Cmnd_STK_UNIVERSAL, 0x4D, 0x00, ext, 0x00, Sync_CRC_EOP}, 3);
+      }
+      client.send({Cmnd_STK_LOAD_ADDRESS, (uint8_t) word, (uint8_t) (word >> 8), Sync_CRC_EOP}, 2);
+      client.send({Cmnd_STK_READ_PAGE, (uint8_t) (n >> 8), (uint8_t) n, 'F', Sync_CRC_EOP}, n + 2);
+    }
+  }
+
+  client.send({Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP}, 2);
+}
+
+void stk500v2_command(ScriptedClient &client, uint8_t seq, std::vector<uint8_t> body, size_t answer_len) {
+  std::vector<uint8_t> msg = {MESSAGE_START, seq, (uint8_t) (body.size() >> 8), (uint8_t) body.size(), TOKEN};
+  msg.insert(msg.end(), body.begin(), body.end());
+  uint8_t sum = 0;
+  for (uint8_t b : msg) sum ^= b;
+  msg.push_back(sum);
+  client.send(msg, STK500V2_HEADER_SIZE + answer_len + 1);
+}
+
+uint32_t crc32(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+// One record: length, address, type, data and checksum
+static void ihex_record(std::string &out, uint16_t addr, uint8_t type, const uint8_t *data, size_t len) {
+  std::vector<uint8_t> record = {(uint8_t) len, (uint8_t) (addr >> 8), (uint8_t) addr, type};
+  record.insert(record.end(), data, data + len);
+  uint8_t sum = 0;
+  for (uint8_t b : record) sum += b;
+  record.push_back(-sum);
+  static const char *digits = "0123456789ABCDEF";
+  out += ':';
+  for (uint8_t b : record) {
+    out += digits[b >> 4];
+    out += digits[b & 0x0F];
+  }
+  out += "\r\n";
+}
+
+std::string ihex_image(const std::vector<uint8_t> &image) {
+  std::string out;
+  for (size_t addr = 0; addr < image.size(); addr += 16) {
+    if (addr > 0 && addr % 0x10000 == 0) {
+      uint8_t segment[2] = {(uint8_t) (addr >> 24), (uint8_t) (addr >> 16)};
+      ihex_record(out, 0, 0x04, segment, 2);
+    }
+    size_t n = std::min<size_t>(16, image.size() - addr);
+    ihex_record(out, addr & 0xFFFF, 0x00, image.data() + addr, n);
+  }
+  ihex_record(out, 0, 0x01, nullptr, 0);
+  return out;
+}
+
+std::vector<uint8_t> native_header(char memtype, uint8_t format, uint8_t flags, uint32_t signature,
+                                   uint16_t pagesize, const std::vector<uint8_t> &payload) {
+  uint32_t size = payload.size();
+  uint32_t crc = crc32(payload.data(), payload.size());
+  return {NATIVE_MAGIC,
+          'A',
+          'V',
+          'R',
+          NATIVE_VERSION,
+          (uint8_t) memtype,
+          format,
+          flags,
+          (uint8_t) (signature >> 16),
+          (uint8_t) (signature >> 8),
+          (uint8_t) signature,
+          NATIVE_COMPRESS_NONE,
+          (uint8_t) (pagesize >> 8),
+          (uint8_t) pagesize,
+          0,
+          0,
+          (uint8_t) (size >> 24),
+          (uint8_t) (size >> 16),
+          (uint8_t) (size >> 8),
+          (uint8_t) size,
+          (uint8_t) (crc >> 24),
+          (uint8_t) (crc >> 16),
+          (uint8_t) (crc >> 8),
+          (uint8_t) crc};
+}
+
+void HeatshrinkWriter::bits_(uint32_t value, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    this->pending_ = this->pending_ << 1 | ((value >> i) & 1);
+    if (++this->pending_bits_ == 8) {
+      this->out_.push_back(this->pending_);
+      this->pending_ = 0;
+      this->pending_bits_ = 0;
+    }
+  }
+}
+
+void HeatshrinkWriter::literal(uint8_t byte) {
+  bits_(1, 1);
+  bits_(byte, 8);
+}
+
+void HeatshrinkWriter::reference(uint32_t distance, uint32_t count) {
+  bits_(0, 1);
+  bits_(distance - 1, this->window_bits);
+  bits_(count - 1, this->lookahead_bits);
+}
+
+std::vector<uint8_t> HeatshrinkWriter::finish() {
+  if (this->pending_bits_ > 0)
+    bits_(0, 8 - this->pending_bits_);
+  return this->out_;
+}
+
+std::vector<uint8_t> heatshrink_encode(const std::vector<uint8_t> &data, int window_bits, int lookahead_bits) {
+  HeatshrinkWriter writer(window_bits, lookahead_bits);
+  size_t window = (size_t) 1 << window_bits, lookahead = (size_t) 1 << lookahead_bits;
+  // A reference has to save bits over the literals it replaces
+  size_t shortest = (1 + window_bits + lookahead_bits) / 9 + 1;
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t best = 0, best_distance = 0;
+    for (size_t distance = 1; distance <= window && distance <= pos; distance++) {
+      size_t n = 0;
+      while (n < lookahead && pos + n < data.size() && data[pos + n] == data[pos + n - distance]) n++;
+      if (n > best) {
+        best = n;
+        best_distance = distance;
+      }
+    }
+    if (best >= shortest) {
+      writer.reference(best_distance, best);
+      pos += best;
+    } else {
+      writer.literal(data[pos++]);
+    }
+  }
+  return writer.finish();
+}
+
+}  // namespace avr_emulator
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "AvrTarget.h"
+#include "ScriptedSocket.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace avr_emulator {
+
+// A firmware-like image of size bytes: code with some 0xFF runs in it, the
+// way linker padding and unused vectors look. Same seed, same image
+std::vector<uint8_t> test_image(size_t size, uint32_t seed);
+
+// What avrdude -c stk500v1 sends to program flash (and eeprom if given)
+// on part: sync, parameters, SET_DEVICE, programming mode, signature, chip
+// erase, a LOAD_ADDRESS and PROG_PAGE per page, 0x4D before the address
+// once the image crosses a 64K word boundary, an optional read back of the
+// flash and LEAVE_PROGMODE
+void stk500v1_program(ScriptedClient &client, const AvrPart &part, const std::vector<uint8_t> &flash,
+                      const std::vector<uint8_t> &eeprom, bool verify);
+
+// The first steps of such a session, up to and including the chip erase.
+// Without erase it stops at the signature, like avrdude -D
+void stk500v1_prologue(ScriptedClient &client, const AvrPart &part, bool erase = true);
+
+// One flash page, with the extended address if the page needs it. ext is
+// the extended address byte the client last sent
+void stk500v1_page(ScriptedClient &client, char memtype, uint32_t byte_addr, const uint8_t *data, size_t length,
+                   uint8_t *ext);
+
+// One stk500v2 message with body, expecting an answer of answer_len bytes
+// in the same framing
+void stk500v2_command(ScriptedClient &client, uint8_t seq, std::vector<uint8_t> body, size_t answer_len);
+
+// CRC-32 (IEEE) as zlib computes it, what native uploads carry
+uint32_t crc32(const uint8_t *data, size_t len);
+
+// Intel HEX text of image loaded at address 0, 16 bytes per record and an
+// extended linear address record wherever a 64K segment starts
+std::string ihex_image(const std::vector<uint8_t> &image);
+
+// The header of a version 2, uncompressed native upload of payload, the way
+// tools/avr_ota_upload.py builds it. The payload follows it on the wire
+std::vector<uint8_t> native_header(char memtype, uint8_t format, uint8_t flags, uint32_t signature,
+                                   uint16_t pagesize, const std::vector<uint8_t> &payload);
+
+// Writes a heatshrink bit stream: a 1 and 8 bits for a literal, a 0,
+// window_bits of distance - 1 and lookahead_bits of count - 1 for a back
+// reference. finish() pads the last byte with zeros
+class HeatshrinkWriter {
+ public:
+  HeatshrinkWriter(int window_bits, int lookahead_bits) : window_bits(window_bits), lookahead_bits(lookahead_bits) {}
+
+  void literal(uint8_t byte);
+  void reference(uint32_t distance, uint32_t count);
+  std::vector<uint8_t> finish();
+
+  const int window_bits;
+  const int lookahead_bits;
+
+ protected:
+  void bits_(uint32_t value, int n);
+
+  std::vector<uint8_t> out_;
+  uint32_t pending_{0};
+  int pending_bits_{0};
+};
+
+// data compressed the way the heatshrink encoder would, with the longest
+// earlier match within the window wherever it is shorter than literals
+std::vector<uint8_t> heatshrink_encode(const std::vector<uint8_t> &data, int window_bits, int lookahead_bits);
+
+}  // namespace avr_emulator
@@ -0,0 +1,9 @@
+#pragma once
+
+namespace esphome {
+namespace network {
+
+const char *get_use_address();
+
+}  // namespace network
+}  // namespace esphome
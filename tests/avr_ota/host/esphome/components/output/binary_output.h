@@ -0,0 +1,23 @@
+#pragma once
+
+namespace esphome {
+namespace output {
+
+class BinaryOutput {
+ public:
+  virtual ~BinaryOutput() = default;
+  void set_state(bool state) {
+    if (state)
+      this->turn_on();
+    else
+      this->turn_off();
+  }
+  virtual void turn_on() { this->write_state(true); }
+  virtual void turn_off() { this->write_state(false); }
+
+ protected:
+  virtual void write_state(bool state) = 0;
+};
+
+}  // namespace output
+}  // namespace esphome
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "esphome/core/component.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace spi {
+
+enum SPIBitOrder {
+  BIT_ORDER_LSB_FIRST,
+  BIT_ORDER_MSB_FIRST,
+};
+
+enum SPIClockPolarity {
+  CLOCK_POLARITY_LOW = false,
+  CLOCK_POLARITY_HIGH = true,
+};
+
+enum SPIClockPhase {
+  CLOCK_PHASE_LEADING,
+  CLOCK_PHASE_TRAILING,
+};
+
+enum SPIDataRate : uint32_t {
+  DATA_RATE_1KHZ = 1000,
+  DATA_RATE_75KHZ = 75000,
+  DATA_RATE_200KHZ = 200000,
+  DATA_RATE_1MHZ = 1000000,
+  DATA_RATE_2MHZ = 2000000,
+  DATA_RATE_4MHZ = 4000000,
+  DATA_RATE_5MHZ = 5000000,
+  DATA_RATE_8MHZ = 8000000,
+  DATA_RATE_10MHZ = 10000000,
+  DATA_RATE_20MHZ = 20000000,
+  DATA_RATE_40MHZ = 40000000,
+  DATA_RATE_80MHZ = 80000000,
+};
+
+class SPIClient;
+
+// Whatever is wired to the host SPI bus. Every device on the bus talks to
+// the one installed with set_host_bus()
+class SPIHostBus {
+ public:
+  virtual ~SPIHostBus() = default;
+  // The device asserted (enable) or released (disable) its chip select
+  virtual void select(SPIClient *device, bool selected) {}
+  // Clock len bytes out of data at rate Hz, replacing them with the bytes read
+  virtual void transfer(SPIClient *device, uint8_t *data, size_t len, uint32_t rate) = 0;
+};
+
+void set_host_bus(SPIHostBus *bus);
+SPIHostBus *get_host_bus();
+
+class SPIClient {
+ public:
+  SPIClient(uint32_t data_rate) : data_rate_(data_rate) {}
+  virtual ~SPIClient() = default;
+
+  virtual void spi_setup() { this->registered_ = true; }
+  virtual void spi_teardown() { this->registered_ = false; }
+
+  void set_data_rate(uint32_t data_rate) { this->data_rate_ = data_rate; }
+  uint32_t get_data_rate() const { return this->data_rate_; }
+
+  void enable() {
+    if (get_host_bus() != nullptr)
+      get_host_bus()->select(this, true);
+  }
+  void disable() {
+    if (get_host_bus() != nullptr)
+      get_host_bus()->select(this, false);
+  }
+
+  void transfer_array(uint8_t *data, size_t length) {
+    if (get_host_bus() != nullptr)
+      get_host_bus()->transfer(this, data, length, this->data_rate_);
+  }
+  uint8_t transfer_byte(uint8_t data) {
+    this->transfer_array(&data, 1);
+    return data;
+  }
+  void write_byte(uint8_t data) { this->transfer_byte(data); }
+  uint8_t read_byte() { return this->transfer_byte(0x00); }
+  void read_array(uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++)
+      data[i] = 0x00;
+    this->transfer_array(data, length);
+  }
+
+ protected:
+  uint32_t data_rate_;
+  bool registered_{false};
+};
+
+template<SPIBitOrder BIT_ORDER, SPIClockPolarity CLOCK_POLARITY, SPIClockPhase CLOCK_PHASE, SPIDataRate DATA_RATE>
+class SPIDevice : public SPIClient {
+ public:
+  SPIDevice() : SPIClient(DATA_RATE) {}
+};
+
+}  // namespace spi
+}  // namespace esphome
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace uart {
+
+// The part of the ESPHome UART bus the component uses. Tests derive from
+// it to put a device on the other end
+class UARTComponent {
+ public:
+  virtual ~UARTComponent() = default;
+
+  virtual void write_array(const uint8_t *data, size_t len) = 0;
+  virtual bool peek_byte(uint8_t *data) = 0;
+  virtual bool read_array(uint8_t *data, size_t len) = 0;
+  virtual int available() = 0;
+  virtual void flush() = 0;
+  // Apply changed settings such as the baud rate
+  virtual void load_settings(bool dump_config) {}
+  virtual void load_settings() { this->load_settings(true); }
+
+  bool read_byte(uint8_t *data) { return this->read_array(data, 1); }
+
+  void set_baud_rate(uint32_t baud_rate) { this->baud_rate_ = baud_rate; }
+  uint32_t get_baud_rate() const { return this->baud_rate_; }
+
+ protected:
+  uint32_t baud_rate_{9600};
+};
+
+}  // namespace uart
+}  // namespace esphome
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "esphome/core/component.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+#include <atomic>
+
+namespace esphome {
+
+class Application {
+ public:
+  void feed_wdt() { this->wdt_feeds_++; }
+  uint32_t get_wdt_feeds() const { return this->wdt_feeds_; }
+
+ protected:
+  std::atomic<uint32_t> wdt_feeds_{0};
+};
+
+extern Application App;
+
+}  // namespace esphome
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace esphome {
+
+namespace setup_priority {
+static const float BUS = 1000.0f;
+static const float HARDWARE = 800.0f;
+static const float DATA = 600.0f;
+static const float AFTER_WIFI = 200.0f;
+}  // namespace setup_priority
+
+class Component {
+ public:
+  virtual ~Component() = default;
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return setup_priority::DATA; }
+
+  void mark_failed() { this->failed_ = true; }
+  bool is_failed() const { return this->failed_; }
+
+ protected:
+  bool failed_{false};
+};
+
+class EntityBase {
+ public:
+  uint32_t get_object_id_hash() { return 0; }
+};
+
+}  // namespace esphome
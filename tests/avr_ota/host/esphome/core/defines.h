@@ -0,0 +1,5 @@
+#pragma once
+
+// Host build: no platform, sensors or text sensors. The test targets add
+// USE_AVR_OTA_* defines on the command line like the code generator does
+#define USE_HOST
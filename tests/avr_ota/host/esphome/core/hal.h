@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+
+// Backed by the host clock, see host.h. With the virtual clock time only
+// moves when something waits, so runs are fast and repeatable
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+}  // namespace esphome
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+
+// Preferences kept in memory for the life of the process
+class ESPPreferenceObject {
+ public:
+  ESPPreferenceObject() = default;
+  explicit ESPPreferenceObject(std::shared_ptr<std::vector<uint8_t>> data) : data_(std::move(data)) {}
+
+  template<typename T> bool save(const T *src) {
+    if (this->data_ == nullptr)
+      return false;
+    this->data_->assign((const uint8_t *) src, (const uint8_t *) src + sizeof(T));
+    return true;
+  }
+  template<typename T> bool load(T *dest) {
+    if (this->data_ == nullptr || this->data_->size() != sizeof(T))
+      return false;
+    memcpy(dest, this->data_->data(), sizeof(T));
+    return true;
+  }
+
+ protected:
+  std::shared_ptr<std::vector<uint8_t>> data_;
+};
+
+class ESPPreferences {
+ public:
+  template<typename T> ESPPreferenceObject make_preference(uint32_t type) {
+    auto &data = this->data_[type];
+    if (data == nullptr)
+      data = std::make_shared<std::vector<uint8_t>>();
+    return ESPPreferenceObject(data);
+  }
+
+ protected:
+  std::map<uint32_t, std::shared_ptr<std::vector<uint8_t>>> data_;
+};
+
+extern ESPPreferences *global_preferences;
+
+}  // namespace esphome
@@ -0,0 +1,82 @@
+#include "host.h"
+
+#include "esphome/components/network/util.h"
+#include "esphome/components/spi/spi.h"
+#include "esphome/core/application.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+#include "esphome/core/preferences.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <thread>
+
+namespace esphome {
+
+Application App;
+
+static ESPPreferences host_preferences;
+ESPPreferences *global_preferences = &host_preferences;
+
+namespace network {
+const char *get_use_address() { return "127.0.0.1"; }
+}  // namespace network
+
+namespace spi {
+static SPIHostBus *host_bus = nullptr;
+void set_host_bus(SPIHostBus *bus) { host_bus = bus; }
+SPIHostBus *get_host_bus() { return host_bus; }
+}  // namespace spi
+
+namespace host {
+
+static std::atomic<bool> virtual_clock{true};
+static std::atomic<uint64_t> virtual_ns{0};
+static const auto real_epoch = std::chrono::steady_clock::now();
+static std::atomic<int> log_level{ESPHOME_LOG_LEVEL_WARN};
+
+void use_virtual_clock(bool use) { virtual_clock = use; }
+bool is_virtual_clock() { return virtual_clock; }
+
+uint64_t now_ns() {
+  if (virtual_clock)
+    return virtual_ns;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - real_epoch).count();
+}
+
+void advance_ns(uint64_t ns) {
+  if (virtual_clock) {
+    virtual_ns += ns;
+    return;
+  }
+  std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+}
+
+void set_log_level(int level) { log_level = level; }
+
+}  // namespace host
+
+uint32_t millis() { return host::now_ns() / 1000000; }
+uint32_t micros() { return host::now_ns() / 1000; }
+void delay(uint32_t ms) { host::advance_ns((uint64_t) ms * 1000000); }
+void delayMicroseconds(uint32_t us) { host::advance_ns((uint64_t) us * 1000); }
+void yield() {
+  if (!host::is_virtual_clock())
+    std::this_thread::yield();
+}
+
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...) {
+  if (level > host::log_level)
+    return;
+  static const char LETTERS[] = "?EWICDVV";
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  fprintf(stderr, "[%9.3f][%c][%s:%d]: %s\n", host::now_ns() / 1e6, LETTERS[level & 7], tag, line, message);
+}
+
+}  // namespace esphome
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "esphome/components/socket/socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace esphome {
+namespace host {
+
+// Host clock behind millis(), micros() and delay(). The virtual clock only
+// moves when something waits or a transfer takes time, so programming
+// sessions run in a fraction of their real time and repeat exactly. The
+// real clock is for tests with threads or real sockets
+void use_virtual_clock(bool virtual_clock);
+bool is_virtual_clock();
+uint64_t now_ns();
+// Move the virtual clock on. Sleeps with the real clock
+void advance_ns(uint64_t ns);
+
+// Messages above this level are dropped, ESPHOME_LOG_LEVEL_* from log.h
+void set_log_level(int level);
+
+// Replaces socket_ip() while set, nullptr goes back to POSIX sockets
+typedef std::function<std::unique_ptr<socket::Socket>(int type, int protocol)> SocketFactory;
+void set_socket_factory(SocketFactory factory);
+
+// A POSIX socket, as socket_ip() returns without a factory
+std::unique_ptr<socket::Socket> posix_socket(int domain, int type, int protocol);
+
+}  // namespace host
+}  // namespace esphome
@@ -0,0 +1,126 @@
+#include "host.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <mutex>
+
+namespace esphome {
+namespace host {
+
+static std::mutex factory_lock;
+static SocketFactory socket_factory;
+
+void set_socket_factory(SocketFactory factory) {
+  std::lock_guard<std::mutex> guard(factory_lock);
+  socket_factory = std::move(factory);
+}
+
+// A plain POSIX socket descriptor
+class PosixSocket : public socket::Socket {
+ public:
+  PosixSocket(int fd) : fd_(fd) {}
+  ~PosixSocket() override { this->close(); }
+
+  std::unique_ptr<socket::Socket> accept(struct sockaddr *addr, socklen_t *addrlen) override {
+    int fd = ::accept(this->fd_, addr, addrlen);
+    if (fd < 0)
+      return nullptr;
+    return std::unique_ptr<socket::Socket>(new PosixSocket(fd));
+  }
+  int bind(const struct sockaddr *addr, socklen_t addrlen) override { return ::bind(this->fd_, addr, addrlen); }
+  int close() override {
+    if (this->fd_ < 0)
+      return 0;
+    int res = ::close(this->fd_);
+    this->fd_ = -1;
+    return res;
+  }
+  int shutdown(int how) override { return ::shutdown(this->fd_, how); }
+
+  int getpeername(struct sockaddr *addr, socklen_t *addrlen) override { return ::getpeername(this->fd_, addr, addrlen); }
+  std::string getpeername() override {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (::getpeername(this->fd_, (struct sockaddr *) &addr, &len) != 0)
+      return "";
+    return format_(addr);
+  }
+  int getsockname(struct sockaddr *addr, socklen_t *addrlen) override { return ::getsockname(this->fd_, addr, addrlen); }
+  std::string getsockname() override {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (::getsockname(this->fd_, (struct sockaddr *) &addr, &len) != 0)
+      return "";
+    return format_(addr);
+  }
+  int getsockopt(int level, int optname, void *optval, socklen_t *optlen) override {
+    return ::getsockopt(this->fd_, level, optname, optval, optlen);
+  }
+  int setsockopt(int level, int optname, const void *optval, socklen_t optlen) override {
+    return ::setsockopt(this->fd_, level, optname, optval, optlen);
+  }
+  int listen(int backlog) override { return ::listen(this->fd_, backlog); }
+  ssize_t read(void *buf, size_t len) override { return ::read(this->fd_, buf, len); }
+  ssize_t readv(const struct iovec *iov, int iovcnt) override { return ::readv(this->fd_, iov, iovcnt); }
+  ssize_t write(const void *buf, size_t len) override { return ::send(this->fd_, buf, len, MSG_NOSIGNAL); }
+  ssize_t writev(const struct iovec *iov, int iovcnt) override { return ::writev(this->fd_, iov, iovcnt); }
+  ssize_t sendto(const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) override {
+    return ::sendto(this->fd_, buf, len, flags | MSG_NOSIGNAL, to, tolen);
+  }
+  int setblocking(bool blocking) override {
+    int flags = fcntl(this->fd_, F_GETFL, 0);
+    if (flags < 0)
+      return -1;
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    return fcntl(this->fd_, F_SETFL, flags) < 0 ? -1 : 0;
+  }
+
+  int get_fd() override { return this->fd_; }
+
+ protected:
+  static std::string format_(const struct sockaddr_in &addr) {
+    char buf[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)) == nullptr)
+      return "";
+    return buf;
+  }
+
+  int fd_;
+};
+
+std::unique_ptr<socket::Socket> posix_socket(int domain, int type, int protocol) {
+  int fd = ::socket(domain, type, protocol);
+  if (fd < 0)
+    return nullptr;
+  return std::unique_ptr<socket::Socket>(new PosixSocket(fd));
+}
+
+}  // namespace host
+
+namespace socket {
+
+std::unique_ptr<Socket> socket_ip(int type, int protocol) {
+  {
+    std::lock_guard<std::mutex> guard(host::factory_lock);
+    if (host::socket_factory)
+      return host::socket_factory(type, protocol);
+  }
+  return host::posix_socket(AF_INET, type, protocol);
+}
+
+socklen_t set_sockaddr_any(struct sockaddr *addr, socklen_t addrlen, uint16_t port) {
+  if (addrlen < sizeof(struct sockaddr_in))
+    return 0;
+  auto *server = (struct sockaddr_in *) addr;
+  memset(server, 0, sizeof(struct sockaddr_in));
+  server->sin_family = AF_INET;
+  server->sin_addr.s_addr = htonl(INADDR_ANY);
+  server->sin_port = htons(port);
+  return sizeof(struct sockaddr_in);
+}
+
+}  // namespace socket
+}  // namespace esphome
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "avr_ota.h"
+#include "emulator/AvrTarget.h"
+#include "emulator/ScriptedSocket.h"
+#include "emulator/Scripts.h"
+#include "host.h"
+
+#include "esphome/core/hal.h"
+
+#include <memory>
+
+namespace avr_test {
+
+using namespace esphome::avr_ota;
+using namespace avr_emulator;
+
+// The component with its protected state opened up for the tests
+class TestComponent : public AVROTAComponent {
+ public:
+  const AVRISP_session_t &get_session() const { return this->session; }
+  AVRISPState_t get_state() const { return this->_state; }
+  bool in_pmode() const { return this->pmode; }
+  uint32_t get_isp_rate() const { return this->isp_rate_; }
+};
+
+// A component wired to an emulated target on the ISP bus and to a scripted
+// network. Configure ota, then call start()
+class Rig {
+ public:
+  explicit Rig(const AvrPart &part) : target(part) {
+    esphome::host::use_virtual_clock(true);
+    esphome::spi::set_host_bus(&this->bus);
+    this->bus.add(&this->target);
+    this->ota.set_avr_enable(&this->target);
+    this->ota.set_ws_port(328);
+    this->ota.set_restore_mode(AVR_ALWAYS_ON);
+  }
+  ~Rig() {
+    this->ota.disable_avr();
+    this->ota.loop();
+    esphome::spi::set_host_bus(nullptr);
+  }
+
+  void start() { this->ota.setup(); }
+
+  // A new client with the given one way latency in microseconds
+  std::shared_ptr<ScriptedClient> client(uint32_t latency_us = 1000) {
+    auto c = std::make_shared<ScriptedClient>();
+    c->latency_us = latency_us;
+    return c;
+  }
+
+  // Connect client and run the main loop, 1 ms of other components per
+  // pass, until the client is done and the programmer idle again. False if
+  // that takes longer than limit_ms of host time
+  bool run(std::shared_ptr<ScriptedClient> c, uint32_t limit_ms = 120000) {
+    this->network.connect(c);
+    return this->run_until([&] { return c->done() && this->ota.get_state() == AVRISP_STATE_IDLE; }, limit_ms);
+  }
+
+  template<typename F> bool run_until(F done, uint32_t limit_ms) {
+    uint64_t limit = esphome::host::now_ns() + (uint64_t) limit_ms * 1000000;
+    // One more pass once done, so the programmer sees the client leave
+    bool finished = false;
+    while (esphome::host::now_ns() < limit) {
+      this->ota.loop();
+      if (finished)
+        return true;
+      finished = done();
+      esphome::delay(1);
+    }
+    return false;
+  }
+
+  IspBus bus;
+  AvrTarget target;
+  ScriptedNetwork network;
+  TestComponent ota;
+};
+
+}  // namespace avr_test
@@ -0,0 +1,71 @@
+#include "check.h"
+#include "rig.h"
+
+#include "avr_commands.h"
+#include "native_commands.h"
+
+using namespace avr_test;
+
+// A second target on the same bus, enabled as a broadcast target
+struct BroadcastRig : Rig {
+  BroadcastRig() : Rig(ATMEGA328P), other(ATMEGA328P) {
+    this->bus.add(&this->other);
+    this->ota.add_broadcast_enable(&this->other);
+  }
+  // Shut down while the second target is still there
+  ~BroadcastRig() {
+    this->ota.disable_avr();
+    this->ota.loop();
+  }
+
+  AvrTarget other;
+};
+
+TEST(broadcast_programs_and_verifies_both) {
+  BroadcastRig rig;
+  rig.start();
+
+  auto flash = test_image(4096, 41);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, false);
+  REQUIRE(rig.run(c));
+
+  // One stream reaches both targets, and the read back at the end checks
+  // each of them on its own
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK(std::equal(flash.begin(), flash.end(), rig.other.flash.begin()));
+  CHECK_EQ(rig.target.stats.chip_erases, 1u);
+  CHECK_EQ(rig.other.stats.chip_erases, 1u);
+  CHECK_EQ(rig.target.stats.page_writes, 32u);
+  CHECK_EQ(rig.other.stats.page_writes, 32u);
+  CHECK_EQ(rig.bus.overlaps, 0u);
+  const auto &session = rig.ota.get_session();
+  CHECK_EQ(session.pages, 32u);
+  CHECK_EQ(session.errors, 0u);
+  CHECK(!rig.target.in_reset());
+  CHECK(!rig.other.in_reset());
+}
+
+TEST(broadcast_mismatch_fails_session) {
+  BroadcastRig rig;
+  rig.start();
+
+  // Without an erase the second target can't set the bits that are already
+  // clear, so it ends up with different contents than the first
+  auto flash = test_image(1024, 42);
+  std::fill(rig.other.flash.begin(), rig.other.flash.begin() + 1024, 0x00);
+  auto c = rig.client();
+  auto stream = native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_VERIFY, 0, 128, flash);
+  stream.insert(stream.end(), flash.begin(), flash.end());
+  c->send(stream, NATIVE_REPLY_SIZE);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_VERIFY);
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK(!std::equal(flash.begin(), flash.end(), rig.other.flash.begin()));
+  CHECK_EQ(rig.other.stats.page_writes, 8u);
+  CHECK(rig.ota.get_session().errors > 0);
+  CHECK(!rig.target.in_reset());
+  CHECK(!rig.other.in_reset());
+}
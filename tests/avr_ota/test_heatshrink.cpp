@@ -0,0 +1,112 @@
+#include "check.h"
+
+#include "Heatshrink.h"
+#include "emulator/Scripts.h"
+
+using esphome::avr_ota::Heatshrink;
+using namespace avr_emulator;
+
+// Everything the decoder produces for stream, read back after each push
+static std::vector<uint8_t> decode(Heatshrink &decoder, const std::vector<uint8_t> &stream) {
+  std::vector<uint8_t> out;
+  for (uint8_t byte : stream) {
+    int produced = decoder.push(byte);
+    for (int i = 0; i < produced; i++) out.push_back(decoder.output(i, produced));
+  }
+  return out;
+}
+
+TEST(heatshrink_rejects_unsupported_parameters) {
+  Heatshrink decoder;
+  CHECK(decoder.begin(8, 4));
+  CHECK(decoder.begin(4, 3));
+  CHECK(decoder.begin(10, 9));
+  CHECK(!decoder.begin(3, 2));
+  CHECK(!decoder.begin(11, 4));
+  CHECK(!decoder.begin(8, 2));
+  CHECK(!decoder.begin(8, 8));
+}
+
+TEST(heatshrink_decodes_literal_runs) {
+  std::vector<uint8_t> data;
+  for (int i = 0; i < 300; i++) data.push_back(i * 7 + 3);
+
+  HeatshrinkWriter writer(8, 4);
+  for (uint8_t byte : data) writer.literal(byte);
+  auto stream = writer.finish();
+  // Nine bits each
+  CHECK_EQ(stream.size(), (300 * 9 + 7) / 8);
+
+  Heatshrink decoder;
+  REQUIRE(decoder.begin(8, 4));
+  auto out = decode(decoder, stream);
+  CHECK(out == data);
+  CHECK_EQ(decoder.get_decoded(), 300u);
+}
+
+// References that reach across the point where the window wraps, the
+// longest distance the window allows, and one that overlaps its own output
+TEST(heatshrink_decodes_references_across_window_wrap) {
+  HeatshrinkWriter writer(4, 3);
+  std::vector<uint8_t> expected;
+  auto literal = [&](uint8_t byte) {
+    writer.literal(byte);
+    expected.push_back(byte);
+  };
+  auto reference = [&](uint32_t distance, uint32_t count) {
+    writer.reference(distance, count);
+    for (uint32_t i = 0; i < count; i++) expected.push_back(expected[expected.size() - distance]);
+  };
+
+  for (int i = 0; i < 14; i++) literal(0x10 + i);
+  // Writes window positions 14 to 3, reading its own first bytes again
+  reference(3, 8);
+  // The whole window back, from before the wrap to after it
+  reference(16, 8);
+  literal(0xEE);
+  reference(16, 8);
+  reference(1, 8);
+  reference(13, 5);
+
+  Heatshrink decoder;
+  REQUIRE(decoder.begin(4, 3));
+  auto out = decode(decoder, writer.finish());
+  CHECK(out == expected);
+  CHECK_EQ(decoder.get_decoded(), (uint32_t) expected.size());
+}
+
+TEST(heatshrink_reference_before_start_reads_zeros) {
+  HeatshrinkWriter writer(8, 4);
+  writer.literal(0x55);
+  writer.reference(4, 6);
+
+  Heatshrink decoder;
+  REQUIRE(decoder.begin(8, 4));
+  auto out = decode(decoder, writer.finish());
+  CHECK(out == std::vector<uint8_t>({0x55, 0, 0, 0, 0x55, 0, 0}));
+}
+
+// A stream cut short decodes to a prefix of the data, and picks up where
+// it stopped when the rest arrives
+TEST(heatshrink_truncated_stream) {
+  // Code repeats itself often enough for references to cut through it
+  auto data = test_image(2048, 51);
+  for (size_t i = 0; i < data.size(); i++)
+    if (i % 64 >= 32)
+      data[i] = data[i - 24];
+  auto stream = heatshrink_encode(data, 8, 4);
+  REQUIRE(stream.size() < data.size());
+
+  for (size_t cut : {(size_t) 1, (size_t) 2, stream.size() / 3, stream.size() - 1}) {
+    Heatshrink decoder;
+    REQUIRE(decoder.begin(8, 4));
+    auto head = decode(decoder, std::vector<uint8_t>(stream.begin(), stream.begin() + cut));
+    CHECK(head.size() < data.size());
+    CHECK(std::equal(head.begin(), head.end(), data.begin()));
+    CHECK_EQ(decoder.get_decoded(), (uint32_t) head.size());
+
+    auto tail = decode(decoder, std::vector<uint8_t>(stream.begin() + cut, stream.end()));
+    head.insert(head.end(), tail.begin(), tail.end());
+    CHECK(head == data);
+  }
+}
@@ -0,0 +1,212 @@
+#include "check.h"
+#include "rig.h"
+
+#include "avr_commands.h"
+#include "native_commands.h"
+
+using namespace avr_test;
+
+// A native upload client: the header and payload in one stream, then the
+// status reply
+static std::shared_ptr<ScriptedClient> uploader(Rig &rig, std::vector<uint8_t> header,
+                                                const std::vector<uint8_t> &payload) {
+  auto c = rig.client();
+  header.insert(header.end(), payload.begin(), payload.end());
+  c->send(header, NATIVE_REPLY_SIZE);
+  return c;
+}
+
+static uint16_t reply_pages(const std::vector<uint8_t> &reply) { return reply[2] << 8 | reply[3]; }
+
+TEST(native_programs_raw_image) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(8192, 11);
+  auto c = uploader(rig,
+                    native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE | NATIVE_FLAG_VERIFY,
+                                  ATMEGA328P.signature, 128, flash),
+                    flash);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  const auto &reply = c->replies[0];
+  CHECK_EQ(reply[0], NATIVE_MAGIC);
+  CHECK_EQ(reply[1], NATIVE_STATUS_OK);
+  CHECK_EQ(reply_pages(reply), 64u);
+  CHECK(c->closed_by_esp);
+  CHECK_EQ(rig.target.stats.chip_erases, 1u);
+  CHECK_EQ(rig.target.stats.busy_violations, 0u);
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK(!rig.ota.in_pmode());
+  CHECK(!rig.target.in_reset());
+}
+
+TEST(native_programs_ihex_image) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  // Not a whole number of pages, the last one is padded with 0xFF
+  auto flash = test_image(6000, 12);
+  std::string hex = ihex_image(flash);
+  std::vector<uint8_t> payload(hex.begin(), hex.end());
+  auto c = uploader(rig, native_header('F', NATIVE_FORMAT_IHEX, NATIVE_FLAG_ERASE, 0, 128, payload), payload);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_OK);
+  CHECK_EQ(reply_pages(c->replies[0]), 47u);
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK_EQ(rig.target.flash[6000], 0xFF);
+}
+
+// The payload on the wire is compressed, size and crc are of what is sent
+TEST(native_programs_heatshrink_image) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(8192, 16);
+  auto payload = heatshrink_encode(flash, 8, 4);
+  auto header = native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE | NATIVE_FLAG_VERIFY, 0, 128, payload);
+  header[11] = NATIVE_COMPRESS_HEATSHRINK;
+  header[14] = 8;
+  header[15] = 4;
+  auto c = uploader(rig, header, payload);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_OK);
+  CHECK_EQ(reply_pages(c->replies[0]), 64u);
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  const auto &session = rig.ota.get_session();
+  CHECK_EQ(session.compressed_bytes, (uint32_t) payload.size());
+  CHECK_EQ(session.decompressed_bytes, 8192u);
+}
+
+TEST(native_programs_eeprom) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto eeprom = test_image(256, 13);
+  auto c = uploader(rig, native_header('E', NATIVE_FORMAT_RAW, 0, 0, ATMEGA328P.eeprom_page_size, eeprom), eeprom);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_OK);
+  CHECK_EQ(rig.target.stats.chip_erases, 0u);
+  CHECK(std::equal(eeprom.begin(), eeprom.end(), rig.target.eeprom.begin()));
+}
+
+TEST(native_reports_crc_mismatch) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(1024, 14);
+  auto header = native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE, 0, 128, flash);
+  header[23] ^= 0x01;
+  auto c = uploader(rig, header, flash);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_CRC);
+  CHECK(c->closed_by_esp);
+  CHECK(!rig.ota.in_pmode());
+  CHECK(!rig.target.in_reset());
+}
+
+TEST(native_rejects_bad_header) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(1024, 15);
+  // Pages have to be a power of two
+  auto c = uploader(rig, native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE, 0, 96, flash), flash);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_BAD_HEADER);
+  // The target was never touched
+  CHECK_EQ(rig.target.stats.enables, 0u);
+  CHECK_EQ(rig.target.stats.instructions, 0u);
+  CHECK(!rig.target.in_reset());
+}
+
+// Flash pages addr_page() can't split would be committed word by word
+TEST(native_rejects_unknown_flash_page_size) {
+  for (int pagesize : {2, 16, 512}) {
+    Rig rig(ATMEGA328P);
+    rig.start();
+
+    auto flash = test_image(1024, 18);
+    auto c = uploader(rig, native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE, 0, pagesize, flash), flash);
+    REQUIRE(rig.run(c));
+
+    REQUIRE(c->answered() == 1);
+    CHECK_EQ(c->replies[0][1], NATIVE_STATUS_BAD_HEADER);
+    CHECK_EQ(rig.target.stats.enables, 0u);
+    CHECK_EQ(rig.target.stats.page_writes, 0u);
+  }
+}
+
+TEST(native_rejects_wrong_signature) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(1024, 16);
+  auto c = uploader(rig, native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE, ATMEGA2560.signature, 128, flash),
+                    flash);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_SIGNATURE);
+  CHECK_EQ(rig.target.stats.chip_erases, 0u);
+  CHECK_EQ(rig.target.stats.page_writes, 0u);
+}
+
+TEST(native_truncated_stream_drops_session) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  // The client goes away half way through the payload
+  auto flash = test_image(4096, 17);
+  auto header = native_header('F', NATIVE_FORMAT_RAW, NATIVE_FLAG_ERASE, 0, 128, flash);
+  auto c = rig.client();
+  header.insert(header.end(), flash.begin(), flash.begin() + flash.size() / 2);
+  c->send(header, 0);
+  rig.network.connect(c);
+  REQUIRE(rig.run_until([&] { return c->closed_by_esp && rig.ota.get_state() == AVRISP_STATE_IDLE; }, 10000));
+
+  // Nobody is left to answer
+  CHECK(c->received.empty());
+  CHECK(rig.ota.get_session().errors > 0);
+  CHECK_EQ(rig.ota.get_state(), AVRISP_STATE_IDLE);
+  CHECK(!rig.ota.in_pmode());
+  CHECK(!rig.target.in_reset());
+  CHECK_EQ(rig.target.stats.interrupted_writes, 0u);
+  // Pages are written once the stream moves past them, so the last one
+  // that arrived stays erased
+  CHECK(std::equal(flash.begin(), flash.begin() + 15 * 128, rig.target.flash.begin()));
+  CHECK_EQ(rig.target.flash[15 * 128], 0xFF);
+}
+
+TEST(native_busy_reply_to_second_client) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  // The first client keeps the programmer busy for a while
+  auto first = rig.client();
+  for (int i = 0; i < 20; i++)
+    first->send({Cmnd_STK_GET_SYNC, Sync_CRC_EOP}, 2);
+  rig.network.connect(first);
+  REQUIRE(rig.run_until([&] { return first->answered() >= 1; }, 1000));
+
+  auto second = rig.client();
+  second->close_at_end = false;
+  rig.network.connect(second);
+  REQUIRE(rig.run_until([&] { return first->done() && second->done(); }, 1000));
+
+  CHECK_EQ(first->answered(), 20u);
+  CHECK(second->closed_by_esp);
+  std::vector<uint8_t> busy = {NATIVE_MAGIC, NATIVE_STATUS_BUSY, 0, 0, 0, 0, 0, 0};
+  CHECK(second->received == busy);
+}
@@ -0,0 +1,104 @@
+#include "check.h"
+#include "rig.h"
+
+#include "emulator/OptibootTarget.h"
+
+#include "native_commands.h"
+
+using namespace avr_test;
+
+static const uint32_t APP_BAUD = 38400;
+static const uint32_t BOOT_BAUD = 115200;
+
+// The rig with the target behind Optiboot on a UART instead of the ISP bus
+struct BootRig : Rig {
+  BootRig() : Rig(ATMEGA328P), boot(ATMEGA328P, BOOT_BAUD) {
+    this->boot.set_baud_rate(APP_BAUD);
+    this->ota.set_avr_enable(&this->boot);
+    this->ota.set_bootloader_uart(&this->boot);
+    this->ota.set_bootloader_baud_rate(BOOT_BAUD);
+  }
+  // Shut down while the bootloader is still there
+  ~BootRig() {
+    this->ota.disable_avr();
+    this->ota.loop();
+  }
+
+  OptibootTarget boot;
+};
+
+TEST(optiboot_programs_flash) {
+  BootRig rig;
+  rig.start();
+
+  auto flash = test_image(4096, 31);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, true);
+  REQUIRE(rig.run(c));
+
+  CHECK(std::equal(flash.begin(), flash.end(), rig.boot.flash.begin()));
+  // The read back returns what was written, page by page
+  size_t pages_read = 0;
+  for (const auto &reply : c->replies) {
+    if (reply.size() != 130)
+      continue;
+    CHECK(std::equal(reply.begin() + 1, reply.end() - 1, flash.begin() + 128 * pages_read));
+    pages_read++;
+  }
+  CHECK_EQ(pages_read, 32u);
+  CHECK_EQ(rig.boot.stats.page_writes, 32u);
+  CHECK_EQ(rig.boot.stats.leaves, 1u);
+  CHECK_EQ(rig.boot.stats.garbled_bytes, 0u);
+  CHECK_EQ(rig.boot.stats.sync_errors, 0u);
+  CHECK_EQ(rig.boot.get_baud_rate(), APP_BAUD);
+}
+
+// Native eeprom pages go to the bootloader as PROG_PAGE 'E', not as ISP
+// page instructions it would ignore
+TEST(optiboot_native_eeprom) {
+  BootRig rig;
+  rig.start();
+
+  auto eeprom = test_image(256, 34);
+  auto c = rig.client();
+  auto stream = native_header('E', NATIVE_FORMAT_RAW, NATIVE_FLAG_VERIFY, 0, ATMEGA328P.eeprom_page_size, eeprom);
+  stream.insert(stream.end(), eeprom.begin(), eeprom.end());
+  c->send(stream, NATIVE_REPLY_SIZE);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == 1);
+  CHECK_EQ(c->replies[0][1], NATIVE_STATUS_OK);
+  CHECK(std::equal(eeprom.begin(), eeprom.end(), rig.boot.eeprom.begin()));
+  CHECK_EQ(rig.boot.stats.page_writes, 256u / ATMEGA328P.eeprom_page_size);
+  CHECK_EQ(rig.boot.stats.leaves, 1u);
+  CHECK_EQ(rig.boot.get_baud_rate(), APP_BAUD);
+}
+
+// A client that goes away mid session must leave the UART at the
+// application rate, and the next session must not take the bootloader
+// rate for it
+TEST(optiboot_dropped_session_restores_baud) {
+  BootRig rig;
+  rig.start();
+
+  auto old_flash = test_image(4096, 32);
+  auto c = rig.client();
+  stk500v1_prologue(*c, ATMEGA328P);
+  uint8_t ext = 0;
+  for (int i = 0; i < 4; i++)
+    stk500v1_page(*c, 'F', i * 128, old_flash.data() + i * 128, 128, &ext);
+  REQUIRE(rig.run(c));
+
+  CHECK(!rig.ota.in_pmode());
+  CHECK_EQ(rig.boot.get_baud_rate(), APP_BAUD);
+  CHECK_EQ(rig.boot.stats.page_writes, 4u);
+
+  auto flash = test_image(4096, 33);
+  c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, false);
+  REQUIRE(rig.run(c));
+
+  CHECK(std::equal(flash.begin(), flash.end(), rig.boot.flash.begin()));
+  CHECK_EQ(rig.boot.stats.garbled_bytes, 0u);
+  CHECK_EQ(rig.boot.get_baud_rate(), APP_BAUD);
+}
@@ -0,0 +1,55 @@
+#include "check.h"
+#include "rig.h"
+
+using namespace avr_test;
+
+// A session that stops after a few flash pages, the last one still
+// programming when the client goes away
+static std::shared_ptr<ScriptedClient> dropped_client(Rig &rig, const std::vector<uint8_t> &flash, int pages) {
+  auto c = rig.client(100);
+  stk500v1_prologue(*c, ATMEGA328P);
+  uint8_t ext = 0;
+  for (int i = 0; i < pages; i++)
+    stk500v1_page(*c, 'F', i * 128, flash.data() + i * 128, 128, &ext);
+  return c;
+}
+
+TEST(disconnect_finishes_pipelined_page) {
+  Rig rig(ATMEGA328P);
+  rig.ota.set_pipelined_writes(true);
+  rig.start();
+
+  auto flash = test_image(1024, 5);
+  auto c = dropped_client(rig, flash, 4);
+  REQUIRE(rig.run(c));
+
+  CHECK(!rig.ota.in_pmode());
+  CHECK(!rig.target.in_reset());
+  CHECK_EQ(rig.target.stats.interrupted_writes, 0u);
+  CHECK(std::equal(flash.begin(), flash.begin() + 4 * 128, rig.target.flash.begin()));
+  CHECK_EQ(rig.ota.get_session().pages, 4u);
+}
+
+TEST(forced_shutdown_finishes_pipelined_page) {
+  Rig rig(ATMEGA328P);
+  rig.ota.set_pipelined_writes(true);
+  rig.start();
+
+  auto flash = test_image(1024, 6);
+  auto c = dropped_client(rig, flash, 8);
+  c->close_at_end = false;
+  rig.network.connect(c);
+  // Stop the programmer right after the reply to the fourth page
+  size_t steps = c->steps.size() - 4;
+  while (c->answered() < steps) {
+    rig.ota.loop();
+    esphome::delay(1);
+  }
+  rig.ota.disable_avr();
+  REQUIRE(rig.run_until([&] { return rig.ota.get_state() == AVRISP_STATE_IDLE; }, 1000));
+
+  CHECK(!rig.ota.in_pmode());
+  CHECK(!rig.target.in_reset());
+  CHECK_EQ(rig.target.stats.interrupted_writes, 0u);
+  CHECK(std::equal(flash.begin(), flash.begin() + 4 * 128, rig.target.flash.begin()));
+}
@@ -0,0 +1,187 @@
+#include "check.h"
+#include "rig.h"
+
+#include "avr_commands.h"
+
+using namespace avr_test;
+
+// Every reply of an stk500v1 session starts with INSYNC and ends with OK
+static bool replies_ok(const ScriptedClient &c) {
+  for (size_t i = 0; i < c.replies.size(); i++) {
+    const auto &reply = c.replies[i];
+    if (reply.size() != c.steps[i].reply || reply.front() != Resp_STK_INSYNC || reply.back() != Resp_STK_OK) {
+      fprintf(stderr, "  reply %zu to command 0x%02x is wrong\n", i, c.steps[i].send[0]);
+      return false;
+    }
+  }
+  return c.answered() == c.steps.size();
+}
+
+TEST(stk500v1_programs_328p) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto flash = test_image(16 * 1024, 1);
+  auto eeprom = test_image(512, 2);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, eeprom, true);
+  REQUIRE(rig.run(c));
+
+  CHECK(replies_ok(*c));
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK(std::equal(eeprom.begin(), eeprom.end(), rig.target.eeprom.begin()));
+  CHECK(!rig.target.in_reset());
+
+  // The signature came back from the part
+  CHECK_EQ(c->replies[7][1], 0x1E);
+  CHECK_EQ(c->replies[7][2], 0x95);
+  CHECK_EQ(c->replies[7][3], 0x0F);
+
+  const AvrStats &stats = rig.target.stats;
+  CHECK_EQ(stats.chip_erases, 1u);
+  CHECK_EQ(stats.busy_violations, 0u);
+  CHECK_EQ(stats.interrupted_writes, 0u);
+  CHECK_EQ(stats.ext_loads, 0u);
+  CHECK_EQ(rig.bus.unselected_bytes, 0u);
+  // Blank pages after the chip erase are not written
+  CHECK(stats.page_writes <= flash.size() / ATMEGA328P.flash_page_size);
+  CHECK_EQ(stats.page_writes, rig.ota.get_session().pages);
+  CHECK_EQ(rig.ota.get_session().flash_bytes, flash.size());
+  CHECK_EQ(rig.ota.get_session().eeprom_bytes, eeprom.size());
+}
+
+// Times the 64K word segment changes between consecutive flash pages of a
+// session, over the write pass and then the verify pass. Programming mode
+// starts in segment 0
+static size_t segment_crossings(const AvrPart &part, size_t size, bool verify) {
+  size_t crossings = 0;
+  uint32_t segment = 0;
+  for (int pass = 0; pass < (verify ? 2 : 1); pass++) {
+    for (size_t addr = 0; addr < size; addr += part.flash_page_size) {
+      if ((addr / 2) >> 16 != segment) {
+        segment = (addr / 2) >> 16;
+        crossings++;
+      }
+    }
+  }
+  return crossings;
+}
+
+TEST(stk500v1_programs_2560_full) {
+  Rig rig(ATMEGA2560);
+  rig.start();
+
+  auto flash = test_image(ATMEGA2560.flash_size, 5);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA2560, flash, {}, true);
+  uint64_t started = esphome::host::now_ns();
+  REQUIRE(rig.run(c));
+  double seconds = (esphome::host::now_ns() - started) / 1e9;
+
+  CHECK(replies_ok(*c));
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  // 0x4D only goes out when the page is in another 64K word segment
+  CHECK_EQ(rig.target.stats.ext_loads, segment_crossings(ATMEGA2560, flash.size(), true));
+  CHECK_EQ(rig.target.stats.busy_violations, 0u);
+  CHECK_EQ(rig.target.stats.interrupted_writes, 0u);
+  CHECK_EQ(rig.ota.get_session().flash_bytes, flash.size());
+  fprintf(stderr, "  %s, %zu KB written and verified at %.1f KB/s\n", ATMEGA2560.name, flash.size() / 1024,
+          flash.size() / 1024.0 / seconds);
+}
+
+TEST(stk500v1_pipelined_writes) {
+  Rig rig(ATMEGA328P);
+  rig.ota.set_pipelined_writes(true);
+  rig.start();
+
+  auto flash = test_image(8 * 1024, 3);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, true);
+  REQUIRE(rig.run(c));
+
+  CHECK(replies_ok(*c));
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  CHECK_EQ(rig.target.stats.busy_violations, 0u);
+  CHECK_EQ(rig.target.stats.interrupted_writes, 0u);
+}
+
+TEST(stk500v1_negotiates_isp_clock) {
+  Rig rig(ATMEGA328P);
+  rig.ota.set_isp_clock(0);
+  rig.start();
+
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, test_image(1024, 4), {}, true);
+  REQUIRE(rig.run(c));
+
+  CHECK(replies_ok(*c));
+  // A quarter of the 16 MHz part clock is the fastest it can sync at
+  CHECK_EQ(rig.ota.get_isp_rate(), 4000000u);
+}
+
+// Reprogramming with one page changed and without a chip erase commits
+// only that page
+TEST(stk500v1_differential_writes) {
+  Rig rig(ATMEGA328P);
+  rig.ota.set_differential_writes(true);
+  rig.start();
+
+  auto flash = test_image(4096, 6);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, false);
+  REQUIRE(rig.run(c));
+  REQUIRE(replies_ok(*c));
+  uint32_t first_writes = rig.target.stats.page_writes;
+
+  // Page 9 changes and the client doesn't erase. Without an erase ISP
+  // programming can only clear bits, so that's all the change does
+  size_t page = ATMEGA328P.flash_page_size;
+  for (size_t i = 9 * page; i < 10 * page; i++) flash[i] &= 0xA5;
+  c = rig.client();
+  stk500v1_prologue(*c, ATMEGA328P, false);
+  uint8_t ext = 0;
+  for (size_t addr = 0; addr < flash.size(); addr += page)
+    stk500v1_page(*c, 'F', addr, flash.data() + addr, page, &ext);
+  c->send({Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP}, 2);
+  REQUIRE(rig.run(c));
+
+  CHECK(replies_ok(*c));
+  CHECK_EQ(rig.target.stats.page_writes - first_writes, 1u);
+  CHECK_EQ(rig.ota.get_session().pages, 1u);
+  CHECK_EQ(rig.ota.get_session().pages_skipped, flash.size() / page - 1);
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+}
+
+// After the chip erase, pages of only 0xFF aren't committed and 0xFF words
+// aren't loaded. The read back still returns the whole image
+TEST(stk500v1_skips_blank_after_erase) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  size_t page = ATMEGA328P.flash_page_size;
+  auto flash = test_image(8192, 7);
+  for (size_t blank : {5, 6, 20, 63}) std::fill(flash.begin() + blank * page, flash.begin() + (blank + 1) * page, 0xFF);
+  auto c = rig.client();
+  stk500v1_program(*c, ATMEGA328P, flash, {}, true);
+  REQUIRE(rig.run(c));
+
+  // Every 0xFF word, those of the blank pages too
+  uint32_t blank_words = 0;
+  for (size_t i = 0; i < flash.size(); i += 2) blank_words += flash[i] == 0xFF && flash[i + 1] == 0xFF;
+
+  CHECK(replies_ok(*c));
+  const AVRISP_session_t &session = rig.ota.get_session();
+  CHECK_EQ(session.pages_blank, 4u);
+  CHECK_EQ(session.words_blank, blank_words);
+  CHECK_EQ(rig.target.stats.page_writes, flash.size() / page - 4);
+  // A byte at a time, only the words that aren't 0xFF
+  CHECK_EQ(rig.target.stats.page_loads, 2 * (flash.size() / 2 - blank_words));
+  CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+  // The read back, page by page
+  std::vector<uint8_t> read;
+  for (const auto &reply : c->replies) {
+    if (reply.size() == page + 2)
+      read.insert(read.end(), reply.begin() + 1, reply.end() - 1);
+  }
+  CHECK(read == flash);
+}
@@ -0,0 +1,136 @@
+#include "check.h"
+#include "rig.h"
+
+#include "stk500v2_commands.h"
+
+using namespace avr_test;
+
+// Sign on, enter programming mode and erase the chip, the way avrdude starts
+static void stk500v2_prologue(ScriptedClient &c, uint8_t &seq) {
+  stk500v2_command(c, seq++, {CMD_SIGN_ON}, 11);
+  stk500v2_command(c, seq++, {CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0x00, 0x00}, 2);
+  stk500v2_command(c, seq++, {CMD_CHIP_ERASE_ISP, 55, 1, 0xAC, 0x80, 0x00, 0x00}, 2);
+}
+
+// LOAD_ADDRESS of a word address, with bit 31 asking for the extended byte
+static void stk500v2_load_address(ScriptedClient &c, uint8_t &seq, uint32_t word) {
+  stk500v2_command(c, seq++,
+                   {CMD_LOAD_ADDRESS, (uint8_t) (0x80 | word >> 24), (uint8_t) (word >> 16), (uint8_t) (word >> 8),
+                    (uint8_t) word},
+                   2);
+}
+
+// Every page of flash written in page mode, then read back a page at a time
+static void stk500v2_program(ScriptedClient &c, uint8_t &seq, const AvrPart &part, const std::vector<uint8_t> &flash) {
+  size_t page = part.flash_page_size;
+  for (size_t addr = 0; addr < flash.size(); addr += page) {
+    stk500v2_load_address(c, seq, addr / 2);
+    std::vector<uint8_t> body = {CMD_PROGRAM_FLASH_ISP, (uint8_t) (page >> 8), (uint8_t) page,
+                                 STK500V2_MODE_PAGE | STK500V2_MODE_WRITE_PAGE | 0x40, 10, 0x40, 0x4C, 0x20, 0xFF,
+                                 0x00};
+    body.insert(body.end(), flash.begin() + addr, flash.begin() + addr + page);
+    stk500v2_command(c, seq++, body, 2);
+  }
+  for (size_t addr = 0; addr < flash.size(); addr += page) {
+    stk500v2_load_address(c, seq, addr / 2);
+    stk500v2_command(c, seq++, {CMD_READ_FLASH_ISP, (uint8_t) (page >> 8), (uint8_t) page, 0x20}, 3 + page);
+  }
+}
+
+// The pages returned by the READ_FLASH_ISP replies, in order
+static std::vector<uint8_t> read_back(const ScriptedClient &c) {
+  std::vector<uint8_t> data;
+  for (size_t i = 0; i < c.replies.size(); i++) {
+    if (c.steps[i].send[STK500V2_HEADER_SIZE] != CMD_READ_FLASH_ISP)
+      continue;
+    const auto &reply = c.replies[i];
+    data.insert(data.end(), reply.begin() + STK500V2_HEADER_SIZE + 2, reply.end() - 2);
+  }
+  return data;
+}
+
+// Fuse, signature and SPI_MULTI reads clock the ISP bus themselves. Every
+// instruction they send must show up in the session statistics
+TEST(stk500v2_counts_direct_instructions) {
+  Rig rig(ATMEGA328P);
+  rig.start();
+
+  auto c = rig.client();
+  uint8_t seq = 0;
+  stk500v2_command(*c, seq++, {CMD_SIGN_ON}, 11);
+  stk500v2_command(*c, seq++, {CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0x00, 0x00}, 2);
+  for (uint8_t i = 0; i < 3; i++)
+    stk500v2_command(*c, seq++, {CMD_READ_SIGNATURE_ISP, 4, 0x30, 0x00, i, 0x00}, 4);
+  stk500v2_command(*c, seq++, {CMD_READ_FUSE_ISP, 4, 0x50, 0x00, 0x00, 0x00}, 4);
+  stk500v2_command(*c, seq++, {CMD_READ_LOCK_ISP, 4, 0x58, 0x00, 0x00, 0x00}, 4);
+  stk500v2_command(*c, seq++, {CMD_READ_OSCCAL_ISP, 4, 0x38, 0x00, 0x00, 0x00}, 4);
+  stk500v2_command(*c, seq++, {CMD_SPI_MULTI, 4, 4, 0, 0x30, 0x00, 0x00, 0x00}, 7);
+  stk500v2_command(*c, seq++, {CMD_SPI_MULTI, 8, 1, 7, 0x30, 0x00, 0x01, 0x00, 0x30, 0x00, 0x02, 0x00}, 4);
+  stk500v2_command(*c, seq++, {CMD_LEAVE_PROGMODE_ISP, 1, 1}, 2);
+
+  // The target only counts instructions once programming is enabled, so
+  // the enable itself is in neither count
+  rig.network.connect(c);
+  REQUIRE(rig.run_until([&] { return c->done() && rig.ota.get_state() == AVRISP_STATE_IDLE; }, 10000));
+  REQUIRE(c->answered() == c->steps.size());
+  CHECK_EQ(c->replies[1][6], STATUS_CMD_OK);
+
+  // The signature bytes, one per READ_SIGNATURE_ISP
+  uint32_t signature = c->replies[2][7] << 16 | c->replies[3][7] << 8 | c->replies[4][7];
+  CHECK_EQ(signature, ATMEGA328P.signature);
+  // The second SPI_MULTI returns the last byte of two instructions
+  CHECK_EQ(c->replies[9][7], (uint8_t) ATMEGA328P.signature);
+
+  uint32_t session_sent = rig.ota.get_session().spi_transactions;
+  uint32_t target_seen = rig.target.stats.instructions;
+  CHECK_EQ(target_seen, 3u + 3u + 1u + 2u);
+  CHECK_EQ(session_sent, target_seen);
+}
+
+// Page mode programming and the read back through the ESP, on a small part
+// and on all 256 KB of an ATmega2560
+TEST(stk500v2_programs_and_reads_back) {
+  for (const AvrPart *part : {&ATMEGA328P, &ATMEGA2560}) {
+    Rig rig(*part);
+    rig.start();
+
+    auto flash = test_image(part->flash_size, 41);
+    auto c = rig.client();
+    uint8_t seq = 0;
+    stk500v2_prologue(*c, seq);
+    stk500v2_program(*c, seq, *part, flash);
+    stk500v2_command(*c, seq++, {CMD_LEAVE_PROGMODE_ISP, 1, 1}, 2);
+    REQUIRE(rig.run(c));
+
+    REQUIRE(c->answered() == c->steps.size());
+    CHECK(std::equal(flash.begin(), flash.end(), rig.target.flash.begin()));
+    CHECK(read_back(*c) == flash);
+    CHECK_EQ(rig.target.stats.busy_violations, 0u);
+    // One segment change each way for the write and the read back
+    CHECK_EQ(rig.target.stats.ext_loads, part->flash_size > 128 * 1024 ? 3u : 0u);
+  }
+}
+
+// A Load Extended Address sent with SPI_MULTI moves the target to another
+// segment. The next read above 128 KB has to select its own again
+TEST(stk500v2_spi_multi_extended_address) {
+  Rig rig(ATMEGA2560);
+  rig.start();
+
+  auto flash = test_image(ATMEGA2560.flash_size, 42);
+  auto c = rig.client();
+  uint8_t seq = 0;
+  stk500v2_prologue(*c, seq);
+  stk500v2_program(*c, seq, ATMEGA2560, flash);
+  stk500v2_command(*c, seq++, {CMD_SPI_MULTI, 4, 0, 0, 0x4D, 0x00, 0x00, 0x00}, 3);
+  uint32_t last = flash.size() - ATMEGA2560.flash_page_size;
+  stk500v2_load_address(*c, seq, last / 2);
+  stk500v2_command(*c, seq++, {CMD_READ_FLASH_ISP, 1, 0, 0x20}, 3 + 256);
+  stk500v2_command(*c, seq++, {CMD_LEAVE_PROGMODE_ISP, 1, 1}, 2);
+  REQUIRE(rig.run(c));
+
+  REQUIRE(c->answered() == c->steps.size());
+  auto pages = read_back(*c);
+  REQUIRE(pages.size() == flash.size() + 256);
+  CHECK(std::equal(pages.begin() + flash.size(), pages.end(), flash.begin() + last));
+}
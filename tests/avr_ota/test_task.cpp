@@ -0,0 +1,104 @@
+#include "check.h"
+#include "rig.h"
+
+#include "esphome/core/log.h"
+
+#include <chrono>
+#include <unistd.h>
+
+using namespace avr_test;
+
+// Built with dedicated_task and run on the real clock: every programmer
+// engine is a thread of its own. Those threads run until the process ends,
+// so the components are never destroyed and main() leaves with _exit()
+
+struct TaskProgrammer {
+  TaskProgrammer(IspBus &bus, uint16_t port) : target(ATMEGA328P) {
+    bus.add(&this->target);
+    this->ota = new TestComponent();
+    this->ota->set_avr_enable(&this->target);
+    this->ota->set_ws_port(port);
+    this->ota->set_restore_mode(AVR_ALWAYS_ON);
+    this->ota->set_dedicated_task(true);
+    this->ota->add_on_avr_callback([this](AVRISPState_t state) {
+      if (state == AVRISP_STATE_ACTIVE)
+        this->active = true;
+      else if (state == AVRISP_STATE_IDLE && this->active)
+        this->sessions++;
+    });
+  }
+
+  AvrTarget target;
+  TestComponent *ota;
+  bool active{false};
+  int sessions{0};
+};
+
+// Two programmers on one SPI bus, both programmed at once. Their sessions
+// have to take turns on the bus while the main loop keeps running
+TEST(task_programmers_share_bus) {
+  esphome::host::use_virtual_clock(false);
+  IspBus bus;
+  esphome::spi::set_host_bus(&bus);
+  ScriptedNetwork network;
+
+  auto *a = new TaskProgrammer(bus, 328);
+  auto *b = new TaskProgrammer(bus, 329);
+  a->ota->setup();
+  b->ota->setup();
+
+  auto flash_a = test_image(4096, 21);
+  auto flash_b = test_image(4096, 22);
+  auto ca = std::make_shared<ScriptedClient>();
+  auto cb = std::make_shared<ScriptedClient>();
+  ca->port = 328;
+  cb->port = 329;
+  stk500v1_program(*ca, ATMEGA328P, flash_a, {}, false);
+  stk500v1_program(*cb, ATMEGA328P, flash_b, {}, false);
+  network.connect(ca);
+  network.connect(cb);
+
+  // The main loop only picks up events, so it should never be held up
+  using clock = std::chrono::steady_clock;
+  auto limit = clock::now() + std::chrono::seconds(20);
+  clock::duration slowest{0};
+  int passes = 0;
+  while ((a->sessions == 0 || b->sessions == 0) && clock::now() < limit) {
+    auto started = clock::now();
+    a->ota->loop();
+    b->ota->loop();
+    slowest = std::max(slowest, clock::now() - started);
+    passes++;
+    esphome::delay(1);
+  }
+  REQUIRE(a->sessions == 1 && b->sessions == 1);
+
+  CHECK(ca->done());
+  CHECK(cb->done());
+  CHECK(std::equal(flash_a.begin(), flash_a.end(), a->target.flash.begin()));
+  CHECK(std::equal(flash_b.begin(), flash_b.end(), b->target.flash.begin()));
+  CHECK_EQ(bus.overlaps, 0u);
+  CHECK_EQ(bus.unselected_bytes, 0u);
+  CHECK_EQ(a->target.stats.interrupted_writes + b->target.stats.interrupted_writes, 0u);
+  CHECK_EQ(a->target.stats.busy_violations + b->target.stats.busy_violations, 0u);
+  CHECK(passes > 100);
+  auto slowest_ms = std::chrono::duration_cast<std::chrono::milliseconds>(slowest).count();
+  CHECK(slowest_ms < 10);
+
+  // The main loop only learns the socket stopped from the engine's event
+  CHECK(a->ota->is_enabled());
+  a->ota->disable_avr();
+  limit = clock::now() + std::chrono::seconds(2);
+  while (a->ota->is_enabled() && clock::now() < limit) {
+    a->ota->loop();
+    esphome::delay(1);
+  }
+  CHECK(!a->ota->is_enabled());
+  CHECK(b->ota->is_enabled());
+}
+
+int main(int argc, char **argv) {
+  int result = avr_test::run(argc, argv);
+  fflush(stderr);
+  _exit(result);
+}
@@ -0,0 +1,210 @@
+#include "check.h"
+
+#include "WebSocket.h"
+#include "emulator/ScriptedSocket.h"
+#include "host.h"
+
+#include "esphome/core/hal.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using namespace esphome::avr_ota;
+using namespace avr_emulator;
+
+// A web socket on a port the system picked, with its readiness visible
+class TestSocket : public WebSocket {
+ public:
+  uint16_t bound_port() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (this->server_->getsockname((struct sockaddr *) &addr, &len) != 0)
+      return 0;
+    return ntohs(addr.sin_port);
+  }
+  bool client_ready() const { return this->client_ready_; }
+  bool rtt_pending() const { return this->rtt_pending_; }
+};
+
+// A blocking POSIX client on loopback
+static int connect_to(uint16_t port) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The listeners share one select(). A result one of them triggered must
+// not leave the other ready for data it has read since, or avrisp() would
+// wait in getch() for the whole socket timeout
+TEST(web_socket_readiness_is_not_stale) {
+  esphome::host::use_virtual_clock(false);
+  TestSocket a, b;
+  a.set_port(0);
+  b.set_port(0);
+  REQUIRE(a.start() && b.start());
+  int ca = connect_to(a.bound_port());
+  int cb = connect_to(b.bound_port());
+  REQUIRE(ca >= 0 && cb >= 0);
+
+  // Accept both, a runs the select() and b takes its result
+  for (int i = 0; i < 100 && (a.status != WebSocketConnected || b.status != WebSocketConnected); i++) {
+    a.handle();
+    b.handle();
+    esphome::delay(1);
+  }
+  REQUIRE(a.status == WebSocketConnected && b.status == WebSocketConnected);
+
+  // Only a has data
+  uint8_t sent = 0x30;
+  REQUIRE(::write(ca, &sent, 1) == 1);
+  esphome::delay(20);
+
+  // b runs the select() this time. It sees a's data and nothing for itself
+  b.handle();
+  CHECK(!b.available());
+  CHECK(a.client_ready());
+
+  // a reads the byte before it looks at that result
+  uint8_t got = 0;
+  REQUIRE(a.read(&got));
+  CHECK_EQ(got, sent);
+  a.handle();
+  CHECK(a.status == WebSocketConnected);
+  CHECK(!a.available());
+  CHECK(!b.available());
+
+  // New data is still seen
+  REQUIRE(::write(cb, &sent, 1) == 1);
+  esphome::delay(20);
+  a.handle();
+  b.handle();
+  CHECK(!a.available());
+  CHECK(b.available());
+
+  ::close(ca);
+  ::close(cb);
+  a.stop();
+  b.stop();
+}
+
+// A scripted client that sends one byte per step and waits for a one byte
+// answer to each, and the web socket connected to it
+static std::shared_ptr<ScriptedClient> ping_client(ScriptedNetwork &network, TestSocket &socket,
+                                                   uint32_t latency_us, int steps) {
+  auto c = std::make_shared<ScriptedClient>();
+  c->latency_us = latency_us;
+  for (int i = 0; i < steps; i++) c->send({(uint8_t) i}, 1);
+  socket.set_port(328);
+  socket.start();
+  network.connect(c);
+  for (int i = 0; i < 1000 && !socket.handle(); i++) esphome::delay(1);
+  return c;
+}
+
+// Read a step and answer it
+static bool pong(TestSocket &socket) {
+  uint8_t b;
+  return socket.read(&b) && socket.write(b) && socket.flush();
+}
+
+TEST(web_socket_rtt_first_sample) {
+  esphome::host::use_virtual_clock(true);
+  ScriptedNetwork network;
+  TestSocket s;
+  auto c = ping_client(network, s, 50000, 2);
+  REQUIRE(s.status == WebSocketConnected);
+
+  // Nothing was flushed before the first byte, so it is not a sample
+  CHECK_EQ(s.get_srtt_us(), 0u);
+  CHECK_EQ(s.get_timeout(), WEB_SOCKET_TIMEOUT_INITIAL);
+  REQUIRE(pong(s));
+  CHECK(s.rtt_pending());
+  CHECK_EQ(s.get_srtt_us(), 0u);
+
+  // The answer takes both latencies, give or take a poll of the read loop
+  uint8_t b;
+  REQUIRE(s.read(&b));
+  CHECK(!s.rtt_pending());
+  uint32_t srtt = s.get_srtt_us();
+  CHECK(srtt >= 100000 && srtt <= 102000);
+  CHECK_EQ(s.get_rttvar_us(), srtt / 2);
+  CHECK_EQ(s.get_timeout(), (srtt + 4 * s.get_rttvar_us()) / 1000);
+  s.stop();
+}
+
+TEST(web_socket_timeout_clamped) {
+  esphome::host::use_virtual_clock(true);
+  {
+    // A 1 ms round trip would give a few ms
+    ScriptedNetwork network;
+    TestSocket s;
+    auto c = ping_client(network, s, 100, 2);
+    REQUIRE(pong(s) && pong(s));
+    REQUIRE(s.get_srtt_us() != 0);
+    CHECK((s.get_srtt_us() + 4 * s.get_rttvar_us()) / 1000 < WEB_SOCKET_TIMEOUT_MIN);
+    CHECK_EQ(s.get_timeout(), WEB_SOCKET_TIMEOUT_MIN);
+    s.stop();
+  }
+  {
+    // 500 ms round trips are kept as samples, but the timeout stops at 1 s
+    ScriptedNetwork network;
+    TestSocket s;
+    s.set_timeouts(200, 1000);
+    auto c = ping_client(network, s, 250000, 2);
+    REQUIRE(pong(s) && pong(s));
+    REQUIRE(s.get_srtt_us() != 0);
+    CHECK((s.get_srtt_us() + 4 * s.get_rttvar_us()) / 1000 > 1000);
+    CHECK_EQ(s.get_timeout(), 1000u);
+    s.stop();
+  }
+}
+
+// Flushing twice before the client answers still takes one sample, from
+// the last flush, and data already buffered is not one
+TEST(web_socket_rtt_one_sample_per_answer) {
+  esphome::host::use_virtual_clock(true);
+  ScriptedNetwork network;
+  TestSocket s;
+  auto c = std::make_shared<ScriptedClient>();
+  c->latency_us = 20000;
+  c->send({0x01}, 2);
+  c->send({0x02, 0x03}, 0);
+  c->close_at_end = false;
+  s.set_port(328);
+  s.start();
+  network.connect(c);
+  for (int i = 0; i < 1000 && !s.handle(); i++) esphome::delay(1);
+  REQUIRE(s.status == WebSocketConnected);
+
+  uint8_t b;
+  REQUIRE(s.read(&b));
+  REQUIRE(s.write(0x10) && s.flush());
+  esphome::delay(5);
+  REQUIRE(s.write(0x11) && s.flush());
+  CHECK(s.rtt_pending());
+  // Nothing queued, nothing to time
+  REQUIRE(s.flush());
+
+  REQUIRE(s.read(&b));
+  CHECK_EQ(b, 0x02);
+  CHECK(!s.rtt_pending());
+  uint32_t srtt = s.get_srtt_us();
+  CHECK(srtt >= 40000 && srtt <= 42000);
+
+  // The next byte came with the same read
+  REQUIRE(s.write(0x12) && s.flush());
+  CHECK(!s.rtt_pending());
+  REQUIRE(s.read(&b));
+  CHECK_EQ(b, 0x03);
+  // A second sample would have moved the deviation off its first value
+  CHECK_EQ(s.get_srtt_us(), srtt);
+  CHECK_EQ(s.get_rttvar_us(), srtt / 2);
+  s.stop();
+}
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+"""Stream an image to an avr_ota port using the native upload protocol.
+
+The whole image is sent in one go and the ESP programs, verifies and
+answers once, so there is no per-page round trip like with avrdude.
+See components/avr_ota/native_commands.h for the wire format.
+
+    $ tools/avr_ota_upload.py 192.168.1.50 firmware.hex --signature 1e950f --pagesize 128
+    $ tools/avr_ota_upload.py 192.168.1.50 firmware.bin --compress
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+import zlib
+
+NATIVE_MAGIC = 0xA5
+NATIVE_VERSION = 1
+NATIVE_VERSION_COMPRESSED = 2
+
+COMPRESS_NONE = 0x00
+COMPRESS_HEATSHRINK = 0x01
+
+# Heatshrink parameters. The ESP keeps a window of at most 2^10 bytes
+WINDOW_BITS = 10
+LOOKAHEAD_BITS = 4
+
+FORMAT_RAW = 0x00
+FORMAT_IHEX = 0x01
+
+FLAG_ERASE = 0x01
+FLAG_VERIFY = 0x02
+
+STATUS = {
+    0x00: "ok",
+    0x01: "bad header",
+    0x02: "target did not sync",
+    0x03: "signature mismatch",
+    0x04: "Intel HEX error",
+    0x05: "image data out of page order",
+    0x06: "page write failed",
+    0x07: "verify failed",
+    0x08: "CRC mismatch",
+    0x09: "connection lost",
+    0x0A: "programmer busy with another client",
+}
+
+# Signature and page sizes of common parts, used when not given explicitly
+PARTS = {
+    "m328p": (0x1E950F, 128, 4),
+    "m328": (0x1E9514, 128, 4),
+    "m168": (0x1E9406, 128, 4),
+    "m88": (0x1E930A, 64, 4),
+    "m32u4": (0x1E9587, 128, 4),
+    "m1280": (0x1E9703, 256, 8),
+    "m2560": (0x1E9801, 256, 8),
+}
+
+
+def heatshrink(data, window_bits=WINDOW_BITS, lookahead_bits=LOOKAHEAD_BITS):
+    """Compress data in the heatshrink LZSS format.
+
+    Each item is a 1 bit and a literal byte, or a 0 bit, the distance - 1 in
+    window_bits and the length - 1 in lookahead_bits, all most significant
+    bit first. Matches are found through the positions of 2 byte prefixes.
+    """
+    window = 1 << window_bits
+    longest = 1 << lookahead_bits
+    out = bytearray()
+    acc = 0
+    nbits = 0
+
+    def put(value, bits):
+        nonlocal acc, nbits
+        acc = acc << bits | value
+        nbits += bits
+        while nbits >= 8:
+            nbits -= 8
+            out.append(acc >> nbits & 0xFF)
+        acc &= (1 << nbits) - 1
+
+    prefixes = {}
+    i = 0
+    while i < len(data):
+        best_len, best_dist = 0, 0
+        for j in reversed(prefixes.get(data[i : i + 2], [])[-64:]):
+            if i - j > window:
+                break
+            n = 0
+            while n < longest and i + n < len(data) and data[j + n] == data[i + n]:
+                n += 1
+            if n > best_len:
+                best_len, best_dist = n, i - j
+                if n == longest:
+                    break
+        # A reference costs 1 + window_bits + lookahead_bits, a literal 9
+        step = best_len if best_len * 9 > 1 + window_bits + lookahead_bits else 1
+        if step > 1:
+            put(0, 1)
+            put(best_dist - 1, window_bits)
+            put(best_len - 1, lookahead_bits)
+        else:
+            put(1, 1)
+            put(data[i], 8)
+        for k in range(i, i + step):
+            prefixes.setdefault(data[k : k + 2], []).append(k)
+        i += step
+    if nbits:
+        put(0, 8 - nbits)
+    return bytes(out)
+
+
+def build_header(args, payload):
+    memtype = b"E" if args.memory == "eeprom" else b"F"
+    fmt = FORMAT_IHEX if args.format == "hex" else FORMAT_RAW
+    flags = 0
+    if not args.no_erase:
+        flags |= FLAG_ERASE
+    if not args.no_verify:
+        flags |= FLAG_VERIFY
+    signature = args.signature.to_bytes(3, "big")
+    return struct.pack(
+        ">B3sBcBB3sBHBBII",
+        NATIVE_MAGIC,
+        b"AVR",
+        NATIVE_VERSION_COMPRESSED if args.compress else NATIVE_VERSION,
+        memtype,
+        fmt,
+        flags,
+        signature,
+        COMPRESS_HEATSHRINK if args.compress else COMPRESS_NONE,
+        args.pagesize,
+        WINDOW_BITS if args.compress else 0,
+        LOOKAHEAD_BITS if args.compress else 0,
+        len(payload),
+        zlib.crc32(payload) & 0xFFFFFFFF,
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host", help="address of the ESP")
+    parser.add_argument("image", help="Intel HEX (.hex) or raw binary image")
+    parser.add_argument("--port", type=int, default=328, help="avr_ota port (default 328)")
+    parser.add_argument("--part", default="m328p", choices=sorted(PARTS), help="target part (default m328p)")
+    parser.add_argument("--signature", type=lambda v: int(v, 16), help="expected signature in hex, 0 to skip")
+    parser.add_argument("--pagesize", type=int, help="page size in bytes")
+    parser.add_argument("--memory", choices=["flash", "eeprom"], default="flash")
+    parser.add_argument("--format", choices=["hex", "raw"], help="payload format (default from extension)")
+    parser.add_argument("--no-erase", action="store_true", help="skip the chip erase before writing flash")
+    parser.add_argument("--no-verify", action="store_true", help="skip reading back each page")
+    parser.add_argument("--compress", action="store_true", help="send the image heatshrink compressed")
+    parser.add_argument("--timeout", type=float, default=60.0, help="seconds to wait for the reply")
+    args = parser.parse_args()
+
+    signature, flash_page, eeprom_page = PARTS[args.part]
+    if args.signature is None:
+        args.signature = signature
+    if args.pagesize is None:
+        args.pagesize = eeprom_page if args.memory == "eeprom" else flash_page
+    if args.format is None:
+        args.format = "hex" if args.image.lower().endswith((".hex", ".ihex", ".ihx")) else "raw"
+
+    with open(args.image, "rb") as f:
+        payload = f.read()
+    size = len(payload)
+    if args.compress:
+        payload = heatshrink(payload)
+        print(f"compressed {size} bytes to {len(payload)} ({size / max(len(payload), 1):.1f}x)")
+
+    header = build_header(args, payload)
+    started = time.monotonic()
+    with socket.create_connection((args.host, args.port), timeout=args.timeout) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.sendall(header + payload)
+
+        reply = b""
+        while len(reply) < 8:
+            data = sock.recv(8 - len(reply))
+            if not data:
+                sys.exit("connection closed before the reply")
+            reply += data
+    elapsed = time.monotonic() - started
+
+    magic, status, pages, device_ms = struct.unpack(">BBHI", reply)
+    if magic != NATIVE_MAGIC:
+        sys.exit(f"unexpected reply {reply.hex()}")
+    print(
+        f"{STATUS.get(status, hex(status))}: {pages} pages, {size} bytes ({len(payload)} sent) in {elapsed:.2f} s "
+        f"({size / 1024 / elapsed:.2f} KB/s, {device_ms} ms on the ESP)"
+    )
+    sys.exit(0 if status == 0 else 1)
+
+
+if __name__ == "__main__":
+    main()